@@ -9,10 +9,18 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
+    | NAME '(' (arg (',' arg)*)? ')'  # Function
+    | SHEET? CELL  # Cell
     | NUMBER  # Literal
     ;
 
+// ranges and text literals are only meaningful as function arguments
+arg
+    : CELL ':' CELL  # Range
+    | STRING  # Text
+    | expr  # Argument
+    ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +35,14 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// declared after CELL, so that A1 is a cell and not a name
+NAME: [A-Za-z_] [A-Za-z0-9_]* ;
+// a quote inside a text literal is doubled
+STRING: '"' (~'"' | '""')* '"' ;
+// sheet prefix of a cell reference: Sheet1!A1 or 'Sheet name'!A1,
+// a quote inside a quoted name is doubled
+SHEET
+    : [A-Za-z_] [A-Za-z0-9_]* '!'
+    | '\'' (~'\'' | '\'\'')+ '\'' '!'
+    ;
 WS: [ \t\n\r]+ -> skip ;
@@ -3,9 +3,17 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "memory_usage.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
@@ -72,10 +80,35 @@ public:
     virtual ~Expr() = default;
     virtual void Print(std::ostream& out) const = 0;
     virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const std::function<double(Position)>& args) const = 0;
+    virtual FormulaAST::Value Evaluate(const FormulaAST::Args& args) const = 0;
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
+    // memory taken by the node itself, operands excluded
+    virtual size_t GetBytes() const = 0;
+
+    // operands of an operation, empty for atoms
+    virtual std::vector<std::unique_ptr<Expr>*> GetOperands() {
+        return {};
+    }
+    // a subexpression that is evaluated once per sheet
+    virtual bool IsShared() const {
+        return false;
+    }
+    // a range of cells, only valid as a function argument
+    virtual const Rect* GetRange() const {
+        return nullptr;
+    }
+
+    // the value used as a lookup key: unlike Evaluate, a cell or a text
+    // literal keeps its text
+    virtual CellInterface::Value EvaluateKey(const FormulaAST::Args& args) const {
+        const auto value = Evaluate(args);
+        if (const auto* number = std::get_if<double>(&value)) {
+            return *number;
+        }
+        return std::get<FormulaError>(value);
+    }
 
     void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
                       bool right_child = false) const {
@@ -95,7 +128,13 @@ public:
 };
 
 namespace {
-class BinaryOpExpr final : public Expr {
+// A chain of binary operations of the same precedence, such as A1+B1-C1
+// or A1*B1/C1. The chain is flat: a formula with thousands of terms is one
+// node with thousands of operands, so printing and evaluating it loops
+// over the operands instead of recursing through a tree as deep as the
+// formula is long. Operations are applied left to right, exactly as in a
+// left-associative tree of binary operations.
+class ChainExpr final : public Expr {
 public:
     enum Type : char {
         Add = '+',
@@ -105,28 +144,83 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-        : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+    explicit ChainExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs) {
+        operands_.push_back(std::move(lhs));
+        Append(type, std::move(rhs));
+    }
+
+    // whether an operation can continue the chain
+    bool Accepts(Type type) const {
+        return IsAdditive(type) == IsAdditive(types_.front());
+    }
+
+    void Append(Type type, std::unique_ptr<Expr> rhs) {
+        types_.push_back(type);
+        operands_.push_back(std::move(rhs));
     }
 
     void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
+        // prints the same as the equivalent tree of binary operations
+        for (auto it = types_.rbegin(); it != types_.rend(); ++it) {
+            out << '(' << static_cast<char>(*it) << ' ';
+        }
+        operands_.front()->Print(out);
+        for (size_t i = 1; i < operands_.size(); ++i) {
+            out << ' ';
+            operands_[i]->Print(out);
+            out << ')';
+        }
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        operands_.front()->PrintFormula(out, GetPrecedence(types_.front()));
+        for (size_t i = 1; i < operands_.size(); ++i) {
+            out << static_cast<char>(types_[i - 1]);
+            operands_[i]->PrintFormula(out, GetPrecedence(types_[i - 1]), /* right_child = */ true);
+        }
     }
 
     ExprPrecedence GetPrecedence() const override {
-        switch (type_) {
+        // the last operation is the top of the equivalent tree
+        return GetPrecedence(types_.back());
+    }
+
+    size_t GetBytes() const override {
+        return sizeof(*this) + operands_.capacity() * sizeof(operands_[0])
+            + types_.capacity() * sizeof(types_[0]);
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& args) const override {
+        auto result = operands_.front()->Evaluate(args);
+        for (size_t i = 1; i < operands_.size(); ++i) {
+            if (std::holds_alternative<FormulaError>(result)) {
+                return result;
+            }
+            const auto rhs = operands_[i]->Evaluate(args);
+            if (std::holds_alternative<FormulaError>(rhs)) {
+                return rhs;
+            }
+            result = Apply(types_[i - 1], std::get<double>(result), std::get<double>(rhs));
+        }
+        return result;
+    }
+
+    std::vector<std::unique_ptr<Expr>*> GetOperands() override {
+        std::vector<std::unique_ptr<Expr>*> result;
+        result.reserve(operands_.size());
+        for (auto& operand : operands_) {
+            result.push_back(&operand);
+        }
+        return result;
+    }
+
+private:
+    static bool IsAdditive(Type type) {
+        return type == Add || type == Subtract;
+    }
+
+    static ExprPrecedence GetPrecedence(Type type) {
+        switch (type) {
             case Add:
                 return EP_ADD;
             case Subtract:
@@ -142,29 +236,37 @@ public:
         }
     }
 
-    double Evaluate(const std::function<double(Position)>& args) const override {
-        switch (type_) {
+    static FormulaAST::Value Apply(Type type, double lhs, double rhs) {
+        double result = 0.0;
+        switch (type) {
             case Add:
-                return lhs_->Evaluate(args) + rhs_->Evaluate(args);
+                result = lhs + rhs;
+                break;
             case Subtract:
-                return lhs_->Evaluate(args) - rhs_->Evaluate(args);
+                result = lhs - rhs;
+                break;
             case Multiply:
-                return lhs_->Evaluate(args) * rhs_->Evaluate(args);
+                result = lhs * rhs;
+                break;
             case Divide:
-                if (rhs_->Evaluate(args) == 0)
-                {
-                    throw FormulaError(FormulaError::Category::Div0);
+                if (rhs == 0) {
+                    return FormulaError(FormulaError::Category::Div0);
                 }
-                return lhs_->Evaluate(args) / rhs_->Evaluate(args);
+                result = lhs / rhs;
+                break;
             default:
-                throw std::invalid_argument("unknown operation");
+                assert(false);
+        }
+        // an overflow is reported the same way as a division by zero
+        if (!std::isfinite(result)) {
+            return FormulaError(FormulaError::Category::Div0);
         }
+        return result;
     }
 
-private:
-    Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    std::vector<std::unique_ptr<Expr>> operands_;
+    // types_[i] joins operands_[i] and operands_[i + 1]
+    std::vector<Type> types_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -195,15 +297,20 @@ public:
         return EP_UNARY;
     }
 
-    double Evaluate(const std::function<double(Position)>& args) const override {
-        switch (type_) {
-            case UnaryPlus:
-                return operand_->Evaluate(args);
-            case UnaryMinus:
-                return -operand_->Evaluate(args);
-            default:
-                throw std::invalid_argument("unknown operation");
+    size_t GetBytes() const override {
+        return sizeof(*this);
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& args) const override {
+        const auto operand = operand_->Evaluate(args);
+        if (type_ == UnaryMinus && std::holds_alternative<double>(operand)) {
+            return -std::get<double>(operand);
         }
+        return operand;
+    }
+
+    std::vector<std::unique_ptr<Expr>*> GetOperands() override {
+        return {&operand_};
     }
 
 private:
@@ -217,10 +324,18 @@ public:
         : cell_(cell) {
     }
 
+    explicit CellExpr(const SheetPosition* sheet_cell)
+        : cell_(&sheet_cell->pos)
+        , sheet_cell_(sheet_cell) {
+    }
+
     void Print(std::ostream& out) const override {
         if (!cell_->IsValid()) {
             out << FormulaError::Category::Ref;
         } else {
+            if (sheet_cell_ != nullptr) {
+                out << FormatSheetName(sheet_cell_->sheet) << '!';
+            }
             out << cell_->ToString();
         }
     }
@@ -233,12 +348,28 @@ public:
         return EP_ATOM;
     }
 
-    double Evaluate(const std::function<double(Position)>& args) const override {
-        return args(*cell_);
+    size_t GetBytes() const override {
+        return sizeof(*this);
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& args) const override {
+        if (sheet_cell_ != nullptr) {
+            return args.sheet_cell(*sheet_cell_);
+        }
+        return args.cell(*cell_);
+    }
+
+    CellInterface::Value EvaluateKey(const FormulaAST::Args& args) const override {
+        if (sheet_cell_ != nullptr) {
+            return Expr::EvaluateKey(args);
+        }
+        return args.value(*cell_);
     }
 
 private:
     const Position* cell_;
+    // set for references qualified with a sheet name
+    const SheetPosition* sheet_cell_ = nullptr;
 };
 
 class NumberExpr final : public Expr {
@@ -248,18 +379,26 @@ public:
     }
 
     void Print(std::ostream& out) const override {
-        out << value_;
+        // the shortest form that reads back as the same number,
+        // so that the formula text does not lose precision
+        char chars[32];
+        const auto result = std::to_chars(std::begin(chars), std::end(chars), value_);
+        out.write(chars, result.ptr - chars);
     }
 
     void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+        Print(out);
     }
 
     ExprPrecedence GetPrecedence() const override {
         return EP_ATOM;
     }
 
-    double Evaluate(const std::function<double(Position)>& args) const override {
+    size_t GetBytes() const override {
+        return sizeof(*this);
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& /* args */) const override {
         return value_;
     }
 
@@ -267,6 +406,386 @@ private:
     double value_;
 };
 
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Rect* range)
+        : range_(range) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << range_->ToString();
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetBytes() const override {
+        return sizeof(*this);
+    }
+
+    const Rect* GetRange() const override {
+        return range_;
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& /* args */) const override {
+        // a range has no single value
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+private:
+    const Rect* range_;
+};
+
+class TextExpr final : public Expr {
+public:
+    explicit TextExpr(std::string text)
+        : text_(std::move(text)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '"';
+        for (char c : text_) {
+            if (c == '"') {
+                out << c;
+            }
+            out << c;
+        }
+        out << '"';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetBytes() const override {
+        return sizeof(*this) + GetHeapBytes(text_);
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& /* args */) const override {
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+    CellInterface::Value EvaluateKey(const FormulaAST::Args& /* args */) const override {
+        return text_;
+    }
+
+private:
+    std::string text_;
+};
+
+// Lookup and aggregate functions. Ranges are searched and totalled through
+// the sheet, which keeps indexes and running totals of the ranges used by
+// formulas, so neither an exact lookup nor a total scans the range.
+class FunctionExpr final : public Expr {
+public:
+    enum Type {
+        Match,    // MATCH(key, range[, type]): a 1-based position in a row or column
+        VLookup,  // VLOOKUP(key, range, column[, sorted]): a cell of the matching row
+        XLookup,  // XLOOKUP(key, range, result range[, if not found])
+        Sum,      // SUM(a, ...), COUNT, MIN and MAX: each argument is a range or a number
+        Count,
+        Min,
+        Max,
+    };
+
+    struct Signature {
+        const char* name;
+        Type type;
+        size_t min_args;
+        size_t max_args;
+        // a bit is set for each argument that must be a range
+        unsigned ranges;
+        // any argument may be either a range or a number
+        bool mixed;
+    };
+
+    static constexpr size_t MAX_ARGS = 255;
+
+    static constexpr Signature SIGNATURES[] = {
+        {"MATCH", Match, 2, 3, 0b010, false},
+        {"VLOOKUP", VLookup, 3, 4, 0b010, false},
+        {"XLOOKUP", XLookup, 3, 4, 0b110, false},
+        {"SUM", Sum, 1, MAX_ARGS, 0, true},
+        {"COUNT", Count, 1, MAX_ARGS, 0, true},
+        {"MIN", Min, 1, MAX_ARGS, 0, true},
+        {"MAX", Max, 1, MAX_ARGS, 0, true},
+    };
+
+public:
+    FunctionExpr(const Signature& signature, std::vector<std::unique_ptr<Expr>> operands)
+        : signature_(signature)
+        , operands_(std::move(operands)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << '(' << signature_.name;
+        for (const auto& operand : operands_) {
+            out << ' ';
+            operand->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << signature_.name << '(';
+        for (size_t i = 0; i < operands_.size(); ++i) {
+            if (i > 0) {
+                out << ',';
+            }
+            operands_[i]->PrintFormula(out, EP_ATOM);
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    size_t GetBytes() const override {
+        return sizeof(*this) + operands_.capacity() * sizeof(operands_[0]);
+    }
+
+    std::vector<std::unique_ptr<Expr>*> GetOperands() override {
+        std::vector<std::unique_ptr<Expr>*> result;
+        for (auto& operand : operands_) {
+            result.push_back(&operand);
+        }
+        return result;
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& args) const override {
+        switch (signature_.type) {
+            case Sum:
+                return EvaluateAggregate(Aggregate::Sum, args);
+            case Count:
+                return EvaluateAggregate(Aggregate::Count, args);
+            case Min:
+                return EvaluateAggregate(Aggregate::Min, args);
+            case Max:
+                return EvaluateAggregate(Aggregate::Max, args);
+            default:
+                break;
+        }
+        const auto key = operands_[0]->EvaluateKey(args);
+        if (const auto* error = std::get_if<FormulaError>(&key)) {
+            return *error;
+        }
+        switch (signature_.type) {
+            case Match:
+                return EvaluateMatch(key, args);
+            case VLookup:
+                return EvaluateVLookup(key, args);
+            case XLookup:
+                return EvaluateXLookup(key, args);
+            default:
+                break;
+        }
+        assert(false);
+        return FormulaError(FormulaError::Category::Value);
+    }
+
+private:
+    FormulaAST::Value EvaluateAggregate(Aggregate type, const FormulaAST::Args& args) const {
+        constexpr double INF = std::numeric_limits<double>::infinity();
+        double result = type == Aggregate::Min ? INF : type == Aggregate::Max ? -INF : 0.0;
+        const auto combine = [type, &result](double value) {
+            if (type == Aggregate::Min) {
+                result = std::min(result, value);
+            } else if (type == Aggregate::Max) {
+                result = std::max(result, value);
+            } else {
+                result += value;
+            }
+        };
+        for (const auto& operand : operands_) {
+            if (const Rect* range = operand->GetRange()) {
+                const auto total = args.aggregate(*range, type);
+                if (const auto* error = std::get_if<FormulaError>(&total)) {
+                    return *error;
+                }
+                combine(std::get<double>(total));
+                continue;
+            }
+            const auto value = operand->Evaluate(args);
+            if (const auto* error = std::get_if<FormulaError>(&value)) {
+                // COUNT counts numbers and skips errors
+                if (type == Aggregate::Count) {
+                    continue;
+                }
+                return *error;
+            }
+            combine(type == Aggregate::Count ? 1.0 : std::get<double>(value));
+        }
+        // MIN and MAX of no numbers are zero
+        if ((type == Aggregate::Min || type == Aggregate::Max) && std::isinf(result)) {
+            return 0.0;
+        }
+        if (!std::isfinite(result)) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+        return result;
+    }
+
+    FormulaAST::Value EvaluateMatch(const CellInterface::Value& key,
+                                    const FormulaAST::Args& args) const {
+        const Rect& range = *operands_[1]->GetRange();
+        if (range.size.rows > 1 && range.size.cols > 1) {
+            return FormulaError(FormulaError::Category::NA);
+        }
+        MatchType type = MatchType::Less;
+        if (operands_.size() > 2) {
+            const auto value = operands_[2]->Evaluate(args);
+            if (std::holds_alternative<FormulaError>(value)) {
+                return value;
+            }
+            const double number = std::get<double>(value);
+            type = number == 0 ? MatchType::Exact : number > 0 ? MatchType::Less : MatchType::Greater;
+        }
+        const int offset = args.match(key, range, type);
+        if (offset < 0) {
+            return FormulaError(FormulaError::Category::NA);
+        }
+        return double(offset + 1);
+    }
+
+    FormulaAST::Value EvaluateVLookup(const CellInterface::Value& key,
+                                      const FormulaAST::Args& args) const {
+        const Rect& range = *operands_[1]->GetRange();
+        const auto column = operands_[2]->Evaluate(args);
+        if (std::holds_alternative<FormulaError>(column)) {
+            return column;
+        }
+        const double col = std::get<double>(column);
+        if (col < 1) {
+            return FormulaError(FormulaError::Category::Value);
+        }
+        if (col >= range.size.cols + 1) {
+            return FormulaError(FormulaError::Category::Ref);
+        }
+        MatchType type = MatchType::Less;
+        if (operands_.size() > 3) {
+            const auto sorted = operands_[3]->Evaluate(args);
+            if (std::holds_alternative<FormulaError>(sorted)) {
+                return sorted;
+            }
+            type = std::get<double>(sorted) != 0 ? MatchType::Less : MatchType::Exact;
+        }
+        // the first column of a one-row range is a single cell
+        const Rect keys = range.size.rows > 1 ? range : Rect{range.top_left, {1, 1}};
+        const int offset = args.match(key, keys, type);
+        if (offset < 0) {
+            return FormulaError(FormulaError::Category::NA);
+        }
+        return args.cell({range.top_left.row + offset, range.top_left.col + int(col) - 1});
+    }
+
+    FormulaAST::Value EvaluateXLookup(const CellInterface::Value& key,
+                                      const FormulaAST::Args& args) const {
+        const Rect& range = *operands_[1]->GetRange();
+        const Rect& result = *operands_[2]->GetRange();
+        const bool by_row = range.size.rows == 1;
+        const bool same_shape = by_row
+            ? result.size.rows == 1 && result.size.cols == range.size.cols
+            : range.size.cols == 1 && result.size.cols == 1 && result.size.rows == range.size.rows;
+        if (!same_shape) {
+            return FormulaError(FormulaError::Category::Value);
+        }
+        const int offset = args.match(key, range, MatchType::Exact);
+        if (offset < 0) {
+            if (operands_.size() > 3) {
+                return operands_[3]->Evaluate(args);
+            }
+            return FormulaError(FormulaError::Category::NA);
+        }
+        const Position& top_left = result.top_left;
+        return args.cell(by_row ? Position{top_left.row, top_left.col + offset}
+                                : Position{top_left.row + offset, top_left.col});
+    }
+
+    const Signature& signature_;
+    std::vector<std::unique_ptr<Expr>> operands_;
+};
+
+// Stands in for a subexpression whose value is computed and cached once
+// for the whole sheet; see FormulaAST::ShareSubexpressions.
+class SharedExpr final : public Expr {
+public:
+    SharedExpr(ExprPrecedence precedence, FormulaAST::Shared shared)
+        : precedence_(precedence)
+        , shared_(std::move(shared)) {
+    }
+
+    void Print(std::ostream& out) const override {
+        out << shared_.text;
+    }
+
+    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+        out << shared_.text;
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return precedence_;
+    }
+
+    size_t GetBytes() const override {
+        return sizeof(*this);
+    }
+
+    bool IsShared() const override {
+        return true;
+    }
+
+    FormulaAST::Value Evaluate(const FormulaAST::Args& /* args */) const override {
+        return shared_.value();
+    }
+
+private:
+    // precedence of the replaced subexpression, so that the formula prints
+    // with the same parentheses
+    ExprPrecedence precedence_;
+    FormulaAST::Shared shared_;
+};
+
+// Whether the value of the expression depends on any cell.
+bool DependsOnCells(Expr& expr) {
+    std::vector<Expr*> stack{&expr};
+    while (!stack.empty()) {
+        Expr* node = stack.back();
+        stack.pop_back();
+        const auto operands = node->GetOperands();
+        if (operands.empty()
+            && (node->IsShared() || node->GetRange() != nullptr || dynamic_cast<CellExpr*>(node) != nullptr)) {
+            return true;
+        }
+        for (auto* operand : operands) {
+            stack.push_back(operand->get());
+        }
+    }
+    return false;
+}
+
+// Operands of the root that are worth sharing: operations (or already
+// shared subexpressions) whose value depends on cells.
+std::vector<std::unique_ptr<Expr>*> GetShareableOperands(Expr& root) {
+    std::vector<std::unique_ptr<Expr>*> result;
+    for (auto* operand : root.GetOperands()) {
+        Expr& expr = **operand;
+        if ((expr.IsShared() || !expr.GetOperands().empty()) && DependsOnCells(expr)) {
+            result.push_back(operand);
+        }
+    }
+    return result;
+}
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     std::unique_ptr<Expr> MoveRoot() {
@@ -281,6 +800,14 @@ public:
         return std::move(cells_);
     }
 
+    std::forward_list<SheetPosition> MoveSheetCells() {
+        return std::move(sheet_cells_);
+    }
+
+    std::forward_list<Rect> MoveRanges() {
+        return std::move(ranges_);
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -319,8 +846,14 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
+        std::unique_ptr<CellExpr> node;
+        if (ctx->SHEET()) {
+            sheet_cells_.push_front({ParseSheetName(ctx->SHEET()->getSymbol()->getText()), value});
+            node = std::make_unique<CellExpr>(&sheet_cells_.front());
+        } else {
+            cells_.push_front(value);
+            node = std::make_unique<CellExpr>(&cells_.front());
+        }
         args_.push_back(std::move(node));
     }
 
@@ -330,22 +863,92 @@ public:
         auto rhs = std::move(args_.back());
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        auto& lhs = args_.back();
 
-        BinaryOpExpr::Type type;
+        ChainExpr::Type type;
         if (ctx->ADD()) {
-            type = BinaryOpExpr::Add;
+            type = ChainExpr::Add;
         } else if (ctx->SUB()) {
-            type = BinaryOpExpr::Subtract;
+            type = ChainExpr::Subtract;
         } else if (ctx->MUL()) {
-            type = BinaryOpExpr::Multiply;
+            type = ChainExpr::Multiply;
         } else {
             assert(ctx->DIV() != nullptr);
-            type = BinaryOpExpr::Divide;
+            type = ChainExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        // the grammar is left-associative, so the left operand of an
+        // operation is the chain built so far; parentheses around it do not
+        // change the order of evaluation, so (A1+B1)+C1 is chained too
+        auto* chain = dynamic_cast<ChainExpr*>(lhs.get());
+        if (chain != nullptr && chain->Accepts(type)) {
+            chain->Append(type, std::move(rhs));
+        } else {
+            lhs = std::make_unique<ChainExpr>(type, std::move(lhs), std::move(rhs));
+        }
+    }
+
+    void exitFunction(FormulaParser::FunctionContext* ctx) override {
+        const size_t count = ctx->arg().size();
+        assert(args_.size() >= count);
+
+        std::string name = ctx->NAME()->getSymbol()->getText();
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) {
+            return std::toupper(c);
+        });
+        const auto* signature = std::find_if(std::begin(FunctionExpr::SIGNATURES),
+                                             std::end(FunctionExpr::SIGNATURES),
+                                             [&name](const auto& signature) {
+                                                 return name == signature.name;
+                                             });
+        if (signature == std::end(FunctionExpr::SIGNATURES)) {
+            throw ParsingError("Unknown function: " + name);
+        }
+        if (count < signature->min_args || count > signature->max_args) {
+            throw ParsingError("Wrong number of arguments: " + name);
+        }
+
+        std::vector<std::unique_ptr<Expr>> operands(std::make_move_iterator(args_.end() - count),
+                                                    std::make_move_iterator(args_.end()));
+        args_.erase(args_.end() - count, args_.end());
+        for (size_t i = 0; i < count; ++i) {
+            const bool range_expected = (signature->ranges >> i & 1) != 0;
+            if (!signature->mixed && range_expected != (operands[i]->GetRange() != nullptr)) {
+                throw ParsingError("Wrong argument " + std::to_string(i + 1) + ": " + name);
+            }
+            // only a lookup key may be a text
+            if ((i > 0 || signature->mixed) && dynamic_cast<TextExpr*>(operands[i].get()) != nullptr) {
+                throw ParsingError("Wrong argument " + std::to_string(i + 1) + ": " + name);
+            }
+        }
+        args_.push_back(std::make_unique<FunctionExpr>(*signature, std::move(operands)));
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        const auto lhs_str = ctx->CELL(0)->getSymbol()->getText();
+        const auto rhs_str = ctx->CELL(1)->getSymbol()->getText();
+        const auto lhs = Position::FromString(lhs_str);
+        const auto rhs = Position::FromString(rhs_str);
+        if (!lhs.IsValid() || !rhs.IsValid()) {
+            throw FormulaException("Invalid range: " + lhs_str + ':' + rhs_str);
+        }
+        // the corners may be given in any order
+        const Position top_left{std::min(lhs.row, rhs.row), std::min(lhs.col, rhs.col)};
+        const Size size{std::abs(lhs.row - rhs.row) + 1, std::abs(lhs.col - rhs.col) + 1};
+        ranges_.push_front({top_left, size});
+        args_.push_back(std::make_unique<RangeExpr>(&ranges_.front()));
+    }
+
+    void exitText(FormulaParser::TextContext* ctx) override {
+        const auto token = ctx->STRING()->getSymbol()->getText();
+        std::string text;
+        for (size_t i = 1; i + 1 < token.size(); ++i) {
+            text += token[i];
+            if (token[i] == '"') {
+                ++i;  // skip the second quote of a doubled pair
+            }
+        }
+        args_.push_back(std::make_unique<TextExpr>(std::move(text)));
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -353,10 +956,85 @@ public:
     }
 
 private:
+    // turns the SHEET token (name followed by '!') into the sheet name
+    static std::string ParseSheetName(const std::string& token) {
+        std::string_view name(token);
+        name.remove_suffix(1);
+        if (name.front() != '\'') {
+            return std::string(name);
+        }
+        name = name.substr(1, name.size() - 2);
+        std::string result;
+        for (size_t i = 0; i < name.size(); ++i) {
+            result += name[i];
+            if (name[i] == '\'') {
+                ++i;  // skip the second quote of a doubled pair
+            }
+        }
+        return result;
+    }
+
     std::vector<std::unique_ptr<Expr>> args_;
     std::forward_list<Position> cells_;
+    std::forward_list<SheetPosition> sheet_cells_;
+    std::forward_list<Rect> ranges_;
 };
 
+// Formulas nested deeper are rejected before parsing: the parser, the
+// printer and the evaluator recurse on nesting. The length of a formula
+// does not matter, a chain of operations is flat.
+constexpr int MAX_NESTING = 256;
+
+// The deepest nesting of a formula: parentheses, including those of
+// function calls, and unary operators, each of which wraps its operand.
+int GetNestingDepth(std::string_view text) {
+    // the depth that each open parenthesis added, with the unary operators
+    // before it
+    std::vector<int> opened;
+    int depth = 0;
+    int max_depth = 0;
+    // unary operators before the current operand
+    int unary = 0;
+    // the last character that is not a space, '\0' at the start
+    char prev = '\0';
+    for (size_t i = 0; i < text.size(); ++i) {
+        const char c = text[i];
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            // a text or a quoted sheet name, a quote inside is doubled
+            for (++i; i < text.size(); ++i) {
+                if (text[i] == c && (i + 1 == text.size() || text[i + 1] != c)) {
+                    break;
+                }
+                if (text[i] == c) {
+                    ++i;
+                }
+            }
+            unary = 0;
+        } else if (c == '(') {
+            opened.push_back(unary + 1);
+            depth += opened.back();
+            max_depth = std::max(max_depth, depth);
+            unary = 0;
+        } else if (c == ')') {
+            if (!opened.empty()) {
+                depth -= opened.back();
+                opened.pop_back();
+            }
+        } else if ((c == '+' || c == '-') && std::strchr("(,+-*/", prev) != nullptr) {
+            // prev is '\0' at the start, and strchr finds the terminator
+            ++unary;
+            max_depth = std::max(max_depth, depth + unary);
+        } else if (std::strchr("*/,:", c) == nullptr) {
+            unary = 0;
+        }
+        prev = c;
+    }
+    return max_depth;
+}
+
 class BailErrorListener : public antlr4::BaseErrorListener {
 public:
     void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
@@ -371,9 +1049,18 @@ public:
 }  // namespace ASTImpl
 
 FormulaAST ParseFormulaAST(std::istream& in) {
+    const std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(text);
+}
+
+FormulaAST ParseFormulaAST(const std::string& in_str) {
     using namespace antlr4;
 
-    ANTLRInputStream input(in);
+    if (ASTImpl::GetNestingDepth(in_str) > ASTImpl::MAX_NESTING) {
+        throw ParsingError("Formula is nested too deeply");
+    }
+
+    ANTLRInputStream input(in_str);
 
     FormulaLexer lexer(&input);
     ASTImpl::BailErrorListener error_listener;
@@ -387,16 +1074,29 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.setErrorHandler(error_handler);
     parser.removeErrorListeners();
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    // SLL prediction is linear and suffices for almost every formula; the
+    // full LL prediction reruns only when SLL fails, which may also be a
+    // real syntax error
+    auto* interpreter = parser.getInterpreter<atn::ParserATNSimulator>();
+    interpreter->setPredictionMode(atn::PredictionMode::SLL);
+    tree::ParseTree* tree = nullptr;
+    try {
+        tree = parser.main();
+    } catch (const ParseCancellationException&) {
+        tokens.seek(0);
+        parser.reset();
+        interpreter->setPredictionMode(atn::PredictionMode::LL);
+        tree = parser.main();
+    }
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
-}
+    // a chain of N operations is a parse tree N levels deep, so the tree is
+    // walked without recursion
+    ASTImpl::ParseASTListener listener;
+    tree::IterativeParseTreeWalker walker;
+    walker.walk(&listener, tree);
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveSheetCells(),
+                      listener.MoveRanges());
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -413,14 +1113,86 @@ void FormulaAST::PrintFormula(std::ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const std::function<double(Position)>& args) const {
+FormulaAST::Value FormulaAST::Execute(const Args& args) const {
     return root_expr_->Evaluate(args);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+std::vector<std::string> FormulaAST::GetSubexpressions() const {
+    std::vector<std::string> result;
+    for (auto* operand : ASTImpl::GetShareableOperands(*root_expr_)) {
+        std::ostringstream out;
+        (*operand)->PrintFormula(out, ASTImpl::EP_ATOM);
+        result.push_back(out.str());
+    }
+    return result;
+}
+
+void FormulaAST::ShareSubexpressions(std::vector<Shared> shared) {
+    auto operands = ASTImpl::GetShareableOperands(*root_expr_);
+    assert(operands.size() == shared.size());
+    for (size_t i = 0; i < operands.size(); ++i) {
+        if (!shared[i].value) {
+            continue;
+        }
+        auto& operand = *operands[i];
+        operand = std::make_unique<ASTImpl::SharedExpr>(operand->GetPrecedence(), std::move(shared[i]));
+    }
+}
+
+FormulaAST::MemoryUsage FormulaAST::GetMemoryUsage() const {
+    MemoryUsage usage;
+    std::vector<ASTImpl::Expr*> stack{root_expr_.get()};
+    while (!stack.empty()) {
+        ASTImpl::Expr* node = stack.back();
+        stack.pop_back();
+        ++usage.nodes;
+        usage.node_bytes += node->GetBytes();
+        for (auto* operand : node->GetOperands()) {
+            stack.push_back(operand->get());
+        }
+    }
+    // a forward_list node is a link and a value
+    for (const auto& cell : cells_) {
+        ++usage.list_nodes;
+        usage.list_bytes += sizeof(void*) + sizeof(cell);
+    }
+    for (const auto& sheet_cell : sheet_cells_) {
+        ++usage.list_nodes;
+        usage.list_bytes += sizeof(void*) + sizeof(sheet_cell) + GetHeapBytes(sheet_cell.sheet);
+    }
+    for (const auto& range : ranges_) {
+        ++usage.list_nodes;
+        usage.list_bytes += sizeof(void*) + sizeof(range);
+    }
+    return usage;
+}
+
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                       std::forward_list<SheetPosition> sheet_cells, std::forward_list<Rect> ranges)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , sheet_cells_(std::move(sheet_cells))
+    , ranges_(std::move(ranges)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    sheet_cells_.sort();
+}
+
+std::string FormatSheetName(std::string_view name) {
+    const bool plain = !name.empty() && (std::isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_')
+        && std::all_of(name.begin(), name.end(), [](char c) {
+               return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+           });
+    if (plain) {
+        return std::string(name);
+    }
+    std::string result = "'";
+    for (char c : name) {
+        result += c;
+        if (c == '\'') {
+            result += c;
+        }
+    }
+    return result + "'";
 }
 
 FormulaAST::~FormulaAST() = default;
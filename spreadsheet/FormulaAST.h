@@ -6,6 +6,9 @@
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
@@ -17,13 +20,56 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
+    // evaluation result: errors are passed by value
+    // instead of unwinding the stack with exceptions
+    using Value = std::variant<double, FormulaError>;
+
+    // callbacks that provide the values of referenced cells
+    struct Args {
+        std::function<Value(Position)> cell;
+        std::function<Value(const SheetPosition&)> sheet_cell;
+        // the value of a cell as is, text included: a lookup key
+        std::function<CellInterface::Value(Position)> value;
+        // the offset of a key in a range or -1, see SheetInterface::Match
+        std::function<int(const CellInterface::Value&, const Rect&, MatchType)> match;
+        // a total of a range, see SheetInterface::GetAggregate
+        std::function<std::variant<double, FormulaError>(const Rect&, Aggregate)> aggregate;
+    };
+
+    // a subexpression evaluated elsewhere, once for the whole sheet
+    struct Shared {
+        // an empty function keeps the subexpression in the tree
+        std::function<Value()> value;
+        // canonical text, must outlive the AST
+        std::string_view text;
+    };
+
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+                        std::forward_list<Position> cells,
+                        std::forward_list<SheetPosition> sheet_cells = {},
+                        std::forward_list<Rect> ranges = {});
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(const std::function<double(Position)>& args) const;
+    Value Execute(const Args& args) const;
+
+    // Canonical texts of the operands of the top-level operation that
+    // depend on cells: the candidates for sharing between formulas.
+    std::vector<std::string> GetSubexpressions() const;
+    // Replaces the subexpressions listed by GetSubexpressions, in the same
+    // order, with the values computed elsewhere and frees their subtrees.
+    void ShareSubexpressions(std::vector<Shared> shared);
+    struct MemoryUsage {
+        size_t nodes = 0;
+        size_t node_bytes = 0;
+        // nodes of the reference lists
+        size_t list_nodes = 0;
+        size_t list_bytes = 0;
+    };
+    // Walks the tree without recursion, so it is linear in the formula size.
+    MemoryUsage GetMemoryUsage() const;
+
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
@@ -36,6 +82,16 @@ public:
         return cells_;
     }
 
+    // references qualified with a sheet name, sorted
+    const std::forward_list<SheetPosition>& GetSheetCells() const {
+        return sheet_cells_;
+    }
+
+    // ranges passed to functions, in no particular order
+    const std::forward_list<Rect>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
@@ -43,7 +99,13 @@ private:
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    std::forward_list<SheetPosition> sheet_cells_;
+    std::forward_list<Rect> ranges_;
 };
 
+// Formats a sheet name as it is written before '!' in a formula,
+// quoting it when needed.
+std::string FormatSheetName(std::string_view name);
+
 FormulaAST ParseFormulaAST(std::istream& in);
 FormulaAST ParseFormulaAST(const std::string& in_str);
@@ -0,0 +1,200 @@
+#include "aggregate.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+constexpr double INF = std::numeric_limits<double>::infinity();
+constexpr double NOT_NUMBER = std::numeric_limits<double>::quiet_NaN();
+}  // namespace
+
+std::optional<double> GetAggregateNumber(const CellInterface::Value& value) {
+    if (const auto* number = std::get_if<double>(&value))
+    {
+        return *number;
+    }
+    if (const auto* text = std::get_if<std::string>(&value))
+    {
+        return ParseNumber(*text);
+    }
+    return std::nullopt;
+}
+
+RangeTotals::RangeTotals(int size, const CellAt& cell_at)
+    : size_(size)
+    , numbers_(size, NOT_NUMBER) {
+    for (int offset = 0; offset < size_; ++offset)
+    {
+        if (const CellInterface* cell = cell_at(offset))
+        {
+            formulas_.Track(offset, cell);
+            Assign(offset, cell->GetValue());
+        }
+    }
+}
+
+void RangeTotals::Update(int offset, const CellInterface* cell) {
+    // значение формулы придёт в Refresh после вычисления
+    if (formulas_.Track(offset, cell) || cell == nullptr)
+    {
+        Assign(offset, CellInterface::Value());
+        return;
+    }
+    Assign(offset, cell->GetValue());
+}
+
+void RangeTotals::Refresh(const CellInterface* cell) {
+    if (const auto offset = formulas_.Find(cell))
+    {
+        Assign(*offset, cell->GetValue());
+    }
+}
+
+std::variant<double, FormulaError> RangeTotals::Get(Aggregate type) {
+    if (type == Aggregate::Count)
+    {
+        return double(count_);
+    }
+    if (!errors_.empty())
+    {
+        return errors_.begin()->second;
+    }
+    if (type == Aggregate::Sum)
+    {
+        return sum_ + compensation_;
+    }
+    if (min_tree_.empty())
+    {
+        BuildTrees();
+    }
+    return type == Aggregate::Min ? min_tree_[1] : max_tree_[1];
+}
+
+void RangeTotals::Assign(int offset, const CellInterface::Value& value) {
+    const double old = numbers_[offset];
+    if (!std::isnan(old))
+    {
+        Add(-old);
+        --count_;
+    }
+    errors_.erase(offset);
+    double number = NOT_NUMBER;
+    if (const auto* error = std::get_if<FormulaError>(&value))
+    {
+        errors_.emplace(offset, *error);
+    }
+    else if (const auto parsed = GetAggregateNumber(value))
+    {
+        number = *parsed;
+        Add(number);
+        ++count_;
+    }
+    numbers_[offset] = number;
+    if (count_ == 0)
+    {
+        // без чисел сумма точно нулевая, а накопленная ошибка сбрасывается
+        sum_ = 0.0;
+        compensation_ = 0.0;
+    }
+    if (!min_tree_.empty() && !(std::isnan(old) && std::isnan(number)))
+    {
+        UpdateTrees(offset);
+    }
+}
+
+void RangeTotals::Add(double term) {
+    const double sum = sum_ + term;
+    if (std::abs(sum_) >= std::abs(term))
+    {
+        compensation_ += (sum_ - sum) + term;
+    }
+    else
+    {
+        compensation_ += (term - sum) + sum_;
+    }
+    sum_ = sum;
+}
+
+void RangeTotals::BuildTrees() {
+    // у дерева из одного листа корень - сам лист
+    const size_t leaves = std::max(size_, 2);
+    min_tree_.assign(2 * leaves, INF);
+    max_tree_.assign(2 * leaves, -INF);
+    for (int offset = 0; offset < size_; ++offset)
+    {
+        if (!std::isnan(numbers_[offset]))
+        {
+            min_tree_[leaves + offset] = numbers_[offset];
+            max_tree_[leaves + offset] = numbers_[offset];
+        }
+    }
+    for (size_t node = leaves - 1; node > 0; --node)
+    {
+        min_tree_[node] = std::min(min_tree_[2 * node], min_tree_[2 * node + 1]);
+        max_tree_[node] = std::max(max_tree_[2 * node], max_tree_[2 * node + 1]);
+    }
+}
+
+void RangeTotals::UpdateTrees(int offset) {
+    const size_t leaves = min_tree_.size() / 2;
+    size_t node = leaves + offset;
+    const double number = numbers_[offset];
+    min_tree_[node] = std::isnan(number) ? INF : number;
+    max_tree_[node] = std::isnan(number) ? -INF : number;
+    for (node /= 2; node > 0; node /= 2)
+    {
+        min_tree_[node] = std::min(min_tree_[2 * node], min_tree_[2 * node + 1]);
+        max_tree_[node] = std::max(max_tree_[2 * node], max_tree_[2 * node + 1]);
+    }
+}
+
+std::variant<double, FormulaError> SheetInterface::GetAggregate(Rect range, Aggregate type) const {
+    double sum = 0.0;
+    double count = 0.0;
+    double min = INF;
+    double max = -INF;
+    std::optional<FormulaError> error;
+    for (int row = range.top_left.row; row < range.top_left.row + range.size.rows; ++row)
+    {
+        for (int col = range.top_left.col; col < range.top_left.col + range.size.cols; ++col)
+        {
+            const CellInterface* cell = GetCell({row, col});
+            if (cell == nullptr)
+            {
+                continue;
+            }
+            const auto value = cell->GetValue();
+            if (const auto* cell_error = std::get_if<FormulaError>(&value))
+            {
+                error = error.value_or(*cell_error);
+            }
+            else if (const auto number = GetAggregateNumber(value))
+            {
+                sum += *number;
+                count += 1;
+                min = std::min(min, *number);
+                max = std::max(max, *number);
+            }
+        }
+    }
+    if (type == Aggregate::Count)
+    {
+        return count;
+    }
+    if (error)
+    {
+        return *error;
+    }
+    switch (type)
+    {
+    case Aggregate::Sum:
+        return sum;
+    case Aggregate::Min:
+        return min;
+    case Aggregate::Max:
+        return max;
+    default:
+        return count;
+    }
+}
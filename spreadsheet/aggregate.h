@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+#include "range_formulas.h"
+
+#include <functional>
+#include <map>
+#include <optional>
+#include <variant>
+#include <vector>
+
+// Числовое значение ячейки для итогов области: число или текст, который
+// целиком читается как число. У остального значения числа нет.
+std::optional<double> GetAggregateNumber(const CellInterface::Value& value);
+
+// Итоги области, которые поддерживаются при каждом изменении её ячеек, а не
+// считаются заново: сумма и число чисел обновляются разностью старого и
+// нового значения за O(1), минимум и максимум - деревом отрезков за
+// O(log n). Ячейки нумеруются смещением по строкам области, значения
+// формул учитываются через RangeFormulas. Деревья строятся при первом
+// запросе минимума или максимума.
+class RangeTotals {
+public:
+    // Ячейка области по смещению или nullptr.
+    using CellAt = std::function<const CellInterface*(int)>;
+
+    // Ячейки области к этому моменту должны быть вычислены.
+    RangeTotals(int size, const CellAt& cell_at);
+
+    // Учитывает новое содержимое ячейки по смещению offset.
+    void Update(int offset, const CellInterface* cell);
+    // Учитывает новое значение формулы, если она входит в область.
+    void Refresh(const CellInterface* cell);
+    std::variant<double, FormulaError> Get(Aggregate type);
+
+private:
+    void Assign(int offset, const CellInterface::Value& value);
+    // Прибавляет слагаемое к сумме с компенсацией ошибки округления
+    // (алгоритм Ноймайера), чтобы сумма не копила ошибку от правок.
+    void Add(double term);
+    void BuildTrees();
+    void UpdateTrees(int offset);
+
+    int size_;
+    // число каждой ячейки или NaN
+    std::vector<double> numbers_;
+    // ошибки ячеек по смещению: итог - первая из них по строкам области
+    std::map<int, FormulaError> errors_;
+    RangeFormulas formulas_;
+    double sum_ = 0.0;
+    double compensation_ = 0.0;
+    size_t count_ = 0;
+    // деревья отрезков: листья с индекса size_, у узла i дети 2i и 2i+1
+    std::vector<double> min_tree_;
+    std::vector<double> max_tree_;
+};
@@ -0,0 +1,499 @@
+#include "arrow_writer.h"
+#include "aggregate.h"
+
+#include <algorithm>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+namespace {
+// Метаданные Arrow записаны во flatbuffers. Здесь только то, что нужно
+// для схемы, пачек и оглавления: таблицы, векторы структур и таблиц,
+// строки. Объекты пишутся от начала буфера к концу, дочерние - после
+// родителя, поэтому все смещения положительные.
+struct FlatObject;
+using FlatPtr = std::unique_ptr<FlatObject>;
+
+struct FlatField {
+    int slot;
+    // байты скаляра; пусто для ссылки на дочерний объект
+    std::string scalar;
+    size_t align;
+    FlatPtr child;
+};
+
+struct FlatObject {
+    enum Kind {
+        Table,
+        Structs,
+        Tables,
+        String,
+    };
+
+    Kind kind;
+    // поля таблицы
+    std::vector<FlatField> fields;
+    // элементы вектора структур или текст строки
+    std::string bytes;
+    size_t count = 0;
+    size_t align = 4;
+    // элементы вектора таблиц
+    std::vector<FlatPtr> items;
+
+    template <typename T>
+    FlatObject& Add(int slot, T value) {
+        std::string scalar(sizeof(T), '\0');
+        std::memcpy(scalar.data(), &value, sizeof(T));
+        fields.push_back({slot, std::move(scalar), sizeof(T), nullptr});
+        return *this;
+    }
+
+    FlatObject& Add(int slot, FlatPtr child) {
+        fields.push_back({slot, {}, 4, std::move(child)});
+        return *this;
+    }
+};
+
+FlatPtr MakeTable() {
+    auto object = std::make_unique<FlatObject>();
+    object->kind = FlatObject::Table;
+    return object;
+}
+
+FlatPtr MakeString(std::string_view text) {
+    auto object = std::make_unique<FlatObject>();
+    object->kind = FlatObject::String;
+    object->bytes = std::string(text);
+    return object;
+}
+
+// bytes - подряд записанные структуры по size байт с выравниванием 8.
+FlatPtr MakeStructs(std::string bytes, size_t size) {
+    auto object = std::make_unique<FlatObject>();
+    object->kind = FlatObject::Structs;
+    object->count = bytes.size() / size;
+    object->bytes = std::move(bytes);
+    object->align = 8;
+    return object;
+}
+
+FlatPtr MakeTables(std::vector<FlatPtr> items) {
+    auto object = std::make_unique<FlatObject>();
+    object->kind = FlatObject::Tables;
+    object->items = std::move(items);
+    return object;
+}
+
+template <typename T>
+void Append(std::string& out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+template <typename T>
+void Store(std::string& out, size_t at, T value) {
+    std::memcpy(out.data() + at, &value, sizeof(T));
+}
+
+void AlignTo(std::string& out, size_t align) {
+    out.resize((out.size() + align - 1) / align * align, '\0');
+}
+
+class FlatEncoder {
+public:
+    std::string Encode(const FlatObject& root) {
+        out_.assign(sizeof(uint32_t), '\0');
+        Write(root, 0);
+        return std::move(out_);
+    }
+
+private:
+    // Пишет объект в конец буфера и ставит смещение на него в ячейку at.
+    void Write(const FlatObject& object, size_t at) {
+        size_t position = 0;
+        switch (object.kind)
+        {
+        case FlatObject::Table:
+            position = WriteTable(object);
+            break;
+        case FlatObject::Structs:
+            // элементы выравниваются, а длина стоит прямо перед ними
+            while ((out_.size() + sizeof(uint32_t)) % object.align != 0)
+            {
+                out_.push_back('\0');
+            }
+            position = out_.size();
+            Append(out_, uint32_t(object.count));
+            out_ += object.bytes;
+            break;
+        case FlatObject::Tables:
+            AlignTo(out_, 4);
+            position = out_.size();
+            Append(out_, uint32_t(object.items.size()));
+            out_.resize(out_.size() + 4 * object.items.size(), '\0');
+            for (size_t i = 0; i < object.items.size(); ++i)
+            {
+                Write(*object.items[i], position + 4 + 4 * i);
+            }
+            break;
+        case FlatObject::String:
+            AlignTo(out_, 4);
+            position = out_.size();
+            Append(out_, uint32_t(object.bytes.size()));
+            out_ += object.bytes;
+            out_.push_back('\0');
+            break;
+        }
+        Store(out_, at, uint32_t(position - at));
+    }
+
+    size_t WriteTable(const FlatObject& table) {
+        // поля по убыванию выравнивания, чтобы не было лишних пропусков;
+        // начало таблицы выровнено на 8, поэтому выровнены и поля
+        std::vector<const FlatField*> fields;
+        for (const auto& field : table.fields)
+        {
+            fields.push_back(&field);
+        }
+        std::stable_sort(fields.begin(), fields.end(), [](const FlatField* lhs, const FlatField* rhs) {
+            return lhs->align > rhs->align;
+        });
+        int slots = 0;
+        for (const FlatField* field : fields)
+        {
+            slots = std::max(slots, field->slot + 1);
+        }
+        std::vector<uint16_t> offsets(slots, 0);
+        size_t size = sizeof(int32_t);
+        for (const FlatField* field : fields)
+        {
+            size = (size + field->align - 1) / field->align * field->align;
+            offsets[field->slot] = uint16_t(size);
+            size += field->child != nullptr ? sizeof(uint32_t) : field->scalar.size();
+        }
+
+        AlignTo(out_, 2);
+        const size_t vtable = out_.size();
+        Append(out_, uint16_t(2 * (2 + slots)));
+        Append(out_, uint16_t(size));
+        for (const uint16_t offset : offsets)
+        {
+            Append(out_, offset);
+        }
+        AlignTo(out_, 8);
+        const size_t position = out_.size();
+        out_.resize(position + size, '\0');
+        Store(out_, position, int32_t(position - vtable));
+        for (const FlatField* field : fields)
+        {
+            if (field->child == nullptr)
+            {
+                std::memcpy(out_.data() + position + offsets[field->slot],
+                            field->scalar.data(), field->scalar.size());
+            }
+        }
+        for (const FlatField* field : fields)
+        {
+            if (field->child != nullptr)
+            {
+                Write(*field->child, position + offsets[field->slot]);
+            }
+        }
+        return position;
+    }
+
+    std::string out_;
+};
+
+// Значения из схем Arrow (Schema.fbs, Message.fbs, File.fbs).
+constexpr int16_t METADATA_V5 = 4;
+constexpr uint8_t HEADER_SCHEMA = 1;
+constexpr uint8_t HEADER_RECORD_BATCH = 3;
+constexpr uint8_t TYPE_INT = 2;
+constexpr uint8_t TYPE_FLOATING_POINT = 3;
+constexpr uint8_t TYPE_UTF8 = 5;
+constexpr int16_t PRECISION_DOUBLE = 2;
+constexpr uint32_t CONTINUATION = 0xFFFFFFFF;
+constexpr std::string_view MAGIC("ARROW1", 6);
+
+std::string ColumnName(int col) {
+    std::string name = Position{0, col}.ToString();
+    name.pop_back();  // номер первой строки
+    return name;
+}
+
+FlatPtr MakeField(std::string_view name, uint8_t type_type, FlatPtr type) {
+    auto field = MakeTable();
+    field->Add(0, MakeString(name))
+        .Add(1, true)  // nullable
+        .Add(2, type_type)
+        .Add(3, std::move(type))
+        .Add(5, MakeTables({}));  // children
+    return field;
+}
+
+FlatPtr MakeSchema(int first_col, int cols) {
+    std::string categories;
+    for (int category = 0; category <= int(FormulaError::Category::NA); ++category)
+    {
+        if (category > 0)
+        {
+            categories += ',';
+        }
+        categories += FormulaError(FormulaError::Category(category)).ToString();
+    }
+    std::vector<FlatPtr> fields;
+    for (int col = first_col; col < first_col + cols; ++col)
+    {
+        const std::string name = ColumnName(col);
+        auto number = MakeTable();
+        number->Add(0, PRECISION_DOUBLE);
+        fields.push_back(MakeField(name, TYPE_FLOATING_POINT, std::move(number)));
+        fields.push_back(MakeField(name + "_text", TYPE_UTF8, MakeTable()));
+        auto code = MakeTable();
+        code->Add(0, int32_t(8)).Add(1, true);  // bitWidth, is_signed
+        auto error = MakeField(name + "_error", TYPE_INT, std::move(code));
+        auto key_value = MakeTable();
+        key_value->Add(0, MakeString("categories")).Add(1, MakeString(categories));
+        std::vector<FlatPtr> metadata;
+        metadata.push_back(std::move(key_value));
+        error->Add(6, MakeTables(std::move(metadata)));
+        fields.push_back(std::move(error));
+    }
+    auto schema = MakeTable();
+    schema->Add(0, int16_t(0))  // little-endian
+        .Add(1, MakeTables(std::move(fields)));
+    return schema;
+}
+
+std::string EncodeMessage(uint8_t header_type, FlatPtr header, int64_t body_length) {
+    auto message = MakeTable();
+    message->Add(0, METADATA_V5)
+        .Add(1, header_type)
+        .Add(2, std::move(header))
+        .Add(3, body_length);
+    return FlatEncoder().Encode(*message);
+}
+
+// Тело пачки: буферы полей подряд, каждый с выравниванием 8, и их
+// описание для заголовка.
+class BatchBody {
+public:
+    // Открывает поле из rows строк: битовая маска заполненных строк.
+    void BeginField(size_t rows) {
+        validity_.assign((rows + 7) / 8, '\0');
+        nulls_ = rows;
+        rows_ = rows;
+    }
+
+    void SetValid(size_t row) {
+        validity_[row / 8] |= char(1 << (row % 8));
+        --nulls_;
+    }
+
+    // Закрывает поле: маска и буферы значений.
+    void EndField(std::initializer_list<std::string_view> buffers) {
+        Append(nodes_, int64_t(rows_));
+        Append(nodes_, int64_t(nulls_));
+        AddBuffer(validity_);
+        for (const auto buffer : buffers)
+        {
+            AddBuffer(buffer);
+        }
+    }
+
+    FlatPtr MakeHeader() {
+        auto batch = MakeTable();
+        batch->Add(0, int64_t(rows_))
+            .Add(1, MakeStructs(std::move(nodes_), 16))
+            .Add(2, MakeStructs(std::move(buffers_), 16));
+        return batch;
+    }
+
+    const std::string& GetBytes() const {
+        return body_;
+    }
+
+private:
+    void AddBuffer(std::string_view bytes) {
+        Append(buffers_, int64_t(body_.size()));
+        Append(buffers_, int64_t(bytes.size()));
+        body_ += bytes;
+        AlignTo(body_, 8);
+    }
+
+    std::string validity_;
+    size_t nulls_ = 0;
+    size_t rows_ = 0;
+    std::string nodes_;
+    std::string buffers_;
+    std::string body_;
+};
+}  // namespace
+
+ArrowWriter::ArrowWriter(std::ostream& output, int first_col, int cols, ArrowFormat format)
+    : output_(output)
+    , first_col_(first_col)
+    , cols_(cols)
+    , format_(format) {
+    if (cols_ <= 0 || !Position{0, first_col_}.IsValid() || !Position{0, first_col_ + cols_ - 1}.IsValid())
+    {
+        throw InvalidPositionException("invalid columns");
+    }
+    if (format_ == ArrowFormat::File)
+    {
+        std::string magic(MAGIC);
+        AlignTo(magic, 8);
+        Write(magic);
+    }
+    WriteMessage(EncodeMessage(HEADER_SCHEMA, MakeSchema(first_col_, cols_), 0), {});
+}
+
+void ArrowWriter::WriteBatch(const Sheet& sheet, int row_begin, int row_end) {
+    if (finished_)
+    {
+        throw std::logic_error("ArrowWriter is finished");
+    }
+    const Rect rect{{row_begin, first_col_}, {row_end - row_begin, cols_}};
+    const size_t rows = size_t(rect.size.rows);
+    std::vector<CellInterface::Value> values(rows * cols_);
+    sheet.GetValues(rect, values.data(), Sheet::Order::ColumnMajor);
+
+    BatchBody body;
+    std::string numbers;
+    std::string offsets;
+    std::string text;
+    std::string codes;
+    for (int col = 0; col < cols_; ++col)
+    {
+        const CellInterface::Value* column = values.data() + col * rows;
+        // числа
+        body.BeginField(rows);
+        numbers.assign(rows * sizeof(double), '\0');
+        std::vector<bool> is_number(rows, false);
+        for (size_t row = 0; row < rows; ++row)
+        {
+            const auto number = GetAggregateNumber(column[row]);
+            if (!number)
+            {
+                continue;
+            }
+            if (std::holds_alternative<std::string>(column[row]))
+            {
+                const CellInterface* cell = sheet.GetCell({row_begin + int(row), first_col_ + col});
+                if (cell->GetTextView()[0] == ESCAPE_SIGN)
+                {
+                    continue;
+                }
+            }
+            std::memcpy(numbers.data() + row * sizeof(double), &*number, sizeof(double));
+            is_number[row] = true;
+            body.SetValid(row);
+        }
+        body.EndField({numbers});
+        // текст
+        body.BeginField(rows);
+        offsets.clear();
+        text.clear();
+        Append(offsets, int32_t(0));
+        for (size_t row = 0; row < rows; ++row)
+        {
+            const auto* value = std::get_if<std::string>(&column[row]);
+            if (value != nullptr && !value->empty() && !is_number[row])
+            {
+                text += *value;
+                body.SetValid(row);
+            }
+            Append(offsets, int32_t(text.size()));
+        }
+        body.EndField({offsets, text});
+        // ошибки
+        body.BeginField(rows);
+        codes.assign(rows, '\0');
+        for (size_t row = 0; row < rows; ++row)
+        {
+            if (const auto* error = std::get_if<FormulaError>(&column[row]))
+            {
+                codes[row] = char(error->GetCategory());
+                body.SetValid(row);
+            }
+        }
+        body.EndField({codes});
+    }
+
+    const int64_t offset = written_;
+    const std::string& bytes = body.GetBytes();
+    const int32_t metadata_length =
+        WriteMessage(EncodeMessage(HEADER_RECORD_BATCH, body.MakeHeader(), int64_t(bytes.size())), bytes);
+    blocks_.push_back({offset, metadata_length, int64_t(bytes.size())});
+}
+
+void ArrowWriter::Finish() {
+    if (finished_)
+    {
+        return;
+    }
+    finished_ = true;
+    std::string end;
+    Append(end, CONTINUATION);
+    Append(end, int32_t(0));
+    Write(end);
+    if (format_ == ArrowFormat::File)
+    {
+        std::string blocks;
+        for (const Block& block : blocks_)
+        {
+            Append(blocks, block.offset);
+            Append(blocks, block.metadata_length);
+            Append(blocks, int32_t(0));  // выравнивание структуры
+            Append(blocks, block.body_length);
+        }
+        auto footer = MakeTable();
+        footer->Add(0, METADATA_V5)
+            .Add(1, MakeSchema(first_col_, cols_))
+            .Add(2, MakeStructs({}, 24))  // словарей нет
+            .Add(3, MakeStructs(std::move(blocks), 24));
+        std::string tail = FlatEncoder().Encode(*footer);
+        Append(tail, int32_t(tail.size()));
+        tail += MAGIC;
+        Write(tail);
+    }
+    output_.flush();
+}
+
+int32_t ArrowWriter::WriteMessage(const std::string& metadata, const std::string& body) {
+    // метаданные дополняются так, чтобы тело начиналось с кратного 8 места
+    std::string frame;
+    Append(frame, CONTINUATION);
+    Append(frame, int32_t(0));
+    frame += metadata;
+    AlignTo(frame, 8);
+    Store(frame, sizeof(uint32_t), int32_t(frame.size() - 8));
+    Write(frame);
+    Write(body);
+    return int32_t(frame.size());
+}
+
+void ArrowWriter::Write(const std::string& bytes) {
+    output_.write(bytes.data(), std::streamsize(bytes.size()));
+    written_ += int64_t(bytes.size());
+}
+
+void ExportArrow(const Sheet& sheet, Rect rect, std::ostream& output, ArrowFormat format, int batch_rows) {
+    if (batch_rows <= 0)
+    {
+        throw std::invalid_argument("batch_rows must be positive");
+    }
+    ArrowWriter writer(output, rect.top_left.col, rect.size.cols, format);
+    for (int row = rect.top_left.row; row < rect.top_left.row + rect.size.rows; row += batch_rows)
+    {
+        writer.WriteBatch(sheet, row, std::min(row + batch_rows, rect.top_left.row + rect.size.rows));
+    }
+    writer.Finish();
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Формат выгрузки Arrow IPC.
+enum class ArrowFormat {
+    Stream,  // поток сообщений: схема, пачки строк и признак конца
+    File,    // файл Arrow: тот же поток между метками ARROW1 и оглавление
+             // пачек в конце, для чтения через отображение в память
+};
+
+// Выгрузка прямоугольной области листа по столбцам в формате Arrow IPC
+// (версия метаданных V5), без внешних зависимостей. Каждому столбцу листа
+// соответствуют три поля:
+// * "A" - float64: числа, то есть значения формул и текст, который целиком
+//   читается как число (кроме экранированного апострофом);
+// * "A_text" - utf8: остальной текст;
+// * "A_error" - int8: категория ошибки формулы, номер FormulaError::Category;
+//   тексты категорий перечислены в метаданных поля "categories".
+// В каждой строке заполнено не больше одного из трёх полей, у пустой ячейки
+// все три пусты (null). Данные пишутся пачками строк (record batch) сразу
+// в поток, поэтому выгрузка не держит в памяти больше одной пачки, а
+// читатель может обрабатывать пачки по мере поступления. Числа пишутся в
+// порядке байтов машины, которая должна быть little-endian.
+class ArrowWriter {
+public:
+    // Пишет схему для столбцов [first_col, first_col + cols).
+    ArrowWriter(std::ostream& output, int first_col, int cols,
+                ArrowFormat format = ArrowFormat::File);
+
+    ArrowWriter(const ArrowWriter&) = delete;
+    ArrowWriter& operator=(const ArrowWriter&) = delete;
+
+    // Пишет строки [row_begin, row_end) столбцов схемы одной пачкой.
+    // Невычисленные формулы вычисляются одним проходом.
+    void WriteBatch(const Sheet& sheet, int row_begin, int row_end);
+    // Завершает выгрузку: признак конца потока и, для файла, оглавление.
+    void Finish();
+
+private:
+    // Пишет сообщение с заголовком metadata и телом body, возвращает
+    // длину метаданных в кадре.
+    int32_t WriteMessage(const std::string& metadata, const std::string& body);
+    void Write(const std::string& bytes);
+
+    // Место пачки в файле, для оглавления.
+    struct Block {
+        int64_t offset;
+        int32_t metadata_length;
+        int64_t body_length;
+    };
+
+    std::ostream& output_;
+    int first_col_;
+    int cols_;
+    ArrowFormat format_;
+    int64_t written_ = 0;
+    std::vector<Block> blocks_;
+    bool finished_ = false;
+};
+
+// Выгружает область rect пачками по batch_rows строк.
+void ExportArrow(const Sheet& sheet, Rect rect, std::ostream& output,
+                 ArrowFormat format = ArrowFormat::File, int batch_rows = 65536);
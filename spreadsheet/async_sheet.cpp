@@ -0,0 +1,144 @@
+#include "async_sheet.h"
+
+#include "cell.h"
+
+#include <algorithm>
+
+AsyncSheet::AsyncSheet()
+    : worker_([this] { Run(); }) {
+}
+
+AsyncSheet::~AsyncSheet() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+    worker_.join();
+}
+
+AsyncSheet::Version AsyncSheet::SetCell(Position pos, std::string text) {
+    std::lock_guard lock(mutex_);
+    sheet_.SetCell(pos, std::move(text));
+    return Edited();
+}
+
+AsyncSheet::Version AsyncSheet::ClearCell(Position pos) {
+    std::lock_guard lock(mutex_);
+    sheet_.ClearCell(pos);
+    return Edited();
+}
+
+AsyncSheet::Version AsyncSheet::Edited() {
+    ++version_;
+    changed_.notify_all();
+    return version_;
+}
+
+AsyncSheet::VersionedValue AsyncSheet::GetValue(Position pos) const {
+    std::lock_guard lock(mutex_);
+    VersionedValue result;
+    result.version = version_;
+    const Cell* cell = sheet_.GetCellRef(pos);
+    if (cell == nullptr)
+    {
+        result.value = "";
+        return result;
+    }
+    const auto last_value = cell->GetLastValue();
+    if (last_value)
+    {
+        result.value = *last_value;
+        result.current = !cell->IsDirty();
+    }
+    else if (sheet_.Evaluate(Rect{pos, Size{1, 1}}, EvalBudget::For(RECALC_SLICE)))
+    {
+        result.value = cell->GetValue();
+    }
+    else
+    {
+        result.value = "";
+        result.current = false;
+    }
+    return result;
+}
+
+AsyncSheet::Version AsyncSheet::GetVersion() const {
+    std::lock_guard lock(mutex_);
+    return version_;
+}
+
+AsyncSheet::Version AsyncSheet::GetCalculatedVersion() const {
+    std::lock_guard lock(mutex_);
+    return calculated_version_;
+}
+
+std::future<AsyncSheet::Version> AsyncSheet::WhenCalculated(Version version) {
+    std::lock_guard lock(mutex_);
+    std::promise<Version> promise;
+    auto future = promise.get_future();
+    if (calculated_version_ >= version)
+    {
+        promise.set_value(calculated_version_);
+    }
+    else
+    {
+        waiters_.emplace_back(version, std::move(promise));
+    }
+    return future;
+}
+
+void AsyncSheet::SetPriorityRects(std::vector<Rect> rects) {
+    std::lock_guard lock(mutex_);
+    sheet_.SetPriorityRects(std::move(rects));
+}
+
+void AsyncSheet::PrintValues(std::ostream& output) const {
+    std::lock_guard lock(mutex_);
+    sheet_.PrintValues(output);
+}
+
+void AsyncSheet::PrintTexts(std::ostream& output) const {
+    std::lock_guard lock(mutex_);
+    sheet_.PrintTexts(output);
+}
+
+void AsyncSheet::Run() {
+    std::unique_lock lock(mutex_);
+    while (true)
+    {
+        changed_.wait(lock, [this] {
+            return stop_ || calculated_version_ != version_;
+        });
+        if (stop_)
+        {
+            return;
+        }
+        // между отрезками блокировка отпускается, чтобы правки и чтения не
+        // ждали окончания всего пересчёта
+        while (!stop_ && sheet_.RecalculateDirty(RECALC_BATCH, EvalBudget::For(RECALC_SLICE)) > 0)
+        {
+            lock.unlock();
+            std::this_thread::yield();
+            lock.lock();
+        }
+        if (stop_)
+        {
+            return;
+        }
+        // устаревших формул не осталось, значит пересчитана текущая версия
+        calculated_version_ = version_;
+        NotifyWaiters();
+    }
+}
+
+void AsyncSheet::NotifyWaiters() {
+    auto ready = std::partition(waiters_.begin(), waiters_.end(), [this](const auto& waiter) {
+        return waiter.first > calculated_version_;
+    });
+    for (auto it = ready; it != waiters_.end(); ++it)
+    {
+        it->second.set_value(calculated_version_);
+    }
+    waiters_.erase(ready, waiters_.end());
+}
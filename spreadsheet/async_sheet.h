@@ -0,0 +1,86 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Таблица с фоновым пересчётом.
+// Правки только сбрасывают кеш зависимых формул и сразу возвращают номер
+// новой версии; пересчёт выполняет фоновый поток короткими отрезками по
+// времени, отпуская блокировку между ними. Чтение возвращает последнее вычисленное значение
+// и сообщает, актуально ли оно. Все методы потокобезопасны.
+class AsyncSheet {
+public:
+    using Version = uint64_t;
+
+    struct VersionedValue {
+        CellInterface::Value value;
+        // версия таблицы на момент чтения
+        Version version = 0;
+        // false, если формула ещё ждёт пересчёта и значение устарело
+        bool current = true;
+    };
+
+    AsyncSheet();
+    // Останавливает фоновый поток; незавершённые ожидания версий получают
+    // исключение std::future_error.
+    ~AsyncSheet();
+
+    AsyncSheet(const AsyncSheet&) = delete;
+    AsyncSheet& operator=(const AsyncSheet&) = delete;
+
+    // Работают как одноимённые методы SheetInterface и возвращают номер
+    // версии, получившейся после правки.
+    Version SetCell(Position pos, std::string text);
+    Version ClearCell(Position pos);
+
+    // Формула, которая ещё ни разу не вычислялась, вычисляется сразу, но не
+    // дольше RECALC_SLICE; если этого не хватило, значение пустое и
+    // неактуальное, а следующие чтения продолжают вычисление.
+    VersionedValue GetValue(Position pos) const;
+
+    // Номер последней правки.
+    Version GetVersion() const;
+    // Версия, для которой все формулы пересчитаны.
+    Version GetCalculatedVersion() const;
+
+    // Завершается, когда пересчитана версия не ниже version. Значение -
+    // фактически пересчитанная версия.
+    std::future<Version> WhenCalculated(Version version);
+
+    // Видимые области, см. Sheet::SetPriorityRects: после правки фоновый
+    // поток пересчитывает их первыми.
+    void SetPriorityRects(std::vector<Rect> rects);
+
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+private:
+    // Сколько устаревших формул фоновый поток берёт в один пересчёт.
+    static constexpr size_t RECALC_BATCH = 256;
+    // Сколько времени пересчёт занимает блокировку за раз: длинные цепочки
+    // зависимостей вычисляются по частям, не задерживая правки и чтения.
+    static constexpr std::chrono::microseconds RECALC_SLICE{500};
+
+    Version Edited();
+    void Run();
+    void NotifyWaiters();
+
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    Sheet sheet_;
+    Version version_ = 0;
+    Version calculated_version_ = 0;
+    std::vector<std::pair<Version, std::promise<Version>>> waiters_;
+    bool stop_ = false;
+    // запускается последним, когда остальные поля уже готовы
+    std::thread worker_;
+};
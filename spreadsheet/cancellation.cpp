@@ -0,0 +1,40 @@
+#include "cancellation.h"
+
+void CancellationToken::Cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+}
+
+bool CancellationToken::IsCancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+}
+
+void CancellationToken::Reset() {
+    cancelled_.store(false, std::memory_order_relaxed);
+}
+
+EvalBudget::EvalBudget(Clock::time_point deadline, const CancellationToken* token)
+    : deadline_(deadline)
+    , token_(token) {}
+
+EvalBudget::EvalBudget(const CancellationToken& token)
+    : token_(&token) {}
+
+EvalBudget EvalBudget::For(Clock::duration timeout, const CancellationToken* token) {
+    return EvalBudget(Clock::now() + timeout, token);
+}
+
+bool EvalBudget::IsExhausted() const {
+    if (exhausted_)
+    {
+        return true;
+    }
+    if (token_ != nullptr && token_->IsCancelled())
+    {
+        exhausted_ = true;
+    }
+    else if (deadline_ && checks_++ % CLOCK_INTERVAL == 0)
+    {
+        exhausted_ = Clock::now() >= *deadline_;
+    }
+    return exhausted_;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+
+// Флаг отмены долгих вычислений. Cancel можно вызывать из любого потока,
+// в том числе пока идёт пересчёт.
+class CancellationToken {
+public:
+    void Cancel();
+    bool IsCancelled() const;
+    // Снимает отмену, чтобы токен можно было использовать снова.
+    void Reset();
+
+private:
+    std::atomic<bool> cancelled_{false};
+};
+
+// Ограничение пересчёта: срок, токен отмены или оба. Пересчёт проверяет
+// его между вычислениями формул и шагами обхода зависимостей и, когда
+// бюджет исчерпан, останавливается: вычисленные ячейки остаются в кеше,
+// остальные - устаревшими, а лист запоминает, где остановился обход, и
+// следующий пересчёт продолжает с того же места. Хотя бы один шаг за вызов
+// выполняется всегда, поэтому повторные вызовы продвигаются даже с малым
+// бюджетом.
+// Бюджет по умолчанию не ограничивает ничего.
+// Проверка дешёвая: часы читаются раз в CLOCK_INTERVAL проверок. Один
+// бюджет проверяется в одном потоке; для других потоков он копируется.
+class EvalBudget {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr unsigned CLOCK_INTERVAL = 16;
+
+    EvalBudget() = default;
+    explicit EvalBudget(Clock::time_point deadline, const CancellationToken* token = nullptr);
+    explicit EvalBudget(const CancellationToken& token);
+    // Бюджет со сроком через timeout от текущего момента.
+    static EvalBudget For(Clock::duration timeout, const CancellationToken* token = nullptr);
+
+    // Исчерпан ли бюджет; исчерпанный бюджет остаётся исчерпанным.
+    bool IsExhausted() const;
+
+private:
+    std::optional<Clock::time_point> deadline_;
+    const CancellationToken* token_ = nullptr;
+    mutable unsigned checks_ = 0;
+    mutable bool exhausted_ = false;
+};
@@ -1,71 +1,212 @@
 #include "cell.h"
 #include "sheet.h"
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
-#include <set>
+#include <utility>
+#include <vector>
 
-Cell::Cell(Sheet& sheet) : impl_(std::make_unique<EmptyImpl>()), sheet_(sheet) {}
+namespace {
+// Значение скрытой ячейки в том виде, в каком оно участвует в формуле.
+FormulaInterface::Value GetSharedValue(const Cell& cell) {
+    const CellInterface::Value value = cell.GetValue();
+    if (const auto* number = std::get_if<double>(&value))
+    {
+        return *number;
+    }
+    if (const auto* error = std::get_if<FormulaError>(&value))
+    {
+        return *error;
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
+}  // namespace
+
+Cell::Cell(Sheet& sheet, bool shared)
+    : impl_(std::make_unique<EmptyImpl>())
+    , sheet_(sheet)
+    , shared_(shared) {
+    sheet_.GetMemoryTracker().Add(MemoryTracker::Cells, 1, sizeof(Cell));
+    impl_->AccountMemory(sheet_.GetMemoryTracker(), 1);
+}
+
+Cell::~Cell() {
+    sheet_.CountEdit();
+    MemoryTracker& tracker = sheet_.GetMemoryTracker();
+    tracker.Add(MemoryTracker::Cells, -1, -int64_t(sizeof(Cell)));
+    impl_->AccountMemory(tracker, -1);
+    AccountSet(users_, -1);
+    AccountSet(used_cells_, -1);
+    sheet_.MarkClean(this);
+    sheet_.Unchain(this);
+    sheet_.ForgetProfiled(this);
+}
 
-Cell::~Cell() = default;
+bool Cell::Set(std::string text) {
+    Load();
+    // Вид содержимого определяется текстом, а канонический текст формулы
+    // разбирается в ту же формулу, поэтому повторная запись опознаётся
+    // сравнением строк, без разбора.
+    if (text == impl_->GetText())
+    {
+        return false;
+    }
+    auto impl = MakeImpl(std::move(text));
+    if (impl->GetText() == impl_->GetText())
+    {
+        return false;
+    }
+    Assign(std::move(impl));
+    return true;
+}
 
-void Cell::Set(std::string text) {
-    std::unique_ptr<Impl> impl;
+void Cell::Reshare() {
+    Load();
+    Assign(MakeImpl(std::string(impl_->GetText())));
+}
+
+std::unique_ptr<Cell::Impl> Cell::MakeImpl(std::string text) const {
     if (text.empty())
     {
-        impl = std::make_unique<EmptyImpl>();
+        return std::make_unique<EmptyImpl>();
     }
-    else if (text[0] == FORMULA_SIGN && text.size() > 1)
+    if (text[0] == FORMULA_SIGN && text.size() > 1)
     {
-        impl = std::make_unique<FormulaImpl>(std::move(text), sheet_);
+        return std::make_unique<FormulaImpl>(std::move(text), sheet_);
     }
-    else
+    return std::make_unique<TextImpl>(std::move(text));
+}
+
+void Cell::Assign(std::unique_ptr<Impl> impl) {
+    // Подвыражения старой формулы перестают принадлежать ячейке заранее:
+    // иначе их обобществление перезадало бы эту же ячейку.
+    std::vector<std::string> old_subexpressions;
+    if (sheet_.IsExpressionSharingEnabled())
     {
-        impl = std::make_unique<TextImpl>(std::move(text));
+        old_subexpressions = impl_->GetSubexpressions();
+        UnregisterSubexpressions();
     }
-    const auto used_cells = impl->GetReferencedCells();
-    if (!used_cells.empty())
+    // скрытые ячейки общих подвыражений и областей
+    std::vector<Cell*> hidden;
+    std::vector<std::string> unshared;
+    std::unordered_set<Cell*> used_set;
+    try
     {
-        std::unordered_set<Cell*> used_set;
-        for (const auto pos_of_used : used_cells)
+        if (sheet_.IsExpressionSharingEnabled())
+        {
+            hidden = ShareSubexpressions(*impl, unshared);
+        }
+        for (const auto pos_of_used : impl->GetReferencedCells())
+        {
+            used_set.insert(sheet_.GetOrCreateCellRef(pos_of_used));
+        }
+        for (const auto& ref : impl->GetSheetReferencedCells())
         {
-            used_set.insert(sheet_.GetCellRef(pos_of_used));
+            used_set.insert(sheet_.GetOrCreateSheetCellRef(ref));
         }
-        if (HasLoop(used_set))
+        for (const Rect& range : impl->GetReferencedRanges())
+        {
+            hidden.push_back(sheet_.AcquireRange(range));
+        }
+        used_set.insert(hidden.begin(), hidden.end());
+        if (!used_set.empty() && HasLoop(used_set))
         {
             throw CircularDependencyException("circular dependency");
         }
-        ClearUsed();
-        used_cells_ = std::move(used_set);
-        for (Cell* cell : used_cells_)
+    }
+    catch (...)
+    {
+        // формула ячейки остаётся прежней
+        for (Cell* cell : hidden)
         {
-            cell->users_.insert(this);
+            if (cell->users_.empty())
+            {
+                ReleaseHidden(cell);
+            }
         }
+        RegisterSubexpressions(old_subexpressions);
+        throw;
     }
-    else
+    ReplaceUsed(std::move(used_set));
+    SetImpl(std::move(impl));
+    RegisterSubexpressions(unshared);
+    Changed();
+}
+
+void Cell::SetRange(std::string text, std::unordered_set<Cell*> cells) {
+    auto impl = std::make_unique<RangeImpl>(std::move(text));
+    for (Cell* cell : cells)
     {
-        ClearUsed();
+        if (!cell->impl_->HasCache())
+        {
+            impl->AddStale(cell);
+        }
     }
-    impl_ = std::move(impl);
-    InvalidateCache(true);
+    SetImpl(std::move(impl));
+    range_ = true;
+    ReplaceUsed(std::move(cells));
+    sheet_.CountEdit();
+}
+
+void Cell::AddRangeCell(Cell* cell) {
+    // новая ячейка пуста, поэтому кеш области остаётся верным
+    sheet_.CountEdit();
+    AccountSet(used_cells_, -1);
+    used_cells_.insert(cell);
+    AccountSet(used_cells_, 1);
+    cell->AccountSet(cell->users_, -1);
+    cell->users_.insert(this);
+    cell->AccountSet(cell->users_, 1);
+}
+
+void Cell::SetRangeListener(RangeListener listener) {
+    static_cast<RangeImpl&>(*impl_).SetListener(std::move(listener));
+}
+
+void Cell::RefreshRange() {
+    const auto& stale = static_cast<RangeImpl&>(*impl_).GetStale();
+    Evaluate(std::vector<const Cell*>(stale.begin(), stale.end()));
+    impl_->GetValue();
+    sheet_.MarkClean(this);
 }
 
 void Cell::Clear() {
-    InvalidateCache(true);
-    impl_ = std::make_unique<EmptyImpl>();
+    UnregisterSubexpressions();
+    SetImpl(std::make_unique<EmptyImpl>());
+    Changed();
     ClearUsed();
 }
 
 Cell::Value Cell::GetValue() const {
+    if (!impl_->HasCache())
+    {
+        Evaluate({this});
+    }
     return impl_->GetValue();
 }
 
+std::optional<Cell::Value> Cell::GetLastValue() const {
+    return impl_->GetLastValue();
+}
+
+bool Cell::IsDirty() const {
+    return !impl_->HasCache();
+}
+
 std::string Cell::GetText() const {
+    Load();
+    return std::string(impl_->GetText());
+}
+
+std::string_view Cell::GetTextView() const {
+    Load();
     return impl_->GetText();
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
+    Load();
     return impl_->GetReferencedCells();
 }
 
@@ -77,62 +218,557 @@ bool Cell::IsReferenced() const {
     return !users_.empty();
 }
 
+bool Cell::IsIsolated() const {
+    return users_.empty() && used_cells_.empty();
+}
+
+bool Cell::IsShared() const {
+    return shared_;
+}
+
+bool Cell::IsFormula() const {
+    if (spilled_)
+    {
+        return static_cast<const SpilledImpl&>(*impl_).IsFormula();
+    }
+    const auto text = impl_->GetText();
+    return text.size() > 1 && text[0] == FORMULA_SIGN;
+}
+
 void Cell::ClearUsed() {
     if (!used_cells_.empty())
     {
-        for (Cell* used_cell : used_cells_)
+        ReplaceUsed({});
+    }
+}
+
+void Cell::ReplaceUsed(std::unordered_set<Cell*> used_cells) {
+    for (Cell* cell : used_cells)
+    {
+        if (used_cells_.count(cell) == 0)
         {
-            used_cell->users_.erase(this);
+            cell->AccountSet(cell->users_, -1);
+            cell->users_.insert(this);
+            cell->AccountSet(cell->users_, 1);
+            if (&cell->sheet_ != &sheet_)
+            {
+                Sheet::Link(sheet_, cell->sheet_);
+            }
         }
-        used_cells_.clear();
+    }
+    // скрытые ячейки освобождаются после замены: среди них могут быть
+    // зависимости освобождаемых
+    std::vector<Cell*> released;
+    for (Cell* cell : used_cells_)
+    {
+        if (used_cells.count(cell) == 0)
+        {
+            cell->AccountSet(cell->users_, -1);
+            cell->users_.erase(this);
+            cell->AccountSet(cell->users_, 1);
+            if (&cell->sheet_ != &sheet_)
+            {
+                Sheet::Unlink(sheet_, cell->sheet_);
+            }
+            if (cell->shared_ && cell->users_.empty())
+            {
+                released.push_back(cell);
+            }
+        }
+    }
+    AccountSet(used_cells_, -1);
+    used_cells_ = std::move(used_cells);
+    AccountSet(used_cells_, 1);
+    for (Cell* cell : released)
+    {
+        ReleaseHidden(cell);
     }
 }
 
-bool LoopFinder(const Cell* start, std::set<Cell*>& buffer, const std::unordered_set<Cell*>& used_cells) {
-    for (Cell* cell : used_cells)
+void Cell::SetImpl(std::unique_ptr<Impl> impl) {
+    impl_->AccountMemory(sheet_.GetMemoryTracker(), -1);
+    impl->AccountMemory(sheet_.GetMemoryTracker(), 1);
+    impl_ = std::move(impl);
+    spilled_ = false;
+}
+
+bool Cell::CanSpill() const {
+    if (spilled_ || shared_ || range_ || impl_->GetText().empty())
+    {
+        return false;
+    }
+    // формула, подвыражения которой учитывает лист, разбирается заново
+    // только вместе с ними, см. Reshare
+    return !sheet_.IsExpressionSharingEnabled() || impl_->GetSubexpressions().empty();
+}
+
+void Cell::Spill(Position pos) {
+    auto impl = std::make_unique<SpilledImpl>(pos, IsFormula(), impl_->GetLastValue(), impl_->HasCache());
+    SetImpl(std::move(impl));
+    spilled_ = true;
+}
+
+void Cell::Restore(std::string text) {
+    auto impl = MakeImpl(std::move(text));
+    impl->RestoreCache(impl_->GetLastValue(), impl_->HasCache());
+    SetImpl(std::move(impl));
+}
+
+bool Cell::IsSpilled() const {
+    return spilled_;
+}
+
+void Cell::Load() const {
+    if (spilled_)
+    {
+        sheet_.LoadRow(static_cast<const SpilledImpl&>(*impl_).GetPosition().row);
+    }
+}
+
+void Cell::AccountSet(const std::unordered_set<Cell*>& set, int sign) const {
+    sheet_.GetMemoryTracker().Add(MemoryTracker::DependencySets, sign * int64_t(set.size()),
+                                  sign * int64_t(GetHeapBytes(set)));
+}
+
+void Cell::ReleaseHidden(Cell* cell) {
+    if (cell->IsFormula())
     {
-        if (*buffer.lower_bound(cell) == cell)
+        cell->sheet_.ReleaseSubexpression(cell);
+    }
+    else
+    {
+        cell->sheet_.ReleaseRange(cell);
+    }
+}
+
+std::vector<Cell*> Cell::ShareSubexpressions(Impl& impl, std::vector<std::string>& unshared) {
+    std::vector<Cell*> shared;
+    const auto texts = impl.GetSubexpressions();
+    if (texts.empty())
+    {
+        return shared;
+    }
+    std::vector<FormulaInterface::Subexpression> subexpressions(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i)
+    {
+        Cell* cell = sheet_.AcquireSubexpression(texts[i], this);
+        if (cell == nullptr)
         {
+            unshared.push_back(texts[i]);
             continue;
         }
-        if (cell == start)
+        subexpressions[i].value = [cell]() {
+            return GetSharedValue(*cell);
+        };
+        subexpressions[i].text = cell->GetTextView().substr(1);
+        shared.push_back(cell);
+    }
+    if (!shared.empty())
+    {
+        impl.ShareSubexpressions(std::move(subexpressions));
+    }
+    return shared;
+}
+
+void Cell::RegisterSubexpressions(const std::vector<std::string>& texts) {
+    for (const auto& text : texts)
+    {
+        sheet_.RegisterSubexpression(text, this);
+    }
+}
+
+void Cell::UnregisterSubexpressions() {
+    if (!sheet_.IsExpressionSharingEnabled())
+    {
+        return;
+    }
+    for (const auto& text : impl_->GetSubexpressions())
+    {
+        sheet_.UnregisterSubexpression(text, this);
+    }
+}
+
+bool Cell::HasLoop(const std::unordered_set<Cell*>& used_cells) const {
+    // Цикл возникает, если одна из новых зависимостей сама (транзитивно)
+    // зависит от этой ячейки, поэтому обходим пользователей, а не
+    // зависимости: добавление ячейки в конец цепочки стоит O(1).
+    std::unordered_set<const Cell*> visited{this};
+    std::vector<const Cell*> stack{this};
+    while (!stack.empty())
+    {
+        const Cell* cell = stack.back();
+        stack.pop_back();
+        if (used_cells.count(const_cast<Cell*>(cell)) > 0)
         {
             return true;
         }
-        buffer.insert(cell);
-        if (!cell->GetRefCells().empty())
+        for (const Cell* user : cell->users_)
         {
-            return LoopFinder(start, buffer, cell->GetRefCells());
+            if (visited.insert(user).second)
+            {
+                stack.push_back(user);
+            }
         }
     }
     return false;
 }
 
-bool Cell::HasLoop(const std::unordered_set<Cell*>& used_cells) const {
-    std::set<Cell*> buffer;
-    return LoopFinder(this, buffer, used_cells);
+void Cell::InvalidateCache(bool force) {
+    // Ячейка без кеша не может иметь пользователей с кешем, поэтому обход
+    // останавливается на уже сброшенных ячейках.
+    sheet_.CountEdit();
+    std::vector<Cell*> stack;
+    if (force || impl_->HasCache())
+    {
+        stack.push_back(this);
+    }
+    while (!stack.empty())
+    {
+        Cell* cell = stack.back();
+        stack.pop_back();
+        cell->impl_->InvalidateCache();
+        // таблица ведёт учёт формул, ожидающих пересчёта
+        if (cell->impl_->HasCache())
+        {
+            cell->sheet_.MarkClean(cell);
+        }
+        else
+        {
+            cell->sheet_.MarkDirty(cell);
+        }
+        for (Cell* user : cell->users_)
+        {
+            if (user->range_)
+            {
+                static_cast<RangeImpl&>(*user->impl_).AddStale(cell);
+            }
+            if (user->impl_->HasCache())
+            {
+                stack.push_back(user);
+            }
+        }
+    }
 }
 
-void Cell::InvalidateCache(bool flag = false) {
-    if (this->impl_->Cache() || flag)
+void Cell::NotifyRanges() {
+    for (Cell* user : users_)
     {
-        this->impl_->InvalidateCache();
-        for (Cell* cell : users_)
+        if (user->range_)
         {
-            cell->InvalidateCache();
+            static_cast<RangeImpl&>(*user->impl_).AddStale(this);
         }
     }
 }
 
-Value Cell::EmptyImpl::GetValue() const {
-    return "";
+const std::unordered_set<Cell*>& Cell::GetEvaluationDeps() const {
+    if (range_)
+    {
+        return static_cast<const RangeImpl&>(*impl_).GetStale();
+    }
+    return used_cells_;
+}
+
+void Cell::Changed() {
+    sheet_.CountEdit();
+    if (!sheet_.DeferInvalidation(this))
+    {
+        InvalidateCache(true);
+        return;
+    }
+    // в ручном режиме сбрасывается только сама ячейка, но области всё
+    // равно должны знать о ней
+    NotifyRanges();
+    if (impl_->HasCache())
+    {
+        sheet_.MarkClean(this);
+    }
+    else
+    {
+        sheet_.MarkDirty(this);
+    }
+}
+
+Cell::EvaluationPlan::EvaluationPlan(const Sheet& sheet)
+    : sheet_(&sheet) {}
+
+bool Cell::EvaluationPlan::IsPending() const {
+    // ячейки плана проверяются только после счётчика: после правки среди
+    // них могут быть удалённые
+    return pending_ && edits_ == sheet_->GetEditCount();
 }
 
-std::string Cell::EmptyImpl::GetText() const {
+const std::vector<const Cell*>& Cell::EvaluationPlan::GetCells() const {
+    return cells_;
+}
+
+void Cell::EvaluationPlan::Reset() {
+    pending_ = false;
+    cells_ = {};
+    stack_ = {};
+    visited_ = {};
+    order_ = {};
+    next_ = 0;
+}
+
+bool Cell::Evaluate(const std::vector<const Cell*>& cells, std::vector<const Cell*>* evaluated,
+                    const EvalBudget* budget, EvaluationPlan* plan) {
+    using Entry = EvaluationPlan::Entry;
+    const bool resume = plan != nullptr && plan->IsPending()
+        && (&cells == &plan->cells_ || cells == plan->cells_);
+    std::optional<EvaluationPlan> local;
+    if (!resume)
+    {
+        const auto dirty = std::find_if(cells.begin(), cells.end(), [](const Cell* cell) {
+            return !cell->impl_->HasCache();
+        });
+        // всё уже вычислено: прерванный план, если он есть, не трогаем
+        if (dirty == cells.end())
+        {
+            return true;
+        }
+        if (plan == nullptr)
+        {
+            plan = &local.emplace((*dirty)->sheet_);
+        }
+        // ячейки кладутся на стек с конца, чтобы первыми обходились и
+        // вычислялись зависимости первой ячейки; вычисленные пропускает
+        // обход
+        std::vector<Entry> stack;
+        stack.reserve(cells.end() - dirty);
+        for (auto it = cells.rbegin(); it.base() != dirty; ++it)
+        {
+            stack.push_back({*it, nullptr, false});
+        }
+        std::vector<const Cell*> roots = cells;
+        plan->Reset();
+        plan->pending_ = true;
+        plan->edits_ = plan->sheet_->GetEditCount();
+        plan->cells_ = std::move(roots);
+        plan->stack_ = std::move(stack);
+        // без перестроек посреди вызова
+        plan->visited_.reserve(plan->stack_.size());
+        plan->order_.reserve(plan->stack_.size());
+    }
+
+    // Обход в глубину в обратном порядке: ячейка попадает в order_ только
+    // после всех своих невычисленных зависимостей, и ячейки order_
+    // вычисляются, как только попадают в него. Общие зависимости
+    // нескольких ячеек обходятся один раз.
+    // Бюджет проверяется между шагами: у невычисленного остатка нет
+    // пользователей с кешем. Первый шаг вызова выполняется всегда, иначе
+    // вызовы с малым бюджетом не продвигались бы. Без сохранённого плана
+    // прерванный обход пришлось бы начинать заново, поэтому тогда бюджет
+    // проверяется только между вычислениями и первая формула вычисляется
+    // всегда.
+    const bool resumable = local == std::nullopt;
+    bool progressed = false;
+    const auto exhausted = [budget, &progressed] {
+        return budget != nullptr && progressed && budget->IsExhausted();
+    };
+    // вычисления учитываются профилем листа, с которого начался пересчёт
+    Profiler* profiler = plan->sheet_->GetProfiler();
+    // вложенное вычисление относится к уже идущему пересчёту
+    const bool session = profiler != nullptr && !profiler->IsActive();
+    if (session)
+    {
+        profiler->BeginRecalc();
+    }
+    bool complete = true;
+    while (complete)
+    {
+        // каждая ячейка вычисляется, когда все её зависимости уже в кеше
+        for (; plan->next_ < plan->order_.size(); ++plan->next_)
+        {
+            const Entry& entry = plan->order_[plan->next_];
+            // между вызовами ячейку мог вычислить кто-то другой
+            if (entry.cell->impl_->HasCache())
+            {
+                continue;
+            }
+            if (exhausted())
+            {
+                complete = false;
+                break;
+            }
+            entry.cell->Load();
+            if (profiler == nullptr)
+            {
+                entry.cell->impl_->GetValue();
+                entry.cell->sheet_.MarkClean(entry.cell);
+            }
+            else
+            {
+                const auto start = Profiler::Clock::now();
+                entry.cell->impl_->GetValue();
+                const auto elapsed = Profiler::Clock::now() - start;
+                entry.cell->sheet_.MarkClean(entry.cell);
+                profiler->Record(entry.cell, entry.parent,
+                                 std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed),
+                                 entry.cell->used_cells_);
+            }
+            progressed = true;
+            if (evaluated != nullptr)
+            {
+                evaluated->push_back(entry.cell);
+            }
+        }
+        if (!complete || plan->stack_.empty())
+        {
+            break;
+        }
+        if (resumable && exhausted())
+        {
+            complete = false;
+            break;
+        }
+        const Entry entry = plan->stack_.back();
+        plan->stack_.pop_back();
+        progressed = progressed || resumable;
+        if (entry.expanded)
+        {
+            plan->order_.push_back(entry);
+            continue;
+        }
+        if (entry.cell->impl_->HasCache() || !plan->visited_.insert(entry.cell).second)
+        {
+            continue;
+        }
+        plan->stack_.push_back({entry.cell, entry.parent, true});
+        for (const Cell* used : entry.cell->GetEvaluationDeps())
+        {
+            if (!used->impl_->HasCache() && plan->visited_.count(used) == 0)
+            {
+                plan->stack_.push_back({used, entry.cell, false});
+            }
+        }
+    }
+    if (session)
+    {
+        profiler->EndRecalc();
+    }
+    if (complete)
+    {
+        plan->Reset();
+    }
+    return complete;
+}
+
+std::vector<Cell*> Cell::RecalculateChain(const std::vector<Cell*>& chain,
+                                          const std::vector<Cell*>& changed,
+                                          const std::vector<const Cell*>& first,
+                                          const EvalBudget* budget, EvaluationPlan* plan) {
+    for (Cell* cell : changed)
+    {
+        cell->InvalidateCache(true);
+    }
+    std::vector<Cell*> refined;
+    refined.reserve(chain.size());
+    // ячейки, переставленные вперёд вместе с вычисленной ради них формулой
+    std::unordered_set<const Cell*> moved;
+    bool progressed = false;
+    // формулы first вычисляются вне цепочки и в ней остаются на своих
+    // местах уже вычисленными
+    if (!first.empty())
+    {
+        std::vector<const Cell*> order;
+        const bool complete = Evaluate(first, &order, budget, plan);
+        progressed = !order.empty();
+        if (!complete)
+        {
+            for (Cell* cell : chain)
+            {
+                if (cell != nullptr && cell->IsFormula())
+                {
+                    refined.push_back(cell);
+                }
+            }
+            return refined;
+        }
+    }
+    // при исчерпанном бюджете невычисленные формулы остаются в цепочке
+    const auto keep_rest = [&chain, &moved, &refined](size_t begin) {
+        for (size_t i = begin; i < chain.size(); ++i)
+        {
+            if (chain[i] != nullptr && moved.count(chain[i]) == 0 && chain[i]->IsFormula())
+            {
+                refined.push_back(chain[i]);
+            }
+        }
+    };
+    for (size_t i = 0; i < chain.size(); ++i)
+    {
+        Cell* cell = chain[i];
+        if (cell == nullptr || moved.count(cell) > 0 || !cell->IsFormula())
+        {
+            continue;
+        }
+        if (cell->impl_->HasCache())
+        {
+            refined.push_back(cell);
+            continue;
+        }
+        // как и в Evaluate, вызов всегда продвигается хотя бы на шаг
+        if (budget != nullptr && progressed && budget->IsExhausted())
+        {
+            keep_rest(i);
+            break;
+        }
+        // в уточнённой цепочке зависимости уже вычислены, и формула
+        // вычисляется без обхода
+        bool ready = cell->sheet_.GetProfiler() == nullptr;
+        for (const Cell* used : cell->used_cells_)
+        {
+            ready = ready && used->impl_->HasCache();
+        }
+        if (ready)
+        {
+            cell->Load();
+            cell->impl_->GetValue();
+            cell->sheet_.MarkClean(cell);
+            refined.push_back(cell);
+            progressed = true;
+            continue;
+        }
+        std::vector<const Cell*> order;
+        const std::vector<const Cell*> cells{cell};
+        const bool complete = Evaluate(cells, &order, budget, plan);
+        progressed = progressed || !order.empty();
+        for (const Cell* evaluated : order)
+        {
+            // вычисленные формулы других листов остаются в их цепочках
+            if (&evaluated->sheet_ == &cell->sheet_)
+            {
+                moved.insert(evaluated);
+                refined.push_back(const_cast<Cell*>(evaluated));
+            }
+        }
+        if (!complete)
+        {
+            keep_rest(i);
+            break;
+        }
+    }
+    return refined;
+}
+
+void Cell::EmptyImpl::AccountMemory(MemoryTracker& tracker, int sign) const {
+    tracker.Add(MemoryTracker::Impls, sign, sign * int64_t(sizeof(*this)));
+}
+
+Cell::Value Cell::EmptyImpl::GetValue() const {
     return "";
 }
 
-Value Cell::TextImpl::GetValue() const {
+std::string_view Cell::EmptyImpl::GetText() const {
+    return {};
+}
+
+void Cell::TextImpl::AccountMemory(MemoryTracker& tracker, int sign) const {
+    tracker.Add(MemoryTracker::Impls, sign, sign * int64_t(sizeof(*this)));
+    tracker.Add(MemoryTracker::Texts, sign, sign * int64_t(GetHeapBytes(content)));
+}
+
+Cell::Value Cell::TextImpl::GetValue() const {
     if (content[0] == ESCAPE_SIGN)
     {
         return content.substr(1);
@@ -140,30 +776,164 @@ Value Cell::TextImpl::GetValue() const {
     return content;
 }
 
-std::string Cell::TextImpl::GetText() const {
+std::string_view Cell::TextImpl::GetText() const {
     return content;
 }
 
-Value Cell::FormulaImpl::GetValue() const {
-    if (!cache_)
+Cell::Value Cell::RangeImpl::GetValue() const {
+    if (listener_ && !stale_.empty())
+    {
+        listener_(stale_);
+    }
+    stale_.clear();
+    cache_valid_ = true;
+    return "";
+}
+
+std::string_view Cell::RangeImpl::GetText() const {
+    return text_;
+}
+
+void Cell::RangeImpl::InvalidateCache() {
+    cache_valid_ = false;
+}
+
+bool Cell::RangeImpl::HasCache() const {
+    return cache_valid_;
+}
+
+void Cell::RangeImpl::AddStale(Cell* cell) {
+    stale_.insert(cell);
+}
+
+const std::unordered_set<Cell*>& Cell::RangeImpl::GetStale() const {
+    return stale_;
+}
+
+void Cell::RangeImpl::SetListener(RangeListener listener) {
+    listener_ = std::move(listener);
+}
+
+void Cell::RangeImpl::AccountMemory(MemoryTracker& tracker, int sign) const {
+    // множество сброшенных ячеек временное и не учитывается
+    tracker.Add(MemoryTracker::Impls, sign, sign * int64_t(sizeof(*this)));
+    tracker.Add(MemoryTracker::Texts, sign, sign * int64_t(GetHeapBytes(text_)));
+}
+
+Cell::Value Cell::SpilledImpl::GetValue() const {
+    return *last_;
+}
+
+std::optional<Cell::Value> Cell::SpilledImpl::GetLastValue() const {
+    return last_;
+}
+
+std::string_view Cell::SpilledImpl::GetText() const {
+    return "";
+}
+
+void Cell::SpilledImpl::InvalidateCache() {
+    // значение текста не устаревает
+    if (formula_)
+    {
+        valid_ = false;
+    }
+}
+
+bool Cell::SpilledImpl::HasCache() const {
+    return valid_;
+}
+
+void Cell::SpilledImpl::AccountMemory(MemoryTracker& tracker, int sign) const {
+    tracker.Add(MemoryTracker::Impls, sign, sign * int64_t(sizeof(*this)));
+    if (last_)
+    {
+        if (const auto* text = std::get_if<std::string>(&*last_))
+        {
+            tracker.Add(MemoryTracker::Texts, sign, sign * int64_t(GetHeapBytes(*text)));
+        }
+    }
+}
+
+Position Cell::SpilledImpl::GetPosition() const {
+    return pos_;
+}
+
+bool Cell::SpilledImpl::IsFormula() const {
+    return formula_;
+}
+
+Cell::Value Cell::FormulaImpl::GetValue() const {
+    if (!cache_valid_)
     {
         cache_ = content->Evaluate(sheet_);
+        cache_valid_ = true;
     }
     return std::visit([](auto& value) {return Value(value); }, *cache_);
 }
 
-std::string Cell::FormulaImpl::GetText() const {
-    return FORMULA_SIGN + content->GetExpression();
+std::optional<Cell::Value> Cell::FormulaImpl::GetLastValue() const {
+    if (!cache_)
+    {
+        return std::nullopt;
+    }
+    return std::visit([](auto& value) {return Value(value); }, *cache_);
+}
+
+std::string_view Cell::FormulaImpl::GetText() const {
+    return text_;
 }
 
 std::vector<Position> Cell::FormulaImpl::GetReferencedCells() const {
     return content->GetReferencedCells();
 }
 
+std::vector<SheetPosition> Cell::FormulaImpl::GetSheetReferencedCells() const {
+    return content->GetSheetReferencedCells();
+}
+
+std::vector<Rect> Cell::FormulaImpl::GetReferencedRanges() const {
+    return content->GetReferencedRanges();
+}
+
 void Cell::FormulaImpl::InvalidateCache() {
-    cache_.reset();
+    cache_valid_ = false;
 }
 
 bool Cell::FormulaImpl::HasCache() const {
-    return cache_.has_value();
-}
\ No newline at end of file
+    return cache_valid_;
+}
+std::vector<std::string> Cell::FormulaImpl::GetSubexpressions() const {
+    return content->GetSubexpressions();
+}
+
+void Cell::FormulaImpl::ShareSubexpressions(std::vector<FormulaInterface::Subexpression> shared) {
+    content->ShareSubexpressions(std::move(shared));
+}
+
+void Cell::FormulaImpl::RestoreCache(const std::optional<Value>& last, bool valid) {
+    if (!last)
+    {
+        return;
+    }
+    if (const auto* number = std::get_if<double>(&*last))
+    {
+        cache_ = *number;
+    }
+    else if (const auto* error = std::get_if<FormulaError>(&*last))
+    {
+        cache_ = *error;
+    }
+    cache_valid_ = valid && cache_.has_value();
+}
+
+void Cell::FormulaImpl::AccountMemory(MemoryTracker& tracker, int sign) const {
+    // дерево формулы не меняется, пока она принадлежит ячейке, поэтому
+    // вычитается то же, что было добавлено
+    const auto usage = content->GetMemoryUsage();
+    tracker.Add(MemoryTracker::Impls, sign, sign * int64_t(sizeof(*this)));
+    tracker.Add(MemoryTracker::Texts, sign, sign * int64_t(GetHeapBytes(text_)));
+    tracker.Add(MemoryTracker::FormulaTrees, sign * int64_t(usage.nodes), sign * int64_t(usage.node_bytes));
+    tracker.Add(MemoryTracker::ReferenceLists, sign * int64_t(usage.list_nodes),
+                sign * int64_t(usage.list_bytes));
+}
@@ -1,45 +1,206 @@
 #pragma once
 
+#include "cancellation.h"
 #include "common.h"
 #include "formula.h"
+#include "memory_usage.h"
 
+#include <cstdint>
 #include <functional>
 #include <unordered_set>
 #include <memory>
 #include <optional>
+#include <vector>
 
 class Sheet;
 
 class Cell : public CellInterface {
 public:
-    explicit Cell(Sheet& sheet);
+    // shared - скрытая ячейка общего подвыражения, см.
+    // Sheet::EnableExpressionSharing.
+    explicit Cell(Sheet& sheet, bool shared = false);
     ~Cell();
 
-    void Set(std::string text);
+    // Задаёт содержимое ячейки. Возвращает false, если оно не изменилось:
+    // тот же текст или формула с той же канонической записью. Тогда ячейка
+    // не трогает ни зависимости, ни кеш. У изменённой формулы меняются
+    // только связи с ячейками, которые появились в ней или пропали.
+    bool Set(std::string text);
+    // Заново разбирает формулу и связывает её с общими подвыражениями листа.
+    void Reshare();
     void Clear();
+    // Делает скрытую ячейку ячейкой области листа (см. Sheet::AcquireRange):
+    // она зависит от всех ячеек области и сбрасывается вместе с любой из
+    // них. text - запись области, cells - существующие ячейки области.
+    void SetRange(std::string text, std::unordered_set<Cell*> cells);
+    // Добавляет в область ячейку, созданную после неё.
+    void AddRangeCell(Cell* cell);
+    // Ячейки области, сброшенные после её вычисления, передаются listener
+    // при каждом вычислении области: к этому моменту их значения в кеше.
+    using RangeListener = std::function<void(const std::unordered_set<Cell*>&)>;
+    void SetRangeListener(RangeListener listener);
+    // Вычисляет сброшенные ячейки области и саму область, даже если её
+    // кеш не сброшен (в ручном режиме листа ячейка сбрасывается без
+    // пользователей).
+    void RefreshRange();
 
     Value GetValue() const override;
+    // Возвращает последнее вычисленное значение, не пересчитывая формулу,
+    // даже если оно устарело. Для формулы, которая ещё ни разу не
+    // вычислялась, возвращает nullopt.
+    std::optional<Value> GetLastValue() const;
+    // Проверяет, что значение формулы устарело и требует пересчёта.
+    bool IsDirty() const;
     std::string GetText() const override;
+    std::string_view GetTextView() const override;
     std::vector<Position> GetReferencedCells() const override;
     std::unordered_set<Cell*> GetRefCells() const;
 
     bool IsReferenced() const;
+    // Проверяет, что ячейка не участвует в зависимостях: ни сама не
+    // ссылается на другие ячейки, ни на неё не ссылаются.
+    bool IsIsolated() const;
+    bool IsShared() const;
+    bool IsFormula() const;
     void ClearUsed();
 
+    // Подкачка листа (см. Sheet::EnablePaging). Spill заменяет содержимое
+    // ячейки последним значением и позицией, а сама ячейка со связями
+    // остаётся на месте: через неё зависимые формулы читают значение, не
+    // загружая страницу. Обращение к тексту ячейки или вычисление
+    // устаревшей формулы загружает её страницу, и лист возвращает
+    // содержимое через Restore, не трогая ни связей, ни кеша.
+    // Выгрузить можно непустую ячейку, не являющуюся скрытой и не
+    // участвующую в общих подвыражениях.
+    bool CanSpill() const;
+    void Spill(Position pos);
+    void Restore(std::string text);
+    bool IsSpilled() const;
+
+    // Состояние вычисления, прерванного бюджетом: пройденная часть обхода
+    // зависимостей и найденный им порядок вычисления. Лист хранит план
+    // между вызовами, чтобы следующий вызов продолжил обход с того же
+    // места, а не начинал его заново. План действителен, пока в листе (у
+    // листа книги - во всей книге) не менялись ячейки и связи между ними.
+    class EvaluationPlan {
+    public:
+        explicit EvaluationPlan(const Sheet& sheet);
+
+        // Есть ли прерванное вычисление, которое можно продолжить.
+        bool IsPending() const;
+        // Ячейки, с которых началось прерванное вычисление.
+        const std::vector<const Cell*>& GetCells() const;
+        void Reset();
+
+    private:
+        friend class Cell;
+
+        // Вместе с ячейкой запоминается формула, ради которой её вычисляют
+        // впервые: это нужно профилировщику.
+        struct Entry {
+            const Cell* cell;
+            const Cell* parent;
+            bool expanded;
+        };
+
+        const Sheet* sheet_;
+        bool pending_ = false;
+        // счётчик изменений листа, при котором план построен
+        uint64_t edits_ = 0;
+        std::vector<const Cell*> cells_;
+        std::vector<Entry> stack_;
+        std::unordered_set<const Cell*> visited_;
+        // ячейки в порядке вычисления и число уже пройденных
+        std::vector<Entry> order_;
+        size_t next_ = 0;
+    };
+
+    // Вычисляет переданные ячейки вместе со всеми их невычисленными
+    // зависимостями за один проход, снизу вверх по явному стеку, чтобы
+    // глубина рекурсии не зависела от длины цепочки зависимостей.
+    // Ячейки вычисляются в порядке cells: сначала первая вместе со своими
+    // зависимостями, затем следующая. Если передан evaluated, в него
+    // дописываются вычисленные ячейки в порядке вычисления. Если передан
+    // budget, исчерпанный бюджет останавливает вычисление между ячейками:
+    // вычисленные остаются в кеше, остальные - устаревшими. С планом plan
+    // бюджет проверяется и на каждом шаге обхода зависимостей, состояние
+    // остановленного вычисления сохраняется в плане, и вызов с теми же
+    // cells продолжает его. Каждый вызов продвигается хотя бы на один шаг
+    // обхода или, без плана, на одну вычисленную формулу. Возвращает
+    // false, если вычислены не все ячейки.
+    static bool Evaluate(const std::vector<const Cell*>& cells,
+                         std::vector<const Cell*>* evaluated = nullptr,
+                         const EvalBudget* budget = nullptr,
+                         EvaluationPlan* plan = nullptr);
+    // Пересчёт по цепочке вычислений (ручной режим листа): сбрасывает кеш
+    // изменённых ячеек и их пользователей и вычисляет устаревшие формулы
+    // цепочки по порядку. Формула, зависимость которой ещё не вычислена,
+    // вычисляется вместе с зависимостями обходом в глубину, и в новой
+    // цепочке они встают перед ней. Возвращает уточнённую цепочку формул.
+    // Формулы first после сброса кеша вычисляются раньше цепочки.
+    // Если бюджет исчерпан, невычисленный остаток цепочки остаётся в ней
+    // после уточнённой части, и следующий пересчёт продолжит с него, а
+    // прерванный обход зависимостей формулы - с места остановки в plan.
+    static std::vector<Cell*> RecalculateChain(const std::vector<Cell*>& chain,
+                                               const std::vector<Cell*>& changed,
+                                               const std::vector<const Cell*>& first = {},
+                                               const EvalBudget* budget = nullptr,
+                                               EvaluationPlan* plan = nullptr);
+
 private:
 
+    class Impl;
+
+    std::unique_ptr<Impl> MakeImpl(std::string text) const;
+    void Assign(std::unique_ptr<Impl> impl);
     bool HasLoop(const std::unordered_set<Cell*>& used_cells) const;
-    void InvalidateCache(bool);
+    // Заменяет зависимости ячейки, освобождая скрытые ячейки, на которые
+    // больше никто не ссылается.
+    void ReplaceUsed(std::unordered_set<Cell*> used_cells);
+    // Связывает подвыражения формулы impl с общими скрытыми ячейками листа
+    // и возвращает их; подвыражения, которые ещё не общие, остаются в
+    // формуле и попадают в unshared.
+    std::vector<Cell*> ShareSubexpressions(Impl& impl, std::vector<std::string>& unshared);
+    void RegisterSubexpressions(const std::vector<std::string>& texts);
+    void UnregisterSubexpressions();
+    // Удаляет скрытую ячейку подвыражения или области.
+    static void ReleaseHidden(Cell* cell);
+    // Сообщает областям, в которые входит ячейка, что её кеш сброшен.
+    void NotifyRanges();
+    // Зависимости, которые обходит вычисление: у области - только её
+    // сброшенные ячейки, а не вся область.
+    const std::unordered_set<Cell*>& GetEvaluationDeps() const;
+    void InvalidateCache(bool force = false);
+    // Заменяет реализацию, учитывая её память в листе.
+    void SetImpl(std::unique_ptr<Impl> impl);
+    // Загружает страницу выгруженной ячейки.
+    void Load() const;
+    // Добавляет (sign = 1) или вычитает (sign = -1) память множества
+    // зависимостей ячейки из счётчиков её листа.
+    void AccountSet(const std::unordered_set<Cell*>& set, int sign) const;
+    // Сбрасывает кеш после изменения ячейки; в ручном режиме листа сброс
+    // кеша пользователей откладывается до пересчёта.
+    void Changed();
 
     class Impl {
     public:
         
         virtual ~Impl() = default;
         virtual Value GetValue() const = 0;
-        virtual std::string GetText() const = 0;
+        virtual std::optional<Value> GetLastValue() const {return GetValue();}
+        virtual std::string_view GetText() const = 0;
         virtual std::vector<Position> GetReferencedCells() const {return {};}
+        virtual std::vector<SheetPosition> GetSheetReferencedCells() const {return {};}
+        virtual std::vector<Rect> GetReferencedRanges() const {return {};}
         virtual void InvalidateCache() {}
-        virtual bool HasCache() {return true;}
+        virtual bool HasCache() const {return true;}
+        virtual std::vector<std::string> GetSubexpressions() const {return {};}
+        virtual void ShareSubexpressions(std::vector<FormulaInterface::Subexpression> /* shared */) {}
+        // Восстанавливает кеш, сохранённый при выгрузке ячейки.
+        virtual void RestoreCache(const std::optional<Value>& /* last */, bool /* valid */) {}
+        // Добавляет (sign = 1) или вычитает (sign = -1) свою память из
+        // счётчиков листа.
+        virtual void AccountMemory(MemoryTracker& tracker, int sign) const = 0;
 
     };
 
@@ -48,7 +209,9 @@ private:
 
         Value GetValue() const override;
 
-        std::string GetText() const override;
+        std::string_view GetText() const override;
+
+        void AccountMemory(MemoryTracker& tracker, int sign) const override;
 
     };
 
@@ -59,7 +222,9 @@ private:
 
         Value GetValue() const override;
 
-        std::string GetText() const override;
+        std::string_view GetText() const override;
+
+        void AccountMemory(MemoryTracker& tracker, int sign) const override;
 
     private:
 
@@ -67,32 +232,130 @@ private:
 
     };
 
+    // Область листа: значения нет, кеш только отмечает, что ячейки области
+    // вычислены. Область помнит ячейки, сброшенные после её вычисления:
+    // только их нужно вычислить перед ней, и только их значения могли
+    // измениться для слушателя.
+    class RangeImpl : public Impl {
+    public:
+
+        explicit RangeImpl(std::string text) : text_(std::move(text)) {}
+
+        Value GetValue() const override;
+
+        std::string_view GetText() const override;
+
+        void InvalidateCache() override;
+
+        bool HasCache() const override;
+
+        void AddStale(Cell* cell);
+
+        const std::unordered_set<Cell*>& GetStale() const;
+
+        void SetListener(RangeListener listener);
+
+        void AccountMemory(MemoryTracker& tracker, int sign) const override;
+
+    private:
+
+        std::string text_;
+        mutable bool cache_valid_ = false;
+        mutable std::unordered_set<Cell*> stale_;
+        RangeListener listener_;
+
+    };
+
     class FormulaImpl : public Impl {
     public:
 
-        explicit FormulaImpl(const std::string& text, SheetInterface& sheet) : content(ParseFormula(text.substr(1))), sheet_(sheet) {}
+        explicit FormulaImpl(const std::string& text, SheetInterface& sheet)
+            : content(ParseFormula(text.substr(1)))
+            , text_(FORMULA_SIGN + content->GetExpression())
+            , sheet_(sheet) {}
 
         Value GetValue() const override;
 
-        std::string GetText() const override;
+        std::optional<Value> GetLastValue() const override;
+
+        std::string_view GetText() const override;
 
         std::vector<Position> GetReferencedCells() const override;
 
-        void InvalidateCache();
+        std::vector<SheetPosition> GetSheetReferencedCells() const override;
+
+        std::vector<Rect> GetReferencedRanges() const override;
+
+        void InvalidateCache() override;
+
+        bool HasCache() const override;
+
+        std::vector<std::string> GetSubexpressions() const override;
+
+        void ShareSubexpressions(std::vector<FormulaInterface::Subexpression> shared) override;
 
-        bool HasCache() const;
+        void RestoreCache(const std::optional<Value>& last, bool valid) override;
+
+        void AccountMemory(MemoryTracker& tracker, int sign) const override;
 
     private:
         
+        // после сброса кеша старое значение сохраняется, чтобы его можно было
+        // прочитать до пересчёта
         mutable std::optional<FormulaInterface::Value> cache_;
+        mutable bool cache_valid_ = false;
         std::unique_ptr<FormulaInterface> content;
+        // каноническое выражение строится один раз при разборе
+        std::string text_;
         SheetInterface& sheet_;
 
     };
 
+    // Выгруженная ячейка: последнее значение и позиция, по которой лист
+    // загружает её текст. Текста нет, поэтому Cell загружает страницу
+    // раньше, чем обратиться к нему.
+    class SpilledImpl : public Impl {
+    public:
+
+        SpilledImpl(Position pos, bool formula, std::optional<Value> last, bool valid)
+            : pos_(pos)
+            , formula_(formula)
+            , last_(std::move(last))
+            , valid_(valid) {}
+
+        Value GetValue() const override;
+
+        std::optional<Value> GetLastValue() const override;
+
+        std::string_view GetText() const override;
+
+        void InvalidateCache() override;
+
+        bool HasCache() const override;
+
+        void AccountMemory(MemoryTracker& tracker, int sign) const override;
+
+        Position GetPosition() const;
+
+        bool IsFormula() const;
+
+    private:
+
+        Position pos_;
+        bool formula_;
+        std::optional<Value> last_;
+        bool valid_;
+
+    };
+
     std::unique_ptr<Impl> impl_;
     Sheet& sheet_;
     std::unordered_set<Cell*> users_;
     std::unordered_set<Cell*> used_cells_;
+    bool shared_ = false;
+    // скрытая ячейка области
+    bool range_ = false;
+    // содержимое выгружено, impl_ - SpilledImpl
+    bool spilled_ = false;
 
 };
\ No newline at end of file
@@ -1,29 +1,86 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <variant>
 #include <vector>
 
+// Размеры таблицы задаются при сборке, например
+// -DSPREADSHEET_MAX_ROWS=1048576. Строка и столбец должны помещаться в 31 бит.
+#ifndef SPREADSHEET_MAX_ROWS
+#define SPREADSHEET_MAX_ROWS 16384
+#endif
+#ifndef SPREADSHEET_MAX_COLS
+#define SPREADSHEET_MAX_COLS 16384
+#endif
+
 // Позиция ячейки. Индексация с нуля.
 struct Position {
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
+    // Сравнение и хеширование идут по 64-битному ключу: строка в старшей
+    // половине, столбец в младшей. Знаковый бит инвертируется, чтобы
+    // порядок ключей совпадал с порядком пар (row, col), включая NONE.
+    uint64_t Key() const {
+        return uint64_t(uint32_t(row) ^ SIGN_BIT) << 32 | (uint32_t(col) ^ SIGN_BIT);
+    }
+    static Position FromKey(uint64_t key) {
+        return {int(uint32_t(key >> 32) ^ SIGN_BIT), int(uint32_t(key) ^ SIGN_BIT)};
+    }
+
+    bool operator==(Position rhs) const {
+        return Key() == rhs.Key();
+    }
+    bool operator!=(Position rhs) const {
+        return Key() != rhs.Key();
+    }
+    bool operator<(Position rhs) const {
+        return Key() < rhs.Key();
+    }
 
     bool IsValid() const;
     std::string ToString() const;
 
     static Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
+    static constexpr int MAX_ROWS = SPREADSHEET_MAX_ROWS;
+    static constexpr int MAX_COLS = SPREADSHEET_MAX_COLS;
     static const Position NONE;
+
+private:
+    static constexpr uint32_t SIGN_BIT = 0x80000000u;
+};
+
+static_assert(SPREADSHEET_MAX_ROWS > 0 && SPREADSHEET_MAX_ROWS <= 0x7FFFFFFF,
+              "SPREADSHEET_MAX_ROWS must fit into a positive int");
+static_assert(SPREADSHEET_MAX_COLS > 0 && SPREADSHEET_MAX_COLS <= 0x7FFFFFFF,
+              "SPREADSHEET_MAX_COLS must fit into a positive int");
+
+namespace std {
+template <>
+struct hash<Position> {
+    size_t operator()(Position pos) const {
+        // мультипликативное хеширование: старшие биты произведения зависят
+        // и от строки, и от столбца
+        return size_t((pos.Key() * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+};
+}  // namespace std
+
+// Позиция ячейки на листе книги с заданным именем.
+struct SheetPosition {
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetPosition& rhs) const;
+    bool operator<(const SheetPosition& rhs) const;
 };
 
 struct Size {
@@ -33,6 +90,19 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область таблицы: левый верхний угол и размер.
+struct Rect {
+    Position top_left;
+    Size size;
+
+    bool operator==(Rect rhs) const;
+
+    // Область корректна, если она целиком лежит в пределах таблицы.
+    bool IsValid() const;
+    // Запись области в формуле: A1:C10. Для некорректной области пустая.
+    std::string ToString() const;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -40,6 +110,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
+        NA,    // функция поиска не нашла значение
     };
 
     FormulaError(Category category) {
@@ -63,6 +134,8 @@ public:
             return "#VALUE!";
         case FormulaError::Category::Div0:
             return "#DIV/0!";
+        case FormulaError::Category::NA:
+            return "#N/A";
         }
         return "";
     }
@@ -109,6 +182,13 @@ public:
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
+    // То же, что GetText(), но без копирования. Представление действительно
+    // до следующего изменения ячейки.
+    virtual std::string_view GetTextView() const = 0;
+    // Проверяет, что текст ячейки пуст.
+    bool IsEmpty() const {
+        return GetTextView().empty();
+    }
 
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
@@ -116,9 +196,32 @@ public:
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+// Способ сравнения при поиске значения в области, см. SheetInterface::Match.
+enum class MatchType {
+    Exact,    // первое значение, равное искомому
+    Less,     // последнее значение, не большее искомого; область по возрастанию
+    Greater,  // последнее значение, не меньшее искомого; область по убыванию
+};
+
+// Итог числовых значений области, см. SheetInterface::GetAggregate.
+enum class Aggregate {
+    Sum,
+    Count,
+    Min,
+    Max,
+};
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Проверяет, что ячейка содержит формулу: её текст начинается со знака "="
+// и длиннее него.
+bool IsFormulaCell(const CellInterface& cell);
+// Число, которым целиком является text, - так текст ячейки читается в
+// формулах. Для пустого текста и текста, не являющегося числом целиком,
+// возвращает nullopt.
+std::optional<double> ParseNumber(const std::string& text);
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -160,6 +263,29 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает лист той же книги с именем name, на который могут
+    // ссылаться формулы вида Лист!A1. Таблица вне книги возвращает nullptr.
+    virtual const SheetInterface* FindSheet(std::string_view name) const {
+        return nullptr;
+    }
+
+    // Ищет значение key в первом столбце области range или, если область
+    // состоит из одной строки, в этой строке. Возвращает смещение найденной
+    // ячейки от начала области или -1. Текст, который целиком читается как
+    // число, сравнивается как число, числа меньше любого текста. Пустые
+    // ячейки и ошибки не совпадают ни с каким значением. Поиск Less и
+    // Greater двоичный и полагается на упорядоченность области. Реализация
+    // по умолчанию перебирает ячейки через GetCell.
+    virtual int Match(const CellInterface::Value& key, Rect range, MatchType type) const;
+
+    // Возвращает итог числовых значений области range. Числом считается и
+    // текст, который целиком читается как число, остальной текст и пустые
+    // ячейки пропускаются. Сумма, минимум и максимум области с ошибкой
+    // равны этой ошибке, Count ошибки не считает. Минимум и максимум
+    // области без чисел - бесконечности: +inf и -inf соответственно.
+    // Реализация по умолчанию перебирает ячейки через GetCell.
+    virtual std::variant<double, FormulaError> GetAggregate(Rect range, Aggregate type) const;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -10,10 +10,43 @@
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 namespace {
+// Значение ячейки листа в том виде, в каком оно участвует в формуле.
+FormulaInterface::Value GetCellValue(const SheetInterface& sheet, Position pos) {
+    if (!pos.IsValid())
+    {
+        return FormulaError(FormulaError::Category::Ref);
+    }
+    const auto* cell = sheet.GetCell(pos);
+    if (cell == nullptr)
+    {
+        return 0.0;
+    }
+    const CellInterface::Value value = cell->GetValue();
+    if (const auto* number = std::get_if<double>(&value))
+    {
+        return *number;
+    }
+    if (const auto* text = std::get_if<std::string>(&value))
+    {
+        // пустой текст считается нулём, текст, не являющийся числом
+        // целиком, даёт ошибку #VALUE!
+        if (text->empty())
+        {
+            return 0.0;
+        }
+        if (const auto number = ParseNumber(*text))
+        {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return std::get<FormulaError>(value);
+}
+
 class Formula : public FormulaInterface {
 public:
     explicit Formula(std::string expression) 
@@ -24,51 +57,33 @@ public:
         }
 
     Value Evaluate(const SheetInterface& sheet) const override {
-        try 
-        {
-            std::function<double(Position)> args = [&sheet](const Position pos)->double{
-                if(!pos.IsValid())
-                {
-                    throw FormulaError(FormulaError::Category::Ref);
-                }
-                const auto* cell = sheet.GetCell(pos);
-                if (cell == nullptr)
-                {
-                    return 0.0;
-                }
-                if (std::holds_alternative<double>(cell->GetValue()))
-                {
-                    return std::get<double>(cell->GetValue());
-                }
-                else if (std::holds_alternative<std::string>(cell->GetValue()))
-                {
-                    const std::string value = std::get<std::string>(cell->GetValue());
-                    if (value == "")
-                    {
-                        return 0.0;
-                    }
-                    std::istringstream is_value(value);
-                    double result = 0.0;
-                    if (is_value.eof() && is_value >> result)
-                    {
-                        return result;
-                    }
-                    else
-                    {
-                        throw FormulaError(FormulaError::Category::Value);
-                    }
-                }
-                else
-                {
-                    throw FormulaError(std::get<FormulaError>(cell->GetValue()));
-                }
-            };
-            return ast_.Execute(args);
-        }
-        catch (const FormulaError& error)
-        {
-            return error;
-        }
+        FormulaAST::Args args;
+        args.cell = [&sheet](const Position pos) {
+            return GetCellValue(sheet, pos);
+        };
+        args.sheet_cell = [&sheet](const SheetPosition& ref) -> Value {
+            const SheetInterface* other = sheet.FindSheet(ref.sheet);
+            if (other == nullptr)
+            {
+                return FormulaError(FormulaError::Category::Ref);
+            }
+            return GetCellValue(*other, ref.pos);
+        };
+        args.value = [&sheet](const Position pos) -> CellInterface::Value {
+            if (!pos.IsValid())
+            {
+                return FormulaError(FormulaError::Category::Ref);
+            }
+            const auto* cell = sheet.GetCell(pos);
+            return cell != nullptr ? cell->GetValue() : CellInterface::Value();
+        };
+        args.match = [&sheet](const CellInterface::Value& key, const Rect& range, MatchType type) {
+            return sheet.Match(key, range, type);
+        };
+        args.aggregate = [&sheet](const Rect& range, Aggregate type) {
+            return sheet.GetAggregate(range, type);
+        };
+        return ast_.Execute(args);
     }
 
     std::string GetExpression() const override {
@@ -86,9 +101,49 @@ public:
                 to_ret.push_back(cell);
             }
         }
+        // ячейки в AST уже отсортированы, остаётся убрать повторы
+        to_ret.erase(std::unique(to_ret.begin(), to_ret.end()), to_ret.end());
         return to_ret;
     }
 
+    std::vector<SheetPosition> GetSheetReferencedCells() const override {
+        std::vector<SheetPosition> to_ret(ast_.GetSheetCells().begin(), ast_.GetSheetCells().end());
+        to_ret.erase(std::unique(to_ret.begin(), to_ret.end()), to_ret.end());
+        return to_ret;
+    }
+
+    std::vector<Rect> GetReferencedRanges() const override {
+        std::vector<Rect> to_ret;
+        for (const Rect& range : ast_.GetRanges())
+        {
+            if (std::find(to_ret.begin(), to_ret.end(), range) == to_ret.end())
+            {
+                to_ret.push_back(range);
+            }
+        }
+        return to_ret;
+    }
+
+    std::vector<std::string> GetSubexpressions() const override {
+        return ast_.GetSubexpressions();
+    }
+
+    void ShareSubexpressions(std::vector<Subexpression> shared) override {
+        std::vector<FormulaAST::Shared> ast_shared;
+        ast_shared.reserve(shared.size());
+        for (auto& subexpression : shared)
+        {
+            ast_shared.push_back({std::move(subexpression.value), subexpression.text});
+        }
+        ast_.ShareSubexpressions(std::move(ast_shared));
+    }
+
+    MemoryUsage GetMemoryUsage() const override {
+        const auto ast_usage = ast_.GetMemoryUsage();
+        return {ast_usage.nodes, sizeof(*this) + ast_usage.node_bytes,
+                ast_usage.list_nodes, ast_usage.list_bytes};
+    }
+
 private:
     FormulaAST ast_;
 };
@@ -2,13 +2,20 @@
 
 #include "common.h"
 
+#include <functional>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Ячейки других листов книги: Лист2!A1, 'Лист с пробелом'!B2
+// * Функции поиска по областям листа: MATCH, VLOOKUP и XLOOKUP, например
+//   VLOOKUP(D1,A1:C100,3,0) или XLOOKUP("Иванов",A1:A100,B1:B100,0)
+// * Итоги областей и чисел: SUM, COUNT, MIN и MAX, например SUM(A1:A100,B1)
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,6 +41,48 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает список ячеек других листов (ссылки вида Лист!A1),
+    // отсортированный по возрастанию и без повторов.
+    virtual std::vector<SheetPosition> GetSheetReferencedCells() const {
+        return {};
+    }
+
+    // Возвращает области, переданные функциям формулы, без повторов.
+    virtual std::vector<Rect> GetReferencedRanges() const {
+        return {};
+    }
+
+    // Подвыражение, которое вычисляется и кешируется один раз на весь лист.
+    struct Subexpression {
+        // значение подвыражения; пустая функция оставляет его в формуле
+        std::function<Value()> value;
+        // каноническое выражение для печати формулы, должно пережить её
+        std::string_view text;
+    };
+
+    // Возвращает канонические выражения операндов верхней операции формулы,
+    // зависящих от ячеек: кандидатов на общие для листа подвыражения.
+    virtual std::vector<std::string> GetSubexpressions() const {
+        return {};
+    }
+
+    // Память разобранной формулы.
+    struct MemoryUsage {
+        // узлы дерева выражения; байты включают и объект формулы
+        size_t nodes = 0;
+        size_t node_bytes = 0;
+        // узлы списков ссылок формулы
+        size_t list_nodes = 0;
+        size_t list_bytes = 0;
+    };
+    virtual MemoryUsage GetMemoryUsage() const {
+        return {};
+    }
+
+    // Заменяет подвыражения из GetSubexpressions (в том же порядке) на
+    // значения, вычисляемые в другом месте.
+    virtual void ShareSubexpressions(std::vector<Subexpression> /* shared */) {}
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
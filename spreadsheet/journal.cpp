@@ -0,0 +1,418 @@
+#include "journal.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+constexpr std::string_view JOURNAL_MAGIC = "SSJ1";
+constexpr std::string_view CHECKPOINT_MAGIC = "SSC1";
+// магия и номер поколения
+constexpr size_t HEADER_SIZE = 4 + 8;
+// операция, строка, столбец и длина текста перед текстом, контрольная сумма после
+constexpr size_t RECORD_PREFIX_SIZE = 1 + 4 + 4 + 4;
+constexpr size_t RECORD_SUFFIX_SIZE = 4;
+
+constexpr char OP_SET = 'S';
+constexpr char OP_CLEAR = 'C';
+
+// Числа пишутся в little-endian независимо от платформы.
+void PutUint32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+    {
+        out += char((value >> (8 * i)) & 0xFF);
+    }
+}
+
+void PutUint64(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i)
+    {
+        out += char((value >> (8 * i)) & 0xFF);
+    }
+}
+
+uint32_t GetUint32(std::string_view in, size_t offset) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        value |= uint32_t(static_cast<unsigned char>(in[offset + i])) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t GetUint64(std::string_view in, size_t offset) {
+    return uint64_t(GetUint32(in, offset)) | (uint64_t(GetUint32(in, offset + 4)) << 32);
+}
+
+// FNV-1a: достаточно, чтобы отличить оборванную запись от целой.
+uint32_t Checksum(std::string_view data) {
+    uint32_t hash = 2166136261u;
+    for (char c : data)
+    {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+std::string MakeHeader(std::string_view magic, uint64_t generation) {
+    std::string header(magic);
+    PutUint64(header, generation);
+    return header;
+}
+
+uint64_t ReadHeader(std::string_view data, std::string_view magic) {
+    if (data.size() < HEADER_SIZE || data.substr(0, magic.size()) != magic)
+    {
+        throw JournalException("unknown journal file format");
+    }
+    return GetUint64(data, magic.size());
+}
+
+void EncodeRecord(std::string& out, char op, Position pos, std::string_view text) {
+    const size_t begin = out.size();
+    out += op;
+    PutUint32(out, uint32_t(pos.row));
+    PutUint32(out, uint32_t(pos.col));
+    PutUint32(out, uint32_t(text.size()));
+    out.append(text);
+    PutUint32(out, Checksum(std::string_view(out).substr(begin)));
+}
+
+// Применяет к sheet записи, начиная с offset. Возвращает смещение первой
+// оборванной или повреждённой записи либо конец данных. Без sheet только
+// проверяет записи.
+size_t Replay(std::string_view data, size_t offset, SheetInterface* sheet) {
+    while (data.size() - offset >= RECORD_PREFIX_SIZE + RECORD_SUFFIX_SIZE)
+    {
+        const char op = data[offset];
+        const Position pos{int(GetUint32(data, offset + 1)), int(GetUint32(data, offset + 5))};
+        const size_t length = GetUint32(data, offset + 9);
+        if (length > data.size() - offset - RECORD_PREFIX_SIZE - RECORD_SUFFIX_SIZE)
+        {
+            break;
+        }
+        const size_t body_size = RECORD_PREFIX_SIZE + length;
+        if (GetUint32(data, offset + body_size) != Checksum(data.substr(offset, body_size)))
+        {
+            break;
+        }
+        if (op != OP_SET && op != OP_CLEAR)
+        {
+            break;
+        }
+        if (sheet != nullptr && op == OP_SET)
+        {
+            sheet->SetCell(pos, std::string(data.substr(offset + RECORD_PREFIX_SIZE, length)));
+        }
+        else if (sheet != nullptr)
+        {
+            sheet->ClearCell(pos);
+        }
+        offset += body_size + RECORD_SUFFIX_SIZE;
+    }
+    return offset;
+}
+
+std::optional<std::string> ReadFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        return std::nullopt;
+    }
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Читает контрольную точку поколения generation, если файл записан целиком.
+std::optional<std::string> ReadCheckpoint(const std::string& path, uint64_t generation) {
+    auto data = ReadFile(path);
+    if (!data || data->size() < HEADER_SIZE || data->substr(0, CHECKPOINT_MAGIC.size()) != CHECKPOINT_MAGIC
+        || GetUint64(*data, CHECKPOINT_MAGIC.size()) != generation
+        || Replay(*data, HEADER_SIZE, nullptr) != data->size())
+    {
+        return std::nullopt;
+    }
+    return data;
+}
+
+void WriteAll(std::FILE* file, std::string_view data) {
+    if (std::fwrite(data.data(), 1, data.size(), file) != data.size())
+    {
+        throw JournalException("journal write failed");
+    }
+}
+
+// Сбрасывает буферы и дожидается записи файла на диск.
+void SyncFile(std::FILE* file) {
+    if (std::fflush(file) != 0)
+    {
+        throw JournalException("journal flush failed");
+    }
+#ifdef _WIN32
+    const int result = _commit(_fileno(file));
+#else
+    const int result = fsync(fileno(file));
+#endif
+    if (result != 0)
+    {
+        throw JournalException("journal fsync failed");
+    }
+}
+
+// Дожидается записи на диск каталога файла path: без этого переименование
+// в нём может потеряться при сбое, даже если сам файл уже на диске.
+void SyncDirectory(const std::string& path) {
+#ifndef _WIN32
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    if (directory.empty())
+    {
+        directory = ".";
+    }
+    const int fd = open(directory.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw JournalException("cannot open directory " + directory.string());
+    }
+    const int result = fsync(fd);
+    close(fd);
+    if (result != 0)
+    {
+        throw JournalException("directory fsync failed");
+    }
+#endif
+}
+}  // namespace
+
+Journal::Journal(std::string path, SheetInterface& sheet, JournalOptions options)
+    : path_(std::move(path))
+    , options_(options) {
+    auto checkpoint = ReadFile(CheckpointPath());
+    uint64_t checkpoint_generation = 0;
+    if (checkpoint)
+    {
+        checkpoint_generation = ReadHeader(*checkpoint, CHECKPOINT_MAGIC);
+    }
+
+    const auto journal = ReadFile(path_);
+    // журнал короче заголовка остаётся после сбоя посреди Reset()
+    const bool has_journal = journal && journal->size() >= HEADER_SIZE;
+    const uint64_t generation = has_journal ? ReadHeader(*journal, JOURNAL_MAGIC) : 0;
+    if (has_journal && generation > checkpoint_generation)
+    {
+        if (generation > checkpoint_generation + 1)
+        {
+            throw JournalException("journal is newer than its checkpoint");
+        }
+        // сбой после очистки журнала, когда переименование новой
+        // контрольной точки не дошло до диска. Если временный файл уцелел,
+        // переименование завершается. Иначе записи журнала применяются
+        // поверх предыдущей контрольной точки: теряются только правки,
+        // свёрнутые в пропавшую
+        if (auto temp = ReadCheckpoint(CheckpointPath() + ".tmp", generation))
+        {
+            std::filesystem::rename(CheckpointPath() + ".tmp", CheckpointPath());
+            SyncDirectory(CheckpointPath());
+            checkpoint = std::move(temp);
+            checkpoint_generation = generation;
+        }
+    }
+
+    // контрольная точка пишется целиком и переименовывается атомарно,
+    // поэтому оборванной она быть не может
+    if (checkpoint && Replay(*checkpoint, HEADER_SIZE, &sheet) != checkpoint->size())
+    {
+        throw JournalException("corrupted checkpoint");
+    }
+    if (!has_journal)
+    {
+        Reset(checkpoint_generation);
+        return;
+    }
+    if (generation < checkpoint_generation)
+    {
+        // сбой между записью контрольной точки и очисткой журнала: все его
+        // записи уже вошли в контрольную точку
+        Reset(checkpoint_generation);
+        return;
+    }
+
+    const size_t end = Replay(*journal, HEADER_SIZE, &sheet);
+    if (end != journal->size())
+    {
+        std::filesystem::resize_file(path_, end);
+    }
+    file_ = std::fopen(path_.c_str(), "ab");
+    if (file_ == nullptr)
+    {
+        throw JournalException("cannot open journal " + path_);
+    }
+    generation_ = generation;
+    committed_bytes_ = end;
+}
+
+Journal::~Journal() {
+    try
+    {
+        Commit();
+    }
+    catch (const JournalException&)
+    {
+        // из деструктора сообщить об ошибке некуда
+    }
+    if (file_ != nullptr)
+    {
+        std::fclose(file_);
+    }
+}
+
+void Journal::LogSet(Position pos, std::string_view text) {
+    Append(OP_SET, pos, text);
+}
+
+void Journal::LogClear(Position pos) {
+    Append(OP_CLEAR, pos, {});
+}
+
+void Journal::Append(char op, Position pos, std::string_view text) {
+    EncodeRecord(pending_, op, pos, text);
+    if (++pending_records_ >= options_.group_commit_records)
+    {
+        Commit();
+    }
+}
+
+void Journal::Commit() {
+    if (pending_.empty())
+    {
+        return;
+    }
+    WriteAll(file_, pending_);
+    SyncFile(file_);
+    committed_bytes_ += pending_.size();
+    pending_.clear();
+    pending_records_ = 0;
+}
+
+bool Journal::NeedsCheckpoint() const {
+    return committed_bytes_ >= options_.checkpoint_bytes;
+}
+
+void Journal::Checkpoint(const SheetInterface& sheet) {
+    Commit();
+
+    std::string data = MakeHeader(CHECKPOINT_MAGIC, generation_ + 1);
+    const Size size = sheet.GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row)
+    {
+        for (int col = 0; col < size.cols; ++col)
+        {
+            const Position pos{row, col};
+            const CellInterface* cell = sheet.GetCell(pos);
+            if (cell != nullptr && !cell->IsEmpty())
+            {
+                EncodeRecord(data, OP_SET, pos, cell->GetTextView());
+            }
+        }
+    }
+
+    const std::string temp_path = CheckpointPath() + ".tmp";
+    std::FILE* temp = std::fopen(temp_path.c_str(), "wb");
+    if (temp == nullptr)
+    {
+        throw JournalException("cannot create checkpoint " + temp_path);
+    }
+    try
+    {
+        WriteAll(temp, data);
+        SyncFile(temp);
+    }
+    catch (...)
+    {
+        std::fclose(temp);
+        throw;
+    }
+    std::fclose(temp);
+    std::filesystem::rename(temp_path, CheckpointPath());
+    // журнал нового поколения можно начинать, только когда переименование
+    // на диске: иначе после сбоя он встретит прежнюю контрольную точку
+    SyncDirectory(CheckpointPath());
+
+    Reset(generation_ + 1);
+}
+
+void Journal::Reset(uint64_t generation) {
+    if (file_ != nullptr)
+    {
+        std::fclose(file_);
+    }
+    file_ = std::fopen(path_.c_str(), "wb");
+    if (file_ == nullptr)
+    {
+        throw JournalException("cannot open journal " + path_);
+    }
+    const std::string header = MakeHeader(JOURNAL_MAGIC, generation);
+    WriteAll(file_, header);
+    SyncFile(file_);
+    generation_ = generation;
+    committed_bytes_ = header.size();
+}
+
+std::string Journal::CheckpointPath() const {
+    return path_ + ".checkpoint";
+}
+
+JournaledSheet::JournaledSheet(std::string path, JournalOptions options)
+    : journal_(std::move(path), sheet_, options) {
+}
+
+void JournaledSheet::SetCell(Position pos, std::string text) {
+    sheet_.SetCell(pos, std::move(text));
+    // канонический текст читается обратно в ту же ячейку
+    journal_.LogSet(pos, sheet_.GetCellRef(pos)->GetTextView());
+    CheckpointIfNeeded();
+}
+
+const CellInterface* JournaledSheet::GetCell(Position pos) const {
+    return sheet_.GetCell(pos);
+}
+
+CellInterface* JournaledSheet::GetCell(Position pos) {
+    return sheet_.GetCell(pos);
+}
+
+void JournaledSheet::ClearCell(Position pos) {
+    sheet_.ClearCell(pos);
+    journal_.LogClear(pos);
+    CheckpointIfNeeded();
+}
+
+Size JournaledSheet::GetPrintableSize() const {
+    return sheet_.GetPrintableSize();
+}
+
+void JournaledSheet::PrintValues(std::ostream& output) const {
+    sheet_.PrintValues(output);
+}
+
+void JournaledSheet::PrintTexts(std::ostream& output) const {
+    sheet_.PrintTexts(output);
+}
+
+void JournaledSheet::Commit() {
+    journal_.Commit();
+}
+
+void JournaledSheet::CheckpointIfNeeded() {
+    if (journal_.NeedsCheckpoint())
+    {
+        journal_.Checkpoint(sheet_);
+    }
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Исключение, выбрасываемое при ошибке ввода-вывода или повреждении файлов
+// журнала, которое нельзя объяснить оборванной последней записью
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct JournalOptions {
+    // Сколько записей накапливается перед общей записью на диск с fsync.
+    size_t group_commit_records = 64;
+    // Размер журнала, после которого состояние таблицы сворачивается в
+    // контрольную точку, а журнал начинается заново.
+    size_t checkpoint_bytes = 16 << 20;
+};
+
+// Журнал изменений таблицы с упреждающей записью.
+// Изменения дописываются в конец файла path пачками (group commit), так что
+// стоимость сохранения пропорциональна числу правок, а не размеру таблицы.
+// Полное состояние периодически записывается в path + ".checkpoint", после
+// чего журнал очищается, и время восстановления остаётся ограниченным.
+// Обе части помечены номером поколения: журнал применяется поверх
+// контрольной точки, только если их поколения совпадают.
+class Journal {
+public:
+    // Открывает журнал и восстанавливает в sheet сохранённое состояние:
+    // загружает контрольную точку и применяет к ней записи журнала.
+    // Оборванная при сбое последняя запись отбрасывается. Журнал на одно
+    // поколение новее контрольной точки остаётся после сбоя, потерявшего
+    // её переименование: тогда берётся уцелевший временный файл новой
+    // контрольной точки, а без него записи журнала применяются поверх
+    // прежней.
+    Journal(std::string path, SheetInterface& sheet, JournalOptions options = {});
+    // Записывает накопленные изменения на диск.
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    void LogSet(Position pos, std::string_view text);
+    void LogClear(Position pos);
+
+    // Записывает накопленные изменения и дожидается их попадания на диск.
+    void Commit();
+
+    bool NeedsCheckpoint() const;
+    // Сохраняет полное состояние sheet в контрольную точку и начинает
+    // журнал заново.
+    void Checkpoint(const SheetInterface& sheet);
+
+    uint64_t GetGeneration() const {
+        return generation_;
+    }
+
+private:
+    void Append(char op, Position pos, std::string_view text);
+    void Reset(uint64_t generation);
+    std::string CheckpointPath() const;
+
+    std::string path_;
+    JournalOptions options_;
+    std::FILE* file_ = nullptr;
+    uint64_t generation_ = 0;
+    // записи, ещё не отправленные на диск
+    std::string pending_;
+    size_t pending_records_ = 0;
+    size_t committed_bytes_ = 0;
+};
+
+// Таблица, все изменения которой записываются в журнал.
+class JournaledSheet : public SheetInterface {
+public:
+    explicit JournaledSheet(std::string path, JournalOptions options = {});
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    // Гарантирует, что все выполненные изменения сохранены на диске.
+    void Commit();
+
+    Journal& GetJournal() {
+        return journal_;
+    }
+
+private:
+    void CheckpointIfNeeded();
+
+    Sheet sheet_;
+    Journal journal_;
+};
@@ -0,0 +1,213 @@
+// Нагрузочный клиент для spreadsheet_server: несколько соединений
+// отправляют смесь правок и чтений пачками по --pipeline запросов и
+// измеряют пропускную способность и перцентили задержки ответов.
+//
+//     spreadsheet_loadgen SOCKET [--clients N] [--requests N]
+//         [--pipeline N] [--reads PERCENT] [--range ROWSxCOLS]
+//
+// Правки пишут числа и формулы в ячейки области --range первого листа,
+// чтения запрашивают значение ячейки или (каждое десятое) всю строку
+// области.
+
+#include "sheet_server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::string socket_path;
+    int clients = 4;
+    int requests = 100000;
+    int pipeline = 32;
+    int reads = 80;
+    int rows = 100;
+    int cols = 10;
+};
+
+struct ClientResult {
+    std::vector<std::chrono::nanoseconds> latencies;
+    size_t errors = 0;
+};
+
+bool ParseOptions(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg.rfind("--", 0) != 0)
+        {
+            if (!options.socket_path.empty())
+            {
+                return false;
+            }
+            options.socket_path = arg;
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            return false;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--range")
+        {
+            const auto x = value.find('x');
+            if (x == std::string::npos)
+            {
+                return false;
+            }
+            options.rows = std::atoi(value.substr(0, x).c_str());
+            options.cols = std::atoi(value.substr(x + 1).c_str());
+            continue;
+        }
+        const int number = std::atoi(value.c_str());
+        if (arg == "--clients")
+        {
+            options.clients = number;
+        }
+        else if (arg == "--requests")
+        {
+            options.requests = number;
+        }
+        else if (arg == "--pipeline")
+        {
+            options.pipeline = number;
+        }
+        else if (arg == "--reads")
+        {
+            options.reads = number;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return !options.socket_path.empty() && options.clients > 0 && options.requests > 0
+           && options.pipeline > 0 && options.reads >= 0 && options.reads <= 100
+           && options.rows > 0 && options.cols > 0;
+}
+
+// Выполняет requests запросов пачками: время ответа отсчитывается от
+// отправки пачки.
+void RunClient(const Options& options, int requests, unsigned seed, ClientResult& result) {
+    SheetClient client(options.socket_path);
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> row(0, options.rows - 1);
+    std::uniform_int_distribution<int> col(0, options.cols - 1);
+    std::uniform_int_distribution<int> percent(0, 99);
+    result.latencies.reserve(requests);
+    while (requests > 0)
+    {
+        const int batch = std::min(requests, options.pipeline);
+        for (int i = 0; i < batch; ++i)
+        {
+            const Position pos{row(random), col(random)};
+            const int dice = percent(random);
+            if (dice < options.reads)
+            {
+                if (dice % 10 == 0)
+                {
+                    client.GetValues(0, {{pos.row, 0}, {1, options.cols}});
+                }
+                else
+                {
+                    client.GetValue(0, pos);
+                }
+            }
+            else if (dice % 2 == 0 || pos.col == 0)
+            {
+                client.SetCell(0, pos, std::to_string(dice));
+            }
+            else
+            {
+                // формула от соседней слева ячейки той же строки
+                client.SetCell(0, pos, "=" + Position{pos.row, pos.col - 1}.ToString() + "+1");
+            }
+        }
+        const auto start = Clock::now();
+        client.Flush();
+        for (int i = 0; i < batch; ++i)
+        {
+            if (client.Receive().error != WireError::None)
+            {
+                ++result.errors;
+            }
+            result.latencies.push_back(Clock::now() - start);
+        }
+        requests -= batch;
+    }
+}
+
+double Percentile(const std::vector<std::chrono::nanoseconds>& sorted, double p) {
+    const size_t index = std::min(sorted.size() - 1, size_t(p * double(sorted.size())));
+    return double(sorted[index].count()) / 1000;
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        std::cerr << "usage: " << argv[0] << " SOCKET [--clients N] [--requests N]"
+                  << " [--pipeline N] [--reads PERCENT] [--range ROWSxCOLS]\n";
+        return 2;
+    }
+
+    std::vector<ClientResult> results(options.clients);
+    std::vector<std::thread> threads;
+    std::vector<std::string> failures(options.clients);
+    const auto start = Clock::now();
+    for (int i = 0; i < options.clients; ++i)
+    {
+        // запросы делятся между клиентами поровну
+        const int requests = options.requests / options.clients + (i < options.requests % options.clients);
+        threads.emplace_back([&, i, requests] {
+            try
+            {
+                RunClient(options, requests, unsigned(i + 1), results[i]);
+            }
+            catch (const std::exception& e)
+            {
+                failures[i] = e.what();
+            }
+        });
+    }
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    for (const auto& failure : failures)
+    {
+        if (!failure.empty())
+        {
+            std::cerr << failure << '\n';
+            return 1;
+        }
+    }
+    std::vector<std::chrono::nanoseconds> latencies;
+    size_t errors = 0;
+    for (const auto& result : results)
+    {
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+        errors += result.errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << std::fixed << std::setprecision(1)
+              << "requests: " << latencies.size() << ", errors: " << errors << '\n'
+              << "throughput: " << double(latencies.size()) / seconds << " requests/s\n"
+              << "latency us: p50 " << Percentile(latencies, 0.5)
+              << ", p90 " << Percentile(latencies, 0.9)
+              << ", p99 " << Percentile(latencies, 0.99)
+              << ", max " << double(latencies.back().count()) / 1000 << '\n';
+    return 0;
+}
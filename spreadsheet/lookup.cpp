@@ -0,0 +1,145 @@
+#include "lookup.h"
+
+namespace {
+// Числа меньше любого текста.
+bool KeyLess(const LookupKey& lhs, const LookupKey& rhs) {
+    if (lhs.index() != rhs.index())
+    {
+        return lhs.index() < rhs.index();
+    }
+    return lhs < rhs;
+}
+
+CellInterface::Value GetCellValue(const CellInterface* cell) {
+    return cell != nullptr ? cell->GetValue() : CellInterface::Value();
+}
+}  // namespace
+
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value) {
+    if (const auto* number = std::get_if<double>(&value))
+    {
+        return *number;
+    }
+    const auto* text = std::get_if<std::string>(&value);
+    if (text == nullptr || text->empty())
+    {
+        return std::nullopt;
+    }
+    if (const auto number = ParseNumber(*text))
+    {
+        return *number;
+    }
+    return *text;
+}
+
+Position GetMatchPosition(const Rect& range, int offset) {
+    if (range.size.rows == 1)
+    {
+        return {range.top_left.row, range.top_left.col + offset};
+    }
+    return {range.top_left.row + offset, range.top_left.col};
+}
+
+int MatchValues(const LookupKey& key, int count, MatchType type,
+                const std::function<CellInterface::Value(int)>& value_at) {
+    if (type == MatchType::Exact)
+    {
+        for (int offset = 0; offset < count; ++offset)
+        {
+            if (MakeLookupKey(value_at(offset)) == key)
+            {
+                return offset;
+            }
+        }
+        return -1;
+    }
+    // значения до искомого удовлетворяют условию, после - нет; ищем
+    // границу, читая O(log n) ячеек
+    const auto before = [&key, type](const std::optional<LookupKey>& value) {
+        if (!value)
+        {
+            return false;
+        }
+        return type == MatchType::Less ? !KeyLess(key, *value) : !KeyLess(*value, key);
+    };
+    int begin = 0;
+    int end = count;
+    while (begin < end)
+    {
+        const int middle = begin + (end - begin) / 2;
+        if (before(MakeLookupKey(value_at(middle))))
+        {
+            begin = middle + 1;
+        }
+        else
+        {
+            end = middle;
+        }
+    }
+    return begin - 1;
+}
+
+LookupIndex::LookupIndex(int rows, const CellAt& cell_at)
+    : keys_(rows, nullptr) {
+    for (int offset = 0; offset < rows; ++offset)
+    {
+        if (const CellInterface* cell = cell_at(offset))
+        {
+            formulas_.Track(offset, cell);
+            Assign(offset, MakeLookupKey(cell->GetValue()));
+        }
+    }
+}
+
+void LookupIndex::Update(int offset, const CellInterface* cell) {
+    // значение формулы придёт в Refresh после вычисления
+    if (formulas_.Track(offset, cell) || cell == nullptr)
+    {
+        Assign(offset, std::nullopt);
+        return;
+    }
+    Assign(offset, MakeLookupKey(cell->GetValue()));
+}
+
+void LookupIndex::Refresh(const CellInterface* cell) {
+    if (const auto offset = formulas_.Find(cell))
+    {
+        Assign(*offset, MakeLookupKey(cell->GetValue()));
+    }
+}
+
+int LookupIndex::Find(const LookupKey& key) const {
+    auto it = rows_.find(key);
+    return it != rows_.end() ? *it->second.begin() : -1;
+}
+
+void LookupIndex::Assign(int offset, std::optional<LookupKey> key) {
+    if (const LookupKey* old = keys_[offset])
+    {
+        auto it = rows_.find(*old);
+        it->second.erase(offset);
+        if (it->second.empty())
+        {
+            rows_.erase(it);
+        }
+        keys_[offset] = nullptr;
+    }
+    if (key)
+    {
+        auto it = rows_.try_emplace(std::move(*key)).first;
+        it->second.insert(offset);
+        keys_[offset] = &it->first;
+    }
+}
+
+int SheetInterface::Match(const CellInterface::Value& key, Rect range, MatchType type) const {
+    const auto lookup_key = MakeLookupKey(key);
+    if (!lookup_key || !range.IsValid())
+    {
+        return -1;
+    }
+    const int count = range.size.rows == 1 ? range.size.cols : range.size.rows;
+    return MatchValues(*lookup_key, count, type, [this, &range](int offset) {
+        return GetCellValue(GetCell(GetMatchPosition(range, offset)));
+    });
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "common.h"
+#include "range_formulas.h"
+
+#include <functional>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+// Значение, по которому ищут функции поиска: число или текст.
+using LookupKey = std::variant<double, std::string>;
+
+// Ключ значения ячейки: текст, который целиком читается как число,
+// становится числом. У пустого текста и ошибки ключа нет.
+std::optional<LookupKey> MakeLookupKey(const CellInterface::Value& value);
+
+// Ячейка области, в которой ищет SheetInterface::Match, по смещению.
+Position GetMatchPosition(const Rect& range, int offset);
+
+// Ищет key среди count значений, которые возвращает value_at по смещению,
+// как описано в SheetInterface::Match: точный поиск перебором, остальные
+// двоичным поиском. Возвращает смещение или -1.
+int MatchValues(const LookupKey& key, int count, MatchType type,
+                const std::function<CellInterface::Value(int)>& value_at);
+
+// Индекс столбца области для точного поиска: для каждого значения хранит
+// смещения строк, в которых оно встречается, значения формул учитываются
+// через RangeFormulas. Поиск - одно обращение к хеш-таблице, а правка
+// ячейки стоит O(log n).
+class LookupIndex {
+public:
+    // Ячейка столбца по смещению строки или nullptr.
+    using CellAt = std::function<const CellInterface*(int)>;
+
+    // Формулы столбца вычисляются при построении.
+    LookupIndex(int rows, const CellAt& cell_at);
+
+    // Учитывает новое содержимое ячейки в строке offset.
+    void Update(int offset, const CellInterface* cell);
+    // Учитывает новое значение формулы, если она входит в столбец.
+    void Refresh(const CellInterface* cell);
+    // Смещение первой строки со значением key или -1.
+    int Find(const LookupKey& key) const;
+
+private:
+    void Assign(int offset, std::optional<LookupKey> key);
+
+    std::unordered_map<LookupKey, std::set<int>> rows_;
+    // ключ каждой строки (указывает на ключ в rows_) или nullptr
+    std::vector<const LookupKey*> keys_;
+    RangeFormulas formulas_;
+};
@@ -1,6 +1,22 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <thread>
 #include "common.h"
 #include "formula.h"
+#include "arrow_writer.h"
+#include "async_sheet.h"
+#include "journal.h"
+#include "partitioned_sheet.h"
+#include "sheet.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include "sheet_server.h"
+#endif
+#include "trace.h"
+#include "workbook.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -49,7 +65,9 @@ void TestPositionAndStringConversion() {
     testSingle(Position{0, 701}, "ZZ1");
     testSingle(Position{0, 702}, "AAA1");
     testSingle(Position{136, 2}, "C137");
-    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+    if (Position::MAX_ROWS == 16384 && Position::MAX_COLS == 16384) {
+        testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+    }
 }
 
 void TestPositionToStringInvalid() {
@@ -68,12 +86,34 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("A+1").IsValid());
     ASSERT(!Position::FromString("R2D2").IsValid());
     ASSERT(!Position::FromString("C3PO").IsValid());
-    ASSERT(!Position::FromString("XFD16385").IsValid());
-    ASSERT(!Position::FromString("XFE16384").IsValid());
+    if (Position::MAX_ROWS == 16384 && Position::MAX_COLS == 16384) {
+        ASSERT(!Position::FromString("XFD16385").IsValid());
+        ASSERT(!Position::FromString("XFE16384").IsValid());
+    }
     ASSERT(!Position::FromString("A1234567890123456789").IsValid());
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
+void TestPositionKeys() {
+    // крайние позиции при любых размерах таблицы, заданных при сборке
+    const Position last{Position::MAX_ROWS - 1, Position::MAX_COLS - 1};
+    ASSERT_EQUAL(Position::FromString(last.ToString()), last);
+    ASSERT(!Position::FromString(Position{Position::MAX_ROWS - 1, 0}.ToString() + "0").IsValid());
+    ASSERT(!(Position{Position::MAX_ROWS, 0}).IsValid());
+    ASSERT(!(Position{0, Position::MAX_COLS}).IsValid());
+
+    const std::vector<Position> positions{
+        Position::NONE, {0, 0}, {0, 1}, {0, Position::MAX_COLS - 1}, {1, 0}, last};
+    for (size_t i = 0; i < positions.size(); ++i) {
+        ASSERT_EQUAL(Position::FromKey(positions[i].Key()), positions[i]);
+        for (size_t j = 0; j < positions.size(); ++j) {
+            ASSERT_EQUAL(positions[i] < positions[j], i < j);
+            ASSERT_EQUAL(positions[i] == positions[j], i == j);
+        }
+    }
+    ASSERT(std::hash<Position>{}("A2"_pos) != std::hash<Position>{}("B1"_pos));
+}
+
 void TestEmpty() {
     auto sheet = CreateSheet();
     ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -245,6 +285,24 @@ void TestErrorDiv0() {
     }
 }
 
+void TestErrorPropagation() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1/0");
+    sheet->SetCell("B1"_pos, "meow");
+    for (int row = 1; row < 100; ++row) {
+        const std::string prev = std::to_string(row);
+        sheet->SetCell(Position{row, 0}, "=1+A" + prev);
+        sheet->SetCell(Position{row, 1}, "=-B" + prev + "*2");
+    }
+    ASSERT_EQUAL(sheet->GetCell("A100"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet->GetCell("B100"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    sheet->SetCell("A1"_pos, "=1/4");
+    ASSERT_EQUAL(sheet->GetCell("A100"_pos)->GetValue(), CellInterface::Value(99.25));
+}
+
 void TestEmptyCellTreatedAsZero() {
     auto sheet = CreateSheet();
     sheet->SetCell("A1"_pos, "=B2");
@@ -264,10 +322,12 @@ void TestFormulaInvalidPosition() {
 
     try_formula("=X0");
     try_formula("=ABCD1");
-    try_formula("=A123456");
     try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-    try_formula("=XFD16385");
-    try_formula("=XFE16384");
+    if (Position::MAX_ROWS == 16384 && Position::MAX_COLS == 16384) {
+        try_formula("=A123456");
+        try_formula("=XFD16385");
+        try_formula("=XFE16384");
+    }
     try_formula("=R2D2");
 }
 
@@ -299,12 +359,12 @@ void TestCellReferences() {
 
     // Ссылка на пустую ячейку
     sheet->SetCell("B2"_pos, "=B1");
-    ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
     ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
 
     sheet->SetCell("A2"_pos, "");
     ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("A2"_pos) == nullptr);
 
     // Ссылка на ячейку за пределами таблицы
     sheet->SetCell("B1"_pos, "=C3");
@@ -345,6 +405,1404 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestTextView() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=(1+2)*  B1");
+    sheet->SetCell("A2"_pos, "'=text");
+    sheet->SetCell("A3"_pos, "");
+
+    const CellInterface* formula = sheet->GetCell("A1"_pos);
+    ASSERT_EQUAL(formula->GetTextView(), "=(1+2)*B1");
+    ASSERT_EQUAL(formula->GetTextView().data(), formula->GetTextView().data());
+    ASSERT_EQUAL(std::string(formula->GetTextView()), formula->GetText());
+    ASSERT(!formula->IsEmpty());
+
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetTextView(), "'=text");
+    // пустые ячейки, заданные и упомянутые в формуле, снаружи не видны
+    ASSERT(sheet->GetCell("A3"_pos) == nullptr);
+    ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 1}));
+}
+
+void TestRectRead() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "=B2*2");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.SetCell("B2"_pos, "=A2+1");
+    sheet.SetCell("A2"_pos, "=1/0");
+    sheet.SetCell("C2"_pos, "=4");
+
+    const Rect rect{"A1"_pos, {3, 3}};
+    std::vector<CellInterface::Value> values(9);
+    sheet.GetValues(rect, values.data());
+    ASSERT_EQUAL(values[0], CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(values[1], CellInterface::Value("text"));
+    ASSERT_EQUAL(values[2], CellInterface::Value(""));
+    ASSERT_EQUAL(values[5], CellInterface::Value(4.0));
+    ASSERT_EQUAL(values[8], CellInterface::Value(""));
+
+    sheet.SetCell("A2"_pos, "=2");
+    std::vector<double> numbers(9);
+    sheet.GetNumbers(rect, numbers.data(), Sheet::Order::ColumnMajor);
+    ASSERT_EQUAL(numbers[0], 6.0);
+    ASSERT_EQUAL(numbers[1], 2.0);
+    ASSERT(std::isnan(numbers[3]));
+    ASSERT_EQUAL(numbers[4], 3.0);
+    ASSERT_EQUAL(numbers[7], 4.0);
+    ASSERT(std::isnan(numbers[8]));
+
+    try {
+        sheet.GetNumbers(Rect{{Position::MAX_ROWS - 1, 0}, {2, 1}}, numbers.data());
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestPrintValuesFormatting() {
+    auto sheet = CreateSheet();
+    constexpr int rows = 600;
+    constexpr int cols = 120;
+    const std::vector<std::string> formulas = {
+        "=1/3", "=-2/7", "=1e10/3", "=1e-7*3", "=123456789", "=0.1+0.2", "=-0", "=1/0",
+    };
+    std::ostringstream expected;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            if (col > 0) {
+                expected << '\t';
+            }
+            const Position pos{row, col};
+            if ((row + col) % 5 == 0) {
+                sheet->SetCell(pos, "r" + std::to_string(row));
+            } else if ((row * col) % 7 != 3) {
+                sheet->SetCell(pos, formulas[(row + 3 * col) % formulas.size()]);
+            }
+            if (const auto* cell = sheet->GetCell(pos)) {
+                expected << cell->GetValue();
+            }
+        }
+        expected << '\n';
+    }
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT(values.str() == expected.str());
+
+    std::ostringstream fixed;
+    fixed << std::fixed;
+    sheet->SetCell("A1"_pos, "=1/3");
+    sheet->PrintValues(fixed);
+    ASSERT_EQUAL(fixed.str().substr(0, 9), "0.333333\t");
+}
+
+void TestJournalRecovery() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path() / "spreadsheet_test.journal";
+    const std::string checkpoint = path.string() + ".checkpoint";
+    fs::remove(path);
+    fs::remove(checkpoint);
+
+    {
+        JournaledSheet sheet(path.string(), JournalOptions{4, 1 << 20});
+        sheet.SetCell("A1"_pos, "=0.1234567*B1");
+        sheet.SetCell("B1"_pos, "2");
+        sheet.SetCell("C3"_pos, "tab\tand\nnewline");
+        sheet.SetCell("D4"_pos, "temporary");
+        sheet.ClearCell("D4"_pos);
+    }
+    {
+        std::ofstream torn(path, std::ios::binary | std::ios::app);
+        torn << "S\x01\x00";
+    }
+    {
+        JournaledSheet sheet(path.string());
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.2469134));
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "tab\tand\nnewline");
+        ASSERT(sheet.GetCell("D4"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{3, 3}));
+        sheet.SetCell("B1"_pos, "3");
+    }
+
+    // маленький порог заставляет журнал сворачиваться в контрольную точку
+    {
+        JournaledSheet sheet(path.string(), JournalOptions{1, 256});
+        for (int row = 0; row < 50; ++row) {
+            sheet.SetCell(Position{row, 4}, "=" + std::to_string(row) + "+B1");
+        }
+        ASSERT(sheet.GetJournal().GetGeneration() > 0);
+        ASSERT(fs::file_size(path) < 256);
+    }
+    {
+        JournaledSheet sheet(path.string());
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.1234567 * 3));
+        ASSERT_EQUAL(sheet.GetCell("E50"_pos)->GetValue(), CellInterface::Value(52.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{50, 5}));
+    }
+    fs::remove(path);
+    fs::remove(checkpoint);
+}
+
+void TestJournalLostCheckpointRename() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path() / "spreadsheet_rename.journal";
+    const std::string checkpoint = path.string() + ".checkpoint";
+    const std::string temp = checkpoint + ".tmp";
+    const std::string previous = checkpoint + ".previous";
+    for (const auto& file : {path.string(), checkpoint, temp, previous}) {
+        fs::remove(file);
+    }
+
+    // состояние после сбоя: журнал уже очищен и начат в новом поколении, а
+    // переименование контрольной точки пропало
+    auto lose_rename = [&](bool keep_temp) {
+        JournaledSheet sheet(path.string());
+        sheet.SetCell("A1"_pos, "1");
+        sheet.GetJournal().Checkpoint(sheet);
+        fs::copy_file(checkpoint, previous);
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.GetJournal().Checkpoint(sheet);
+        ASSERT_EQUAL(sheet.GetJournal().GetGeneration(), 2u);
+        sheet.SetCell("A3"_pos, "=A2+1");
+        sheet.Commit();
+        if (keep_temp) {
+            fs::rename(checkpoint, temp);
+        }
+        fs::rename(previous, checkpoint);
+    };
+
+    lose_rename(true);
+    {
+        JournaledSheet sheet(path.string());
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+        ASSERT_EQUAL(sheet.GetJournal().GetGeneration(), 2u);
+        ASSERT(!fs::exists(temp));
+    }
+    {
+        JournaledSheet sheet(path.string());
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+    }
+
+    fs::remove(path);
+    fs::remove(checkpoint);
+    lose_rename(false);
+    {
+        // без временного файла пропадают только правки, свёрнутые в
+        // потерянную контрольную точку
+        JournaledSheet sheet(path.string());
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=A2+1");
+        ASSERT_EQUAL(sheet.GetJournal().GetGeneration(), 2u);
+        sheet.SetCell("A2"_pos, "5");
+    }
+    {
+        JournaledSheet sheet(path.string());
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(6.0));
+    }
+    fs::remove(path);
+    fs::remove(checkpoint);
+}
+
+void TestAsyncRecalculation() {
+    AsyncSheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 2000; ++row) {
+        sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    auto version = sheet.SetCell("A1"_pos, "10");
+    ASSERT_EQUAL(sheet.WhenCalculated(version).get(), version);
+    auto value = sheet.GetValue("A2000"_pos);
+    ASSERT(value.current);
+    ASSERT_EQUAL(value.value, CellInterface::Value(2009.0));
+    ASSERT_EQUAL(value.version, version);
+
+    version = sheet.SetCell("A1"_pos, "20");
+    value = sheet.GetValue("A2000"_pos);
+    if (!value.current) {
+        ASSERT_EQUAL(value.value, CellInterface::Value(2009.0));
+    }
+    sheet.WhenCalculated(version).wait();
+    ASSERT_EQUAL(sheet.GetValue("A2000"_pos).value, CellInterface::Value(2019.0));
+    ASSERT(sheet.GetCalculatedVersion() >= version);
+
+    version = sheet.ClearCell("A1"_pos);
+    sheet.WhenCalculated(version).wait();
+    ASSERT_EQUAL(sheet.GetValue("A3"_pos).value, CellInterface::Value(2.0));
+    ASSERT_EQUAL(sheet.WhenCalculated(1).get(), sheet.GetCalculatedVersion());
+}
+
+void TestAsyncLongChain() {
+    using Clock = EvalBudget::Clock;
+    // цепочка из 100000 формул, по 10000 в столбце: каждая ссылается на
+    // предыдущую
+    constexpr int ROWS = 10000;
+    constexpr int LENGTH = 10 * ROWS;
+    const auto at = [](int index) {
+        return Position{index % ROWS, index / ROWS};
+    };
+    AsyncSheet sheet;
+    sheet.SetCell(at(0), "1");
+    for (int index = 1; index < LENGTH; ++index) {
+        sheet.SetCell(at(index), "=" + at(index - 1).ToString() + "+1");
+    }
+    sheet.WhenCalculated(sheet.GetVersion()).wait();
+    const Position last = at(LENGTH - 1);
+
+    // вся цепочка зависит от первой ячейки, но пересчитывается по частям:
+    // чтение не ждёт окончания пересчёта
+    const auto start = Clock::now();
+    auto calculated = sheet.WhenCalculated(sheet.SetCell(at(0), "2"));
+    Clock::duration longest{};
+    int stale = 0;
+    while (calculated.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        const auto before = Clock::now();
+        const auto value = sheet.GetValue(last);
+        longest = std::max(longest, Clock::now() - before);
+        if (!value.current) {
+            ASSERT_EQUAL(value.value, CellInterface::Value(double(LENGTH)));
+            ++stale;
+        }
+    }
+    const auto total = Clock::now() - start;
+    ASSERT(stale > 0);
+    ASSERT(longest * 4 < total);
+    ASSERT_EQUAL(sheet.GetValue(last).value, CellInterface::Value(LENGTH + 1.0));
+
+    // новая формула в конце цепочки при чтении вычисляется не дольше
+    // отрезка пересчёта, остальное досчитывается фоном
+    sheet.SetCell(at(0), "3");
+    sheet.SetCell("Z1"_pos, "=" + last.ToString());
+    auto value = sheet.GetValue("Z1"_pos);
+    while (!value.current) {
+        ASSERT_EQUAL(value.value, CellInterface::Value(""));
+        value = sheet.GetValue("Z1"_pos);
+    }
+    ASSERT_EQUAL(value.value, CellInterface::Value(LENGTH + 2.0));
+}
+
+void TestWorkbookReferences() {
+    Workbook book;
+    Sheet& prices = book.AddSheet("Prices");
+    Sheet& orders = book.AddSheet("Orders");
+    Sheet& other = book.AddSheet("It's other");
+
+    prices.SetCell("A1"_pos, "10");
+    orders.SetCell("A1"_pos, "3");
+    orders.SetCell("B1"_pos, "=A1 * Prices!A1");
+    other.SetCell("A1"_pos, "=Orders!B1+'It''s other'!A2");
+    ASSERT_EQUAL(orders.GetCell("B1"_pos)->GetText(), "=A1*Prices!A1");
+    ASSERT_EQUAL(other.GetCell("A1"_pos)->GetText(), "=Orders!B1+'It''s other'!A2");
+    ASSERT_EQUAL(orders.GetCell("B1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(other.GetCell("A1"_pos)->GetValue(), CellInterface::Value(30.0));
+
+    prices.SetCell("A1"_pos, "12");
+    ASSERT_EQUAL(orders.GetDirtyCount(), 1u);
+    ASSERT_EQUAL(other.GetDirtyCount(), 1u);
+    book.Recalculate();
+    ASSERT_EQUAL(orders.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(other.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(other.GetCell("A1"_pos)->GetValue(), CellInterface::Value(36.0));
+
+    bool caught = false;
+    try {
+        prices.SetCell("A1"_pos, "='It''s other'!A1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    caught = false;
+    try {
+        prices.SetCell("A2"_pos, "=Missing!A1");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    auto single = CreateSheet();
+    single->SetCell("A1"_pos, "=1+2");
+    ASSERT(ParseFormula("Prices!A1")->Evaluate(*single)
+           == FormulaInterface::Value(FormulaError::Category::Ref));
+}
+
+void TestPaging() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path() / "spreadsheet_test.spill";
+
+    Sheet sheet;
+    PagingOptions options;
+    options.spill_path = path.string();
+    options.memory_budget = 16 << 10;
+    options.rows_per_page = 16;
+    sheet.EnablePaging(options);
+
+    sheet.SetCell("A1"_pos, "=B1*2");
+    sheet.SetCell("B1"_pos, "21");
+    for (int row = 16; row < 1000; ++row) {
+        sheet.SetCell(Position{row, 0}, "text " + std::to_string(row));
+        sheet.SetCell(Position{row, 2}, "=" + std::to_string(row) + "/2");
+    }
+    PagingStats stats = sheet.GetPagingStats();
+    ASSERT(stats.page_outs > 0);
+    ASSERT(stats.spilled_pages > 0);
+    ASSERT(stats.resident_bytes <= options.memory_budget);
+    ASSERT(fs::exists(path));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1000, 3}));
+
+    ASSERT_EQUAL(sheet.GetCell(Position{20, 0})->GetText(), "text 20");
+    ASSERT_EQUAL(sheet.GetCell(Position{20, 2})->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+    ASSERT(sheet.GetPagingStats().page_ins > stats.page_ins);
+
+    // формула, сославшаяся на выгруженную ячейку, загружает её страницу
+    sheet.SetCell("B2"_pos, "=C900+1");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(450.5));
+
+    Sheet plain;
+    for (int row = 0; row < 1000; ++row) {
+        for (int col = 0; col < 3; ++col) {
+            if (const CellInterface* cell = sheet.GetCell(Position{row, col})) {
+                plain.SetCell(Position{row, col}, cell->GetText());
+            }
+        }
+    }
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    std::ostringstream expected_texts;
+    plain.PrintTexts(expected_texts);
+    std::ostringstream expected_values;
+    plain.PrintValues(expected_values);
+    ASSERT_EQUAL(texts.str(), expected_texts.str());
+    ASSERT_EQUAL(values.str(), expected_values.str());
+    ASSERT(sheet.GetPagingStats().resident_bytes <= options.memory_budget);
+
+    // константный лист загружает выгруженные страницы так же прозрачно
+    const SheetInterface& view = sheet;
+    ASSERT(sheet.GetPagingStats().spilled_pages > 0);
+    ASSERT_EQUAL(view.GetCell(Position{20, 0})->GetText(), "text 20");
+    std::ostringstream view_texts;
+    view.PrintTexts(view_texts);
+    std::ostringstream view_values;
+    view.PrintValues(view_values);
+    ASSERT_EQUAL(view_texts.str(), expected_texts.str());
+    ASSERT_EQUAL(view_values.str(), expected_values.str());
+    ASSERT(sheet.GetPagingStats().resident_bytes <= options.memory_budget);
+}
+
+void TestPagingLinkedCells() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path() / "spreadsheet_linked_test.spill";
+
+    Sheet sheet;
+    PagingOptions options;
+    options.spill_path = path.string();
+    options.memory_budget = 256 << 10;
+    options.rows_per_page = 16;
+    sheet.EnablePaging(options);
+
+    // цепочка формул через все страницы: каждая ячейка связана с соседними,
+    // а длинный текст рядом с ней ни с чем не связан
+    constexpr int ROWS = 1000;
+    const std::string padding(200, 'x');
+    sheet.SetCell("C1"_pos, "=A" + std::to_string(ROWS));
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < ROWS; ++row) {
+        sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+        sheet.SetCell(Position{row, 1}, padding + std::to_string(row));
+    }
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(double(ROWS)));
+    sheet.SetCell("D1"_pos, "edit");
+    const PagingStats stats = sheet.GetPagingStats();
+    ASSERT(stats.spilled_pages > 0);
+    ASSERT(stats.resident_bytes <= options.memory_budget);
+
+    // формула читает значение выгруженной формулы без загрузки её страницы
+    const Sheet& view = sheet;
+    ASSERT_EQUAL(view.GetCell("C1"_pos)->GetValue(), CellInterface::Value(double(ROWS)));
+    ASSERT_EQUAL(sheet.GetPagingStats().page_ins, stats.page_ins);
+    // а чтение самой ячейки загружает страницу
+    ASSERT_EQUAL(view.GetCell("A20"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(sheet.GetPagingStats().page_ins, stats.page_ins + 1);
+
+    // пересчёт через выгруженные формулы загружает их страницы
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(ROWS + 4.0));
+    ASSERT(sheet.GetPagingStats().page_ins > stats.page_ins);
+    ASSERT_EQUAL(sheet.GetCell("A500"_pos)->GetText(), "=A499+1");
+    ASSERT_EQUAL(sheet.GetCell("B500"_pos)->GetText(), padding + "499");
+    sheet.SetCell("A500"_pos, "0");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(double(ROWS - 500)));
+
+    std::ostringstream texts;
+    sheet.PrintTexts(texts);
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT(texts.str().find("=A999+1\t" + padding + "999\t\t\n") != std::string::npos);
+    ASSERT(values.str().find("\n500\t" + padding + "999\t\t\n") != std::string::npos);
+    ASSERT(sheet.GetPagingStats().resident_bytes <= options.memory_budget);
+}
+
+void TestZOrderLayout() {
+    ASSERT_EQUAL(MortonEncode({0, 1}), 1u);
+    ASSERT_EQUAL(MortonEncode({1, 0}), 2u);
+    ASSERT_EQUAL(MortonEncode({3, 3}), 15u);
+    const Position far{Position::MAX_ROWS - 1, Position::MAX_COLS - 2};
+    ASSERT_EQUAL(MortonDecode(MortonEncode(far)), far);
+
+    Sheet rows;
+    Sheet tiles(Sheet::Layout::ZOrder);
+    auto set = [&](Position pos, const std::string& text) {
+        rows.SetCell(pos, text);
+        tiles.SetCell(pos, text);
+    };
+    for (int row = 0; row < 40; row += 3) {
+        for (int col = 0; col < 30; col += 2) {
+            set(Position{row, col}, std::to_string(row * 100 + col));
+        }
+    }
+    set("Z100"_pos, "=A1+C4");
+    set("B50"_pos, "=Z100*2");
+    set("D7"_pos, "text");
+    set("A1"_pos, "5");
+    rows.ClearCell("E4"_pos);
+    tiles.ClearCell("E4"_pos);
+    ASSERT(tiles.GetCell("E4"_pos) == nullptr);
+    ASSERT_EQUAL(tiles.GetCell("B50"_pos)->GetValue(), CellInterface::Value(614.0));
+    ASSERT_EQUAL(tiles.GetPrintableSize(), rows.GetPrintableSize());
+
+    for (const Rect rect : {Rect{{0, 0}, {100, 30}}, Rect{{5, 3}, {17, 9}}, Rect{{49, 1}, {1, 1}}}) {
+        for (const auto order : {Sheet::Order::RowMajor, Sheet::Order::ColumnMajor}) {
+            std::vector<CellInterface::Value> expected(size_t(rect.size.rows) * rect.size.cols);
+            std::vector<CellInterface::Value> actual(expected.size());
+            rows.GetValues(rect, expected.data(), order);
+            tiles.GetValues(rect, actual.data(), order);
+            ASSERT(expected == actual);
+        }
+    }
+
+    std::ostringstream expected;
+    rows.PrintValues(expected);
+    rows.PrintTexts(expected);
+    std::ostringstream actual;
+    tiles.PrintValues(actual);
+    tiles.PrintTexts(actual);
+    ASSERT_EQUAL(actual.str(), expected.str());
+}
+
+void TestEvaluationProfiler() {
+    Workbook book;
+    Sheet& sheet = book.AddSheet("Main");
+    Sheet& data = book.AddSheet("Data");
+    data.SetCell("A1"_pos, "=2+3");
+    sheet.SetCell("D1"_pos, "=Data!A1");
+    sheet.SetCell("B1"_pos, "=D1*2");
+    sheet.SetCell("C1"_pos, "=D1+1");
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    ASSERT(sheet.GetProfile().empty());
+
+    sheet.EnableProfiling(true);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(16.0));
+    const auto profile = sheet.GetProfile();
+    ASSERT_EQUAL(profile.size(), 5u);
+    ASSERT_EQUAL(profile.front().cell, "A1");
+    ASSERT_EQUAL(profile.front().profile.dependencies, 2u);
+    for (const auto& entry : profile) {
+        ASSERT_EQUAL(entry.profile.evaluations, 1u);
+        ASSERT(entry.profile.exclusive <= entry.profile.inclusive);
+    }
+
+    const auto path = sheet.GetCriticalPath();
+    ASSERT_EQUAL(path.size(), 4u);
+    ASSERT_EQUAL(path.front(), "A1");
+    ASSERT_EQUAL(path[2], "D1");
+    ASSERT_EQUAL(path.back(), "Data!A1");
+
+    // Data!A1 вычисляется один раз, ради той формулы, что дошла до неё первой
+    std::ostringstream stacks;
+    sheet.WriteCollapsedStacks(stacks);
+    std::istringstream lines(stacks.str());
+    std::vector<std::string> frames;
+    for (std::string line; std::getline(lines, line);) {
+        frames.push_back(line.substr(0, line.rfind(' ')));
+    }
+    std::sort(frames.begin(), frames.end());
+    ASSERT_EQUAL(frames.size(), 5u);
+    ASSERT_EQUAL(frames[0], "A1");
+    ASSERT((frames[1] == "A1;B1" && frames[2] == "A1;B1;D1" && frames[3] == "A1;B1;D1;Data!A1"
+            && frames[4] == "A1;C1")
+           || (frames[1] == "A1;B1" && frames[2] == "A1;C1" && frames[3] == "A1;C1;D1"
+               && frames[4] == "A1;C1;D1;Data!A1"));
+
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetProfile().size(), 4u);
+    // ячейка другого листа удаляется и из профиля этого листа
+    sheet.SetCell("D1"_pos, "=5");
+    data.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetProfile().size(), 3u);
+    for (const auto& entry : sheet.GetProfile()) {
+        ASSERT(entry.cell != "Data!A1" && entry.cell != "?");
+    }
+    sheet.EnableProfiling(false);
+    ASSERT(sheet.GetProfile().empty());
+}
+
+void TestSharedSubexpressions() {
+    Sheet sheet;
+    sheet.EnableExpressionSharing(true);
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("C1"_pos, "3");
+    sheet.SetCell("A1"_pos, "=(B1+C1)*2");
+    // одно вхождение ещё не делает подвыражение общим
+    ASSERT_EQUAL(sheet.GetSharedExpressionCount(), 0u);
+    sheet.SetCell("A2"_pos, "=(B1+C1)/5");
+    sheet.SetCell("A3"_pos, "=((B1+C1)/5)-1");
+    sheet.SetCell("A4"_pos, "=(B1+C1)/5+1");
+    ASSERT_EQUAL(sheet.GetSharedExpressionCount(), 2u);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=(B1+C1)*2");
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=(B1+C1)/5-1");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetReferencedCells(), (std::vector{"B1"_pos, "C1"_pos}));
+
+    // общее подвыражение вычисляется один раз за пересчёт
+    sheet.EnableProfiling(true);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+    for (const auto& entry : sheet.GetProfile()) {
+        ASSERT_EQUAL(entry.profile.evaluations, 1u);
+    }
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetValue(), CellInterface::Value(2.0));
+    // четыре формулы и две скрытые ячейки
+    ASSERT_EQUAL(sheet.GetProfile().size(), 6u);
+
+    // изменение ячейки сбрасывает общее подвыражение вместе с формулами
+    sheet.SetCell("C1"_pos, "8");
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(1.0));
+    try {
+        sheet.SetCell("C1"_pos, "=A2");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    try {
+        sheet.SetCell("B1"_pos, "=(B1+C1)*3");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "2");
+    ASSERT_EQUAL(sheet.GetSharedExpressionCount(), 2u);
+
+    // скрытые ячейки удаляются вместе с последней ссылающейся формулой
+    sheet.ClearCell("A3"_pos);
+    ASSERT_EQUAL(sheet.GetSharedExpressionCount(), 2u);
+    sheet.ClearCell("A4"_pos);
+    ASSERT_EQUAL(sheet.GetSharedExpressionCount(), 1u);
+    sheet.SetCell("A2"_pos, "=B1");
+    sheet.ClearCell("A1"_pos);
+    ASSERT_EQUAL(sheet.GetSharedExpressionCount(), 0u);
+    ASSERT(!sheet.GetCellRef("C1"_pos)->IsReferenced());
+}
+
+void TestRedundantSet() {
+    Sheet sheet;
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("A1"_pos, "=B1+1");
+    sheet.SetCell("A2"_pos, "=A1*2");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    // тот же текст и та же формула в другой записи не сбрасывают кеш
+    sheet.SetCell("B1"_pos, "2");
+    sheet.SetCell("A1"_pos, "=B1+1");
+    sheet.SetCell("A1"_pos, "=(B1)+1");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT(!sheet.GetCellRef("A2"_pos)->IsDirty());
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1+1");
+
+    // изменённая формула меняет только свои связи
+    sheet.SetCell("A1"_pos, "=B1+C1");
+    ASSERT(sheet.GetCellRef("A2"_pos)->IsDirty());
+    ASSERT(sheet.GetCellRef("B1"_pos)->IsReferenced());
+    ASSERT(sheet.GetCellRef("C1"_pos)->IsReferenced());
+    sheet.SetCell("A1"_pos, "=C1");
+    ASSERT(!sheet.GetCellRef("B1"_pos)->IsReferenced());
+    sheet.SetCell("C1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+}
+
+void TestRecordingSheet() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path() / "spreadsheet_test.trace";
+    {
+        auto sheet = CreateSheet();
+        RecordingSheet recording(*sheet, path.string());
+        recording.SetCell("A1"_pos, "=B2*2");
+        recording.SetCell("B2"_pos, "21");
+        ASSERT_EQUAL(recording.GetCell("A1"_pos)->GetValue(), CellInterface::Value(42.0));
+        ASSERT_EQUAL(recording.GetCell("B2"_pos)->GetText(), "21");
+        ASSERT(recording.GetCell("C3"_pos) == nullptr);
+        try {
+            recording.SetCell("B2"_pos, "=A1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        recording.ClearCell("A1"_pos);
+        std::ostringstream out;
+        recording.PrintValues(out);
+        ASSERT_EQUAL(out.str(), "\t\n\t21\n");
+        // посредник живёт, пока ячейка не очищена
+        ASSERT_EQUAL(recording.GetProxyCount(), 1u);
+        sheet->ClearCell("B2"_pos);
+        ASSERT(recording.GetCell("B2"_pos) == nullptr);
+        ASSERT_EQUAL(recording.GetProxyCount(), 0u);
+    }
+
+    TraceReader reader(path.string());
+    std::vector<TraceRecord> records;
+    while (auto record = reader.Next()) {
+        records.push_back(*record);
+    }
+    const std::vector<TraceOp> ops{TraceOp::SetCell, TraceOp::SetCell, TraceOp::GetValue,
+                                   TraceOp::GetText, TraceOp::SetCell, TraceOp::ClearCell,
+                                   TraceOp::PrintValues};
+    ASSERT_EQUAL(records.size(), ops.size());
+    for (size_t i = 0; i < ops.size(); ++i) {
+        ASSERT(records[i].op == ops[i]);
+        if (i > 0) {
+            ASSERT(records[i].offset >= records[i - 1].offset);
+        }
+    }
+    ASSERT_EQUAL(records[0].pos, "A1"_pos);
+    ASSERT_EQUAL(records[0].text, "=B2*2");
+    ASSERT_EQUAL(records[3].pos, "B2"_pos);
+    ASSERT_EQUAL(records[4].text, "=A1");
+    ASSERT_EQUAL(records[5].pos, "A1"_pos);
+
+    // слишком длинный текст отвергается целиком, и трасса остаётся читаемой
+    {
+        TraceWriter writer(path.string());
+        try {
+            writer.Write(TraceOp::SetCell, "A1"_pos, std::string(TRACE_MAX_TEXT + 1, 'x'));
+            ASSERT(false);
+        } catch (const TraceException&) {
+        }
+        writer.Write(TraceOp::SetCell, "B2"_pos, "7");
+    }
+    {
+        TraceReader written(path.string());
+        const auto record = written.Next();
+        ASSERT(record.has_value());
+        ASSERT(record->op == TraceOp::SetCell);
+        ASSERT_EQUAL(record->pos, "B2"_pos);
+        ASSERT_EQUAL(record->text, "7");
+        ASSERT(!written.Next().has_value());
+    }
+
+    // длина текста из повреждённой трассы не становится размером буфера
+    {
+        std::ofstream trace(path, std::ios::binary);
+        trace << "SST1" << char(TraceOp::SetCell) << '\0' << '\0' << '\0'
+              << std::string(9, char(0xFF)) << '\1';
+    }
+    try {
+        TraceReader(path.string()).Next();
+        ASSERT(false);
+    } catch (const TraceException&) {
+    }
+    fs::remove(path);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+void TestSheetServer() {
+    namespace fs = std::filesystem;
+    const fs::path path = fs::temp_directory_path() / "spreadsheet_test.sock";
+    Workbook book;
+    book.AddSheet("Data").SetCell("A1"_pos, "5");
+    book.AddSheet("Main");
+    SheetServer server(book, path.string());
+    std::thread thread([&server] {
+        server.Run();
+    });
+    {
+        // запросы отправляются одной записью, ответы приходят по порядку
+        SheetClient client(path.string());
+        client.SetCell(1, "A1"_pos, "=Data!A1*2");
+        client.SetCell(1, "B1"_pos, "text");
+        client.SetCell(1, "C1"_pos, "=C1");
+        client.SetCell(1, "D1"_pos, "=1+");
+        client.GetValue(1, "A1"_pos);
+        client.GetText(1, "A1"_pos);
+        client.GetValues(1, {"A1"_pos, {2, 3}});
+        client.GetValue(2, "A1"_pos);
+        client.ClearCell(1, "B1"_pos);
+        client.GetValue(1, "B1"_pos);
+        client.GetValue(1, Position::NONE);
+        client.Flush();
+        ASSERT_EQUAL(client.GetPendingCount(), 11u);
+
+        ASSERT(client.Receive().error == WireError::None);
+        ASSERT(client.Receive().error == WireError::None);
+        ASSERT(client.Receive().error == WireError::CircularDependency);
+        ASSERT(client.Receive().error == WireError::Formula);
+        auto response = client.Receive();
+        ASSERT_EQUAL(response.values, std::vector<CellInterface::Value>{10.0});
+        ASSERT_EQUAL(client.Receive().text, "=Data!A1*2");
+        response = client.Receive();
+        ASSERT_EQUAL(response.values, (std::vector<CellInterface::Value>{10.0, "text", "", "", "", ""}));
+        ASSERT(client.Receive().error == WireError::UnknownSheet);
+        ASSERT(client.Receive().error == WireError::None);
+        ASSERT_EQUAL(client.Receive().values, std::vector<CellInterface::Value>{""});
+        ASSERT(client.Receive().error == WireError::InvalidPosition);
+        ASSERT_EQUAL(client.GetPendingCount(), 0u);
+    }
+    server.Stop();
+    thread.join();
+    const ServerStats stats = server.GetStats();
+    ASSERT_EQUAL(stats.requests, 11u);
+    ASSERT(stats.batches < stats.requests);
+    ASSERT_EQUAL(book.GetSheet("Main")->GetCell("A1"_pos)->GetValue(), CellInterface::Value(10.0));
+}
+#endif
+
+void TestManualCalcMode() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    // цепочка в порядке хранения перевёрнута относительно зависимостей
+    sheet.SetCell("B1"_pos, "=B2+1");
+    sheet.SetCell("B2"_pos, "=B3+1");
+    sheet.SetCell("B3"_pos, "=A1*10");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(12.0));
+
+    sheet.SetCalcMode(Sheet::CalcMode::Manual);
+    sheet.SetCell("A1"_pos, "2");
+    // пользователи изменённой ячейки сохраняют прежние значения
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(12.0));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(), CellInterface::Value(10.0));
+    sheet.SetCell("C1"_pos, "=B1*2");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 1u);
+
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(22.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(44.0));
+
+    // каждая устаревшая формула вычисляется за пересчёт один раз
+    sheet.EnableProfiling(true);
+    sheet.SetCell("A1"_pos, "3");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(64.0));
+    ASSERT_EQUAL(sheet.GetProfile().size(), 4u);
+    sheet.EnableProfiling(false);
+
+    sheet.SetCell("A1"_pos, "4");
+    sheet.ClearCell("C1"_pos);
+    sheet.SetCell("B3"_pos, "=A1");
+    sheet.SetCalcMode(Sheet::CalcMode::Automatic);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(7.0));
+}
+
+void TestPartitionedSheet() {
+    PartitionedSheet sheet(16);
+    constexpr int THREADS = 4;
+    constexpr int ROWS = 16;
+    // каждый поток строит цепочку формул в своей области
+    std::vector<std::thread> writers;
+    for (int t = 0; t < THREADS; ++t) {
+        writers.emplace_back([&sheet, t] {
+            const int base = t * ROWS;
+            for (int round = 0; round < 50; ++round) {
+                sheet.SetCell({base, 0}, std::to_string(round));
+                for (int row = base + 1; row < base + ROWS; ++row) {
+                    sheet.SetCell({row, 0}, "=" + Position{row - 1, 0}.ToString() + "+1");
+                }
+                ASSERT_EQUAL(sheet.GetValue({base + ROWS - 1, 0}), CellInterface::Value(double(round + ROWS - 1)));
+            }
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    ASSERT(sheet.GetStats().local > 0);
+
+    // ссылка между областями переводит обе в исключительный режим
+    sheet.SetCell("B1"_pos, "=A32*2");
+    ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(2 * (49.0 + ROWS - 1)));
+    const size_t exclusive = sheet.GetStats().exclusive;
+    sheet.SetCell("A17"_pos, "100");
+    ASSERT_EQUAL(sheet.GetStats().exclusive, exclusive + 1);
+    ASSERT_EQUAL(sheet.GetValue("B1"_pos), CellInterface::Value(2 * (100.0 + ROWS - 1)));
+    try {
+        sheet.SetCell("A17"_pos, "=B1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    // без ссылки между областями они снова независимы
+    sheet.ClearCell("B1"_pos);
+    const size_t local = sheet.GetStats().local;
+    sheet.SetCell("A17"_pos, "1");
+    ASSERT_EQUAL(sheet.GetStats().local, local + 1);
+    ASSERT_EQUAL(sheet.GetText("A18"_pos), "=A17+1");
+    ASSERT_EQUAL(sheet.GetValue("A32"_pos), CellInterface::Value(16.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{THREADS * ROWS, 1}));
+}
+
+void TestLookupFunctions() {
+    Sheet sheet;
+    constexpr int ROWS = 1000;
+    // таблица: код, название и цена; коды по возрастанию
+    for (int row = 0; row < ROWS; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row * 10));
+        sheet.SetCell({row, 1}, "item" + std::to_string(row));
+        sheet.SetCell({row, 2}, std::to_string(row) + ".5");
+    }
+    sheet.SetCell("E1"_pos, "=vlookup(D1,A1:C1000,3,0)");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=VLOOKUP(D1,A1:C1000,3,0)");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetReferencedCells(), std::vector{"D1"_pos});
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA));
+    // индекс строится при первом поиске
+    ASSERT_EQUAL(sheet.GetLookupIndexCount(), 0u);
+    sheet.SetCell("D1"_pos, "420");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(42.5));
+    ASSERT_EQUAL(sheet.GetLookupIndexCount(), 1u);
+    sheet.SetCell("E2"_pos, "=MATCH(\"item7\",B1:B1000,0)+XLOOKUP(D1,A1:A1000,C1:C1000)");
+    ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(50.5));
+    ASSERT_EQUAL(sheet.GetLookupIndexCount(), 3u);
+    // приблизительный поиск двоичный и обходится без индекса
+    sheet.SetCell("E3"_pos, "=VLOOKUP(425,A1:C1000,3)*0+MATCH(9999,A1:A1000)");
+    ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetValue(), CellInterface::Value(double(ROWS)));
+    sheet.SetCell("E4"_pos, "=XLOOKUP(1,A1:A1000,C1:C1000,-1)");
+    ASSERT_EQUAL(sheet.GetCell("E4"_pos)->GetValue(), CellInterface::Value(-1.0));
+
+    // изменения столбца сразу попадают в индекс
+    sheet.SetCell("A43"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA));
+    ASSERT_EQUAL(sheet.GetCell("E4"_pos)->GetValue(), CellInterface::Value(42.5));
+    sheet.SetCell("A2"_pos, "=D1");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(1.5));
+    sheet.ClearCell("A2"_pos);
+    sheet.SetCell("A1500"_pos, "420");
+    sheet.SetCell("A900"_pos, "'420");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(899.5));
+    sheet.SetCell("C900"_pos, "=D1/4");
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetValue(), CellInterface::Value(105.0));
+
+    try {
+        sheet.SetCell("C900"_pos, "=E1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    for (const std::string formula : {"=SUMX(A1:A2)", "=MATCH(1)", "=MATCH(1,2)",
+                                      "=VLOOKUP(1,A1:B2,\"x\")", "=A1:B2", "=MATCH(1,A1:B)"}) {
+        try {
+            sheet.SetCell("F1"_pos, formula);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    // скрытая ячейка области удаляется вместе с последней формулой
+    sheet.ClearCell("E1"_pos);
+    sheet.ClearCell("E3"_pos);
+    ASSERT_EQUAL(sheet.GetLookupIndexCount(), 2u);
+    sheet.ClearCell("E2"_pos);
+    sheet.ClearCell("E4"_pos);
+    ASSERT_EQUAL(sheet.GetLookupIndexCount(), 0u);
+    ASSERT(!sheet.GetCellRef("A1"_pos)->IsReferenced());
+
+    // значения формул столбца индексируются после их вычисления
+    Sheet formulas;
+    for (int row = 0; row < ROWS; ++row) {
+        formulas.SetCell({row, 1}, std::to_string(row));
+        formulas.SetCell({row, 0}, "=B" + std::to_string(row + 1) + "*2");
+    }
+    formulas.SetCell("D1"_pos, "=MATCH(C1,A1:A1000,0)");
+    formulas.SetCell("C1"_pos, "1000");
+    ASSERT_EQUAL(formulas.GetCell("D1"_pos)->GetValue(), CellInterface::Value(501.0));
+    formulas.SetCell("B501"_pos, "7");
+    ASSERT_EQUAL(formulas.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::NA));
+    formulas.SetCell("B900"_pos, "500");
+    formulas.SetCell("B3"_pos, "500");
+    ASSERT_EQUAL(formulas.GetCell("D1"_pos)->GetValue(), CellInterface::Value(3.0));
+    formulas.SetCell("A3"_pos, "text");
+    ASSERT_EQUAL(formulas.GetCell("D1"_pos)->GetValue(), CellInterface::Value(900.0));
+    formulas.SetCell("A2"_pos, "=C1");
+    ASSERT_EQUAL(formulas.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+    formulas.SetCell("C1"_pos, "14");
+    ASSERT_EQUAL(formulas.GetCell("D1"_pos)->GetValue(), CellInterface::Value(2.0));
+    formulas.ClearCell("A2"_pos);
+    ASSERT_EQUAL(formulas.GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0));
+}
+
+void TestRangeAggregates() {
+    Sheet sheet;
+    constexpr int ROWS = Position::MAX_ROWS;
+    for (int row = 0; row < ROWS; ++row) {
+        sheet.SetCell({row, 0}, std::to_string(row + 1));
+    }
+    const std::string column = "A1:A" + std::to_string(ROWS);
+    sheet.SetCell("C1"_pos, "=sum(" + column + ")");
+    sheet.SetCell("C2"_pos, "=COUNT(" + column + ")");
+    sheet.SetCell("C3"_pos, "=MAX(" + column + ")");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=SUM(" + column + ")");
+    const double total = double(ROWS) * (ROWS + 1) / 2;
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(double(ROWS)));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(double(ROWS)));
+    ASSERT_EQUAL(sheet.GetRangeTotalsCount(), 1u);
+
+    // правка одной ячейки обновляет итоги без обхода столбца
+    sheet.SetCell(Position{ROWS - 1, 0}, "0.5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total - ROWS + 0.5));
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(double(ROWS - 1)));
+    sheet.SetCell("A2"_pos, "text");
+    sheet.ClearCell("A3"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total - ROWS + 0.5 - 5));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(double(ROWS - 2)));
+
+    // значения формул области учитываются после их пересчёта
+    sheet.SetCell("E1"_pos, "1");
+    sheet.SetCell("A1"_pos, "=E1*-3");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total - ROWS + 0.5 - 9));
+    sheet.SetCell("E1"_pos, "-2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total - ROWS + 0.5));
+    sheet.SetCell("C4"_pos, "=MIN(" + column + ")");
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(0.5));
+    sheet.SetCell("E1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(-3.0));
+    ASSERT_EQUAL(sheet.GetRangeTotalsCount(), 1u);
+
+    // ошибка области - значение суммы, но не счёта
+    sheet.SetCell("A5"_pos, "=1/0");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(double(ROWS - 3)));
+    // из нескольких ошибок итог - первая по строкам области
+    sheet.SetCell("F9"_pos, "x");
+    sheet.SetCell("A8"_pos, "=F9");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    sheet.SetCell("A5"_pos, "5");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    sheet.SetCell("A8"_pos, "8");
+    sheet.ClearCell("F9"_pos);
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total - ROWS + 0.5 - 9));
+
+    // в ручном режиме итоги следуют за пересчётом
+    sheet.SetCalcMode(Sheet::CalcMode::Manual);
+    sheet.SetCell("E1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total - ROWS + 0.5 - 9));
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(total - ROWS + 0.5 - 12));
+    sheet.SetCalcMode(Sheet::CalcMode::Automatic);
+
+    // аргументы-числа и области без чисел
+    sheet.SetCell("G1"_pos, "=SUM(E1:F2,10,E1)+COUNT(E1,F1)+MAX(F1:F3)+MIN(F1:F3,-1)");
+    ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetValue(), CellInterface::Value(14.0 + 2.0 + 0.0 - 1.0));
+    for (const std::string formula : {"=SUM()", "=COUNT(\"x\")", "=MAX(A1:A2"}) {
+        try {
+            sheet.SetCell("G2"_pos, formula);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    sheet.ClearCell("C1"_pos);
+    sheet.ClearCell("C2"_pos);
+    sheet.ClearCell("C3"_pos);
+    sheet.ClearCell("C4"_pos);
+    ASSERT_EQUAL(sheet.GetRangeTotalsCount(), 2u);
+    sheet.ClearCell("G1"_pos);
+    ASSERT_EQUAL(sheet.GetRangeTotalsCount(), 0u);
+}
+
+void TestManyRanges() {
+    Sheet sheet;
+    constexpr int RANGES = 3000;
+    // суммы по 20 строк со сдвигом на 5: области перекрываются и пересекают
+    // границы блоков индекса областей
+    const std::string columns[] = {"KO", "B", "C", "D"};
+    const auto range = [&columns](int index) {
+        const std::string& column = columns[index % 4];
+        const int row = index / 4 * 5 + 1;
+        return column + std::to_string(row) + ":" + column + std::to_string(row + 19);
+    };
+    for (int index = 0; index < RANGES; ++index) {
+        sheet.SetCell(Position{index, 500}, "=SUM(" + range(index) + ")");
+        ASSERT_EQUAL(sheet.GetCell(Position{index, 500})->GetValue(), CellInterface::Value(0.0));
+    }
+    sheet.SetCell("B258"_pos, "2");
+    sheet.SetCell("KO300"_pos, "3");
+    sheet.SetCell("C3000"_pos, "4");
+    int with_b = 0;
+    int with_ko = 0;
+    for (int index = 0; index < RANGES; ++index) {
+        const auto value = std::get<double>(sheet.GetCell(Position{index, 500})->GetValue());
+        const int row = index / 4 * 5 + 1;
+        if (index % 4 == 1 && row <= 258 && 258 < row + 20) {
+            ASSERT_EQUAL(value, 2.0);
+            ++with_b;
+        } else if (index % 4 == 0 && row <= 300 && 300 < row + 20) {
+            ASSERT_EQUAL(value, 3.0);
+            ++with_ko;
+        } else if (index % 4 == 2 && row <= 3000 && 3000 < row + 20) {
+            ASSERT_EQUAL(value, 4.0);
+        } else {
+            ASSERT_EQUAL(value, 0.0);
+        }
+    }
+    ASSERT_EQUAL(with_b, 4);
+    ASSERT_EQUAL(with_ko, 4);
+
+    // удалённые области больше не обновляются
+    for (int index = 0; index < RANGES; ++index) {
+        sheet.ClearCell(Position{index, 500});
+    }
+    ASSERT_EQUAL(sheet.GetRangeTotalsCount(), 0u);
+    sheet.SetCell("B258"_pos, "5");
+    sheet.SetCell("B1"_pos, "=SUM(B250:B260)");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(5.0));
+}
+
+void TestArrowExport() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1.5");
+    sheet.SetCell("A2"_pos, "text");
+    sheet.SetCell("A3"_pos, "=1/0");
+    sheet.SetCell("A4"_pos, "'42");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B4"_pos, "=A2");
+    const Rect rect{{0, 0}, {10, 2}};
+
+    std::ostringstream stream;
+    ExportArrow(sheet, rect, stream, ArrowFormat::Stream, 4);
+    std::ostringstream file;
+    ExportArrow(sheet, rect, file, ArrowFormat::File, 4);
+    const std::string stream_bytes = stream.str();
+    const std::string file_bytes = file.str();
+    const std::string continuation(4, '\xFF');
+    const std::string end_of_stream = continuation + std::string(4, '\0');
+    ASSERT_EQUAL(stream_bytes.substr(0, 4), continuation);
+    ASSERT_EQUAL(stream_bytes.substr(stream_bytes.size() - 8), end_of_stream);
+    ASSERT_EQUAL(stream_bytes.size() % 8, 0u);
+    // файл - тот же поток между метками и оглавление пачек
+    ASSERT_EQUAL(file_bytes.substr(0, 8), std::string("ARROW1\0\0", 8));
+    ASSERT_EQUAL(file_bytes.substr(8, stream_bytes.size()), stream_bytes);
+    ASSERT_EQUAL(file_bytes.substr(file_bytes.size() - 6), "ARROW1");
+    int32_t footer_size = 0;
+    std::memcpy(&footer_size, file_bytes.data() + file_bytes.size() - 10, sizeof(footer_size));
+    ASSERT_EQUAL(8 + stream_bytes.size() + footer_size + 10, file_bytes.size());
+
+    // числа лежат в буферах как есть, текст - подряд
+    const double number = 3.0;
+    ASSERT(stream_bytes.find(std::string(reinterpret_cast<const char*>(&number), sizeof(number)))
+           != std::string::npos);
+    ASSERT(stream_bytes.find("text42") != std::string::npos);
+    ASSERT(stream_bytes.find("B_error") != std::string::npos);
+
+    // пачки пишутся в поток сразу
+    std::ostringstream partial;
+    ArrowWriter writer(partial, 0, 2, ArrowFormat::Stream);
+    const size_t schema_size = partial.str().size();
+    writer.WriteBatch(sheet, 0, 4);
+    ASSERT(partial.str().size() > schema_size);
+    writer.Finish();
+    ASSERT_EQUAL(partial.str().substr(partial.str().size() - 8), end_of_stream);
+
+    try {
+        ArrowWriter invalid(partial, Position::MAX_COLS - 1, 2);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+}
+
+void TestDeepDependencyChain() {
+    auto sheet = CreateSheet();
+    constexpr int rows = Position::MAX_ROWS;
+    sheet->SetCell("A1"_pos, "=B1");
+    for (int row = 1; row < rows; ++row) {
+        const std::string current = std::to_string(row + 1);
+        sheet->SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+B" + current);
+        sheet->SetCell(Position{row, 1}, "1");
+    }
+    ASSERT_EQUAL(sheet->GetCell(Position{rows - 1, 0})->GetValue(),
+                 CellInterface::Value(double(rows - 1)));
+
+    sheet->SetCell("B1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell(Position{rows - 1, 0})->GetValue(),
+                 CellInterface::Value(double(rows + 4)));
+
+    bool caught = false;
+    try {
+        sheet->SetCell("B1"_pos, "=" + Position{rows - 1, 0}.ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestRecalcBudget() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 1; row < 100; ++row) {
+        sheet.SetCell(Position{row, 0}, "=A" + std::to_string(row) + "+1");
+    }
+    ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetValue(), CellInterface::Value(100.0));
+
+    // отменённый пересчёт делает один шаг: первый вызов только начинает
+    // обход зависимостей, следующие продолжают его с места остановки
+    CancellationToken token;
+    token.Cancel();
+    sheet.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 99u);
+    size_t remaining = sheet.Recalculate(EvalBudget(token));
+    ASSERT_EQUAL(remaining, 99u);
+    size_t calls = 1;
+    while (remaining > 0) {
+        if (calls == 50) {
+            // правка отменяет прерванный обход, он начинается заново
+            sheet.SetCell("A1"_pos, "6");
+        }
+        remaining = sheet.Recalculate(EvalBudget(EvalBudget::Clock::now()));
+        ++calls;
+    }
+    // на формулу приходится не больше четырёх шагов: снятие со стека
+    // корнем и зависимостью, завершение обхода и вычисление
+    ASSERT(calls <= 50 + 4 * 99);
+    ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetValue(), CellInterface::Value(105.0));
+
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT(!sheet.Evaluate({"A1"_pos, {100, 1}}, EvalBudget(token)));
+    ASSERT(!sheet.Evaluate({"A1"_pos, {100, 1}}, EvalBudget(token)));
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 99u);
+    // продолжение с того же места даёт те же значения
+    ASSERT(sheet.Evaluate({"A1"_pos, {100, 1}}, EvalBudget::For(std::chrono::hours(1))));
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("A100"_pos)->GetValue(), CellInterface::Value(103.0));
+
+    sheet.SetCalcMode(Sheet::CalcMode::Manual);
+    sheet.SetCell("A1"_pos, "7");
+    sheet.SetCell("B1"_pos, "=A100*2");
+    // первый пересчёт сбрасывает кеш пользователей правки, дальше каждый
+    // прерванный пересчёт продолжает цепочку
+    remaining = sheet.Recalculate(EvalBudget(token));
+    ASSERT_EQUAL(remaining, 99u);
+    while (remaining > 0) {
+        const size_t left = sheet.Recalculate(EvalBudget(token));
+        ASSERT(left < remaining);
+        remaining = left;
+    }
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(212.0));
+
+    Workbook book;
+    Sheet& first = book.AddSheet("First");
+    Sheet& second = book.AddSheet("Second");
+    first.SetCell("A1"_pos, "1");
+    first.SetCell("A2"_pos, "=A1+1");
+    first.SetCell("A3"_pos, "=A2+1");
+    second.SetCell("A1"_pos, "=First!A3*10");
+    ASSERT_EQUAL(second.GetCell("A1"_pos)->GetValue(), CellInterface::Value(30.0));
+    first.SetCell("A1"_pos, "2");
+    ASSERT(!book.Recalculate(EvalBudget(token)));
+    token.Reset();
+    ASSERT(book.Recalculate(EvalBudget(token)));
+    ASSERT_EQUAL(second.GetCell("A1"_pos)->GetValue(), CellInterface::Value(40.0));
+}
+
+void TestPriorityRecalculation() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell(Position{row, 1}, "=A1+" + std::to_string(row));
+    }
+    sheet.SetCell("D1"_pos, "=B500*2");
+    sheet.SetCell("D2"_pos, "=D1+B1");
+    sheet.SetPriorityRects({{"D1"_pos, {5, 2}}});
+    ASSERT_EQUAL(sheet.GetPriorityRects().size(), 1u);
+
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 1002u);
+    ASSERT_EQUAL(sheet.GetPriorityDirtyCount(), 2u);
+    // видимые формулы вычисляются первыми вместе с зависимостями
+    ASSERT_EQUAL(sheet.RecalculateDirty(1), 1000u);
+    ASSERT_EQUAL(sheet.GetPriorityDirtyCount(), 1u);
+    // прерываемый на каждом шаге пересчёт тоже начинает с видимой D2
+    CancellationToken token;
+    token.Cancel();
+    int calls = 0;
+    while (sheet.GetPriorityDirtyCount() > 0) {
+        ASSERT(sheet.RecalculateDirty(1000, EvalBudget(token)) >= 998u);
+        ++calls;
+    }
+    ASSERT_EQUAL(calls, 6);
+    ASSERT_EQUAL(sheet.GetDirtyCount(), 998u);
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(1004.0));
+    ASSERT_EQUAL(sheet.Recalculate(), 0u);
+
+    sheet.SetCalcMode(Sheet::CalcMode::Manual);
+    sheet.SetCell("A1"_pos, "3");
+    // D1 и D2 с зависимостями B500 и B1: по три шага обхода и вычислению
+    // на формулу
+    calls = 0;
+    do {
+        sheet.Recalculate(EvalBudget(token));
+        ++calls;
+    } while (sheet.GetPriorityDirtyCount() > 0);
+    ASSERT_EQUAL(calls, 12);
+    ASSERT(sheet.GetDirtyCount() > 0);
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetValue(), CellInterface::Value(1007.0));
+    ASSERT_EQUAL(sheet.Recalculate(), 0u);
+    ASSERT_EQUAL(sheet.GetCell("B1000"_pos)->GetValue(), CellInterface::Value(1002.0));
+
+    // формула перекрытых областей попадает в пачку пересчёта один раз
+    Sheet overlapped;
+    for (int row = 0; row < 10; ++row) {
+        overlapped.SetCell(Position{row, 1}, "=A1+" + std::to_string(row));
+    }
+    overlapped.SetPriorityRects({{"B1"_pos, {3, 1}}, {"B2"_pos, {3, 1}}});
+    overlapped.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(overlapped.GetDirtyCount(), 10u);
+    ASSERT_EQUAL(overlapped.GetPriorityDirtyCount(), 4u);
+    ASSERT_EQUAL(overlapped.RecalculateDirty(6), 4u);
+
+    bool caught = false;
+    try {
+        sheet.SetPriorityRects({{Position{-1, 0}, {1, 1}}});
+    } catch (const InvalidPositionException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.MemoryUsage().GetTotalBytes(), 0u);
+
+    sheet.SetCell("A1"_pos, "a text that does not fit into a short string");
+    auto usage = sheet.MemoryUsage();
+    ASSERT_EQUAL(usage.cells.objects, 1u);
+    ASSERT_EQUAL(usage.impls.objects, 1u);
+    ASSERT_EQUAL(usage.texts.objects, 1u);
+    ASSERT(usage.texts.bytes > 40);
+    ASSERT_EQUAL(usage.storage.objects, 1u);
+
+    sheet.SetCell("B1"_pos, "=A2+1");
+    usage = sheet.MemoryUsage();
+    // пустая A2 создаётся для ссылки
+    ASSERT_EQUAL(usage.cells.objects, 3u);
+    ASSERT_EQUAL(usage.formula_trees.objects, 3u);
+    ASSERT_EQUAL(usage.reference_lists.objects, 1u);
+    ASSERT_EQUAL(usage.dependency_sets.objects, 2u);
+    ASSERT(usage.dependency_sets.bytes > 0);
+    ASSERT_EQUAL(usage.storage.objects, 2u);
+
+    // счётчики возвращаются к нулю, когда всё удалено
+    for (int row = 0; row < 50; ++row) {
+        sheet.SetCell(Position{row, 2}, "=SUM(A1:A50)+B1*" + std::to_string(row));
+        sheet.SetCell(Position{row, 3}, "=XLOOKUP(C" + std::to_string(row + 1) + ",C1:C50,A1:A50,0)");
+        sheet.SetCell(Position{row, 4}, row % 2 ? "=D1" : "some text of a cell, long enough for the heap");
+    }
+    sheet.SetCell("B1"_pos, "=A3/2");
+    sheet.EnableExpressionSharing(true);
+    sheet.SetCell("F1"_pos, "=(A1+A2)*2");
+    sheet.SetCell("F2"_pos, "=(A1+A2)/2");
+    ASSERT(sheet.MemoryUsage().formula_trees.objects > 300);
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int row = 0; row < 50; ++row) {
+            for (int col = 0; col < 6; ++col) {
+                sheet.ClearCell(Position{row, col});
+            }
+        }
+    }
+    usage = sheet.MemoryUsage();
+    ASSERT_EQUAL(usage.cells.objects, 0u);
+    ASSERT_EQUAL(usage.impls.bytes, 0u);
+    ASSERT_EQUAL(usage.texts.bytes, 0u);
+    ASSERT_EQUAL(usage.formula_trees.bytes, 0u);
+    ASSERT_EQUAL(usage.reference_lists.bytes, 0u);
+    ASSERT_EQUAL(usage.dependency_sets.bytes, 0u);
+
+    Sheet tiled(Sheet::Layout::ZOrder);
+    tiled.SetCell("A1"_pos, "1");
+    tiled.SetCell("Z100"_pos, "2");
+    usage = tiled.MemoryUsage();
+    ASSERT_EQUAL(usage.cells.objects, 2u);
+    ASSERT_EQUAL(usage.storage.objects, 2u);
+    // у каждой плитки выделена только группа мест с её ячейкой
+    ASSERT_EQUAL(usage.storage_slack.objects, 2u * (ZOrderStore::GROUP - 1));
+    tiled.SetCell("B1"_pos, "3");
+    tiled.SetCell("A5"_pos, "4");
+    ASSERT_EQUAL(tiled.MemoryUsage().storage_slack.objects, 3u * (ZOrderStore::GROUP - 1) - 1);
+    // группа освобождается вместе с последней ячейкой
+    tiled.ClearCell("A5"_pos);
+    ASSERT_EQUAL(tiled.MemoryUsage().storage_slack.objects, 2u * (ZOrderStore::GROUP - 1) - 1);
+}
+
+void TestHugeFormula() {
+    Sheet sheet;
+    constexpr int TERMS = 50000;
+    for (int row = 0; row < 4; ++row) {
+        for (int col = 0; col < 4; ++col) {
+            sheet.SetCell(Position{row, col}, std::to_string(row * 4 + col + 1));
+        }
+    }
+    // цепочка сложений и вычитаний по ячейкам 4x4
+    std::string formula = "=A1";
+    double expected = 1.0;
+    // сколько раз A1 входит в сумму с учётом знака
+    double a1 = 1.0;
+    for (int i = 1; i < TERMS; ++i) {
+        const Position pos{i % 4, i / 4 % 4};
+        formula += i % 3 == 0 ? "-" : "+";
+        formula += pos.ToString();
+        const double value = pos.row * 4 + pos.col + 1;
+        expected = i % 3 == 0 ? expected - value : expected + value;
+        if (pos == "A1"_pos) {
+            a1 += i % 3 == 0 ? -1.0 : 1.0;
+        }
+    }
+    sheet.SetCell("F1"_pos, formula);
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetText(), formula);
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(expected));
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetReferencedCells().size(), 16u);
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet.GetCell("F1"_pos)->GetValue(), CellInterface::Value(expected + a1));
+
+    // скобки, не меняющие порядок вычисления, пропадают из текста
+    sheet.SetCell("F2"_pos, "=((A1+B1)-C1)+(D1-A2)*(B2/C2/D2)");
+    ASSERT_EQUAL(sheet.GetCell("F2"_pos)->GetText(), "=A1+B1-C1+(D1-A2)*B2/C2/D2");
+    sheet.SetCell("F3"_pos, "=A1-(B1-C1)/D1*2");
+    ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetText(), "=A1-(B1-C1)/D1*2");
+    ASSERT_EQUAL(sheet.GetCell("F3"_pos)->GetValue(), CellInterface::Value(2.5));
+
+    const auto nested = [](int depth, const std::string& open, const std::string& close) {
+        std::string text = "=";
+        for (int i = 0; i < depth; ++i) {
+            text += open;
+        }
+        text += "1";
+        for (int i = 0; i < depth; ++i) {
+            text += close;
+        }
+        return text;
+    };
+    sheet.SetCell("F4"_pos, nested(100, "(-", ")"));
+    ASSERT_EQUAL(sheet.GetCell("F4"_pos)->GetValue(), CellInterface::Value(1.0));
+    // глубокая вложенность отвергается до разбора
+    for (const auto& text : {nested(1000, "(", ")"), nested(1000, "-", ""), nested(200, "-(", ")")}) {
+        bool caught = false;
+        try {
+            sheet.SetCell("F5"_pos, text);
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+    // скобки внутри текста не считаются
+    sheet.SetCell("F5"_pos, "=MATCH(\"" + std::string(300, '(') + "\",A1:A4,0)");
+}
 }  // namespace
 
 int main() {
@@ -352,6 +1810,7 @@ int main() {
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
     RUN_TEST(tr, TestStringToPositionInvalid);
+    RUN_TEST(tr, TestPositionKeys);
     RUN_TEST(tr, TestEmpty);
     RUN_TEST(tr, TestInvalidPosition);
     RUN_TEST(tr, TestSetCellPlainText);
@@ -362,11 +1821,41 @@ int main() {
     RUN_TEST(tr, TestFormulaReferencedCells);
     RUN_TEST(tr, TestErrorValue);
     RUN_TEST(tr, TestErrorDiv0);
+    RUN_TEST(tr, TestErrorPropagation);
     RUN_TEST(tr, TestEmptyCellTreatedAsZero);
     RUN_TEST(tr, TestFormulaInvalidPosition);
     RUN_TEST(tr, TestPrint);
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestTextView);
+    RUN_TEST(tr, TestRectRead);
+    RUN_TEST(tr, TestPrintValuesFormatting);
+    RUN_TEST(tr, TestJournalRecovery);
+    RUN_TEST(tr, TestJournalLostCheckpointRename);
+    RUN_TEST(tr, TestAsyncRecalculation);
+    RUN_TEST(tr, TestAsyncLongChain);
+    RUN_TEST(tr, TestWorkbookReferences);
+    RUN_TEST(tr, TestPaging);
+    RUN_TEST(tr, TestPagingLinkedCells);
+    RUN_TEST(tr, TestZOrderLayout);
+    RUN_TEST(tr, TestEvaluationProfiler);
+    RUN_TEST(tr, TestRecordingSheet);
+    RUN_TEST(tr, TestSharedSubexpressions);
+    RUN_TEST(tr, TestRedundantSet);
+    RUN_TEST(tr, TestManualCalcMode);
+    RUN_TEST(tr, TestPartitionedSheet);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestRangeAggregates);
+    RUN_TEST(tr, TestManyRanges);
+    RUN_TEST(tr, TestArrowExport);
+    RUN_TEST(tr, TestRecalcBudget);
+    RUN_TEST(tr, TestPriorityRecalculation);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestHugeFormula);
+#if defined(__unix__) || defined(__APPLE__)
+    RUN_TEST(tr, TestSheetServer);
+#endif
+    RUN_TEST(tr, TestDeepDependencyChain);
     return 0;
 }
@@ -0,0 +1,48 @@
+#include "memory_usage.h"
+
+size_t SheetMemoryUsage::GetTotalBytes() const {
+    return cells.bytes + impls.bytes + texts.bytes + formula_trees.bytes + reference_lists.bytes
+        + dependency_sets.bytes + storage.bytes + storage_slack.bytes;
+}
+
+void MemoryTracker::Add(Category category, int64_t objects, int64_t bytes) {
+    Counter& counter = counters_[category];
+    if (concurrent_)
+    {
+        counter.objects.fetch_add(objects, std::memory_order_relaxed);
+        counter.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        return;
+    }
+    // в одном потоке обходимся без атомарного сложения
+    counter.objects.store(counter.objects.load(std::memory_order_relaxed) + objects,
+                          std::memory_order_relaxed);
+    counter.bytes.store(counter.bytes.load(std::memory_order_relaxed) + bytes,
+                        std::memory_order_relaxed);
+}
+
+void MemoryTracker::EnableConcurrentWriters() {
+    concurrent_ = true;
+}
+
+void MemoryTracker::Fill(SheetMemoryUsage& usage) const {
+    SheetMemoryUsage::Category* categories[CATEGORY_COUNT] = {
+        &usage.cells, &usage.impls, &usage.texts,
+        &usage.formula_trees, &usage.reference_lists, &usage.dependency_sets,
+    };
+    for (int category = 0; category < CATEGORY_COUNT; ++category)
+    {
+        categories[category]->objects = size_t(counters_[category].objects.load(std::memory_order_relaxed));
+        categories[category]->bytes = size_t(counters_[category].bytes.load(std::memory_order_relaxed));
+    }
+}
+
+size_t GetHeapBytes(const std::string& text) {
+    // короткая строка хранит символы внутри объекта
+    const auto begin = reinterpret_cast<uintptr_t>(&text);
+    const auto data = reinterpret_cast<uintptr_t>(text.data());
+    if (data >= begin && data < begin + sizeof(text))
+    {
+        return 0;
+    }
+    return text.capacity() + 1;
+}
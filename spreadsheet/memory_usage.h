@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+
+// Память листа по видам объектов: число объектов и байты. Байты - оценка
+// по размерам объектов и ёмкостям контейнеров, без накладных расходов
+// распределителя памяти.
+struct SheetMemoryUsage {
+    struct Category {
+        size_t objects = 0;
+        size_t bytes = 0;
+    };
+
+    // объекты Cell, включая скрытые ячейки подвыражений и областей
+    Category cells;
+    // реализации содержимого ячеек (Cell::Impl)
+    Category impls;
+    // строки текста ячеек и канонических записей формул; объекты - строки,
+    // байты - только память вне объекта строки
+    Category texts;
+    // разобранные формулы: узлы деревьев FormulaAST
+    Category formula_trees;
+    // узлы списков ссылок формул (forward_list позиций, ссылок на другие
+    // листы и областей)
+    Category reference_lists;
+    // хеш-множества users_ и used_cells_; объекты - элементы множеств
+    Category dependency_sets;
+    // хранилище ячеек: массивы строк data_ или плитки Z-порядка; объекты -
+    // строки или плитки, байты - занятые места
+    Category storage;
+    // незанятая ёмкость хранилища
+    Category storage_slack;
+
+    size_t GetTotalBytes() const;
+};
+
+// Счётчики памяти листа, которые ячейки обновляют при каждом изменении,
+// поэтому отчёт не обходит лист. При правке из нескольких потоков
+// (Sheet::EnableConcurrentWriters) счётчики меняются атомарно.
+class MemoryTracker {
+public:
+    enum Category {
+        Cells,
+        Impls,
+        Texts,
+        FormulaTrees,
+        ReferenceLists,
+        DependencySets,
+        CATEGORY_COUNT,
+    };
+
+    void Add(Category category, int64_t objects, int64_t bytes);
+    void EnableConcurrentWriters();
+    // Заполняет отслеживаемые категории usage.
+    void Fill(SheetMemoryUsage& usage) const;
+
+private:
+    struct Counter {
+        std::atomic<int64_t> objects{0};
+        std::atomic<int64_t> bytes{0};
+    };
+
+    std::array<Counter, CATEGORY_COUNT> counters_;
+    bool concurrent_ = false;
+};
+
+// Память строки вне её объекта: короткие строки хранятся в самом объекте.
+size_t GetHeapBytes(const std::string& text);
+
+// Память хеш-множества вне его объекта: массив корзин и узлы элементов.
+template <typename T>
+size_t GetHeapBytes(const std::unordered_set<T>& set) {
+    // узел - указатель на следующий и значение; хеш указателей и чисел не
+    // хранится в узле
+    constexpr size_t NODE_BYTES = sizeof(void*) + sizeof(T);
+    // пустое множество с одной корзиной хранит её в себе
+    const size_t buckets = set.bucket_count() > 1 ? set.bucket_count() : 0;
+    return buckets * sizeof(void*) + set.size() * NODE_BYTES;
+}
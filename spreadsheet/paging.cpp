@@ -0,0 +1,52 @@
+#include "paging.h"
+
+namespace {
+// fseek принимает long, которого не хватает для файлов больше 2 ГБ
+bool Seek(std::FILE* file, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, int64_t(offset), SEEK_SET) == 0;
+#else
+    return fseeko(file, off_t(offset), SEEK_SET) == 0;
+#endif
+}
+}  // namespace
+
+SpillFile::SpillFile(std::string path)
+    : path_(std::move(path))
+    , file_(std::fopen(path_.c_str(), "w+b")) {
+    if (file_ == nullptr)
+    {
+        throw PagingException("cannot create spill file " + path_);
+    }
+}
+
+SpillFile::~SpillFile() {
+    std::fclose(file_);
+    std::remove(path_.c_str());
+}
+
+void SpillFile::Write(Slot& slot, std::string_view data) {
+    if (data.size() > slot.capacity)
+    {
+        // в старое место не помещается, пишем в конец файла
+        slot.offset = size_;
+        slot.capacity = data.size();
+        size_ += data.size();
+    }
+    slot.size = data.size();
+    if (!Seek(file_, slot.offset)
+        || std::fwrite(data.data(), 1, data.size(), file_) != data.size())
+    {
+        throw PagingException("spill file write failed");
+    }
+}
+
+std::string SpillFile::Read(const Slot& slot) const {
+    std::string data(slot.size, '\0');
+    if (!Seek(file_, slot.offset)
+        || std::fread(data.data(), 1, data.size(), file_) != data.size())
+    {
+        throw PagingException("spill file read failed");
+    }
+    return data;
+}
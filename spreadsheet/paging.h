@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Исключение, выбрасываемое при ошибке ввода-вывода файла подкачки
+class PagingException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct PagingOptions {
+    // Файл, в который выгружаются холодные страницы. Создаётся заново и
+    // удаляется вместе с таблицей.
+    std::string spill_path;
+    // Оценка памяти под ячейки, после превышения которой страницы,
+    // к которым дольше всего не обращались, выгружаются на диск.
+    size_t memory_budget = size_t(256) << 20;
+    // Страница - полоса из стольких строк таблицы.
+    int rows_per_page = 64;
+};
+
+// Счётчики подкачки.
+struct PagingStats {
+    size_t page_ins = 0;
+    size_t page_outs = 0;
+    size_t resident_pages = 0;
+    size_t spilled_pages = 0;
+    // приблизительная оценка памяти под ячейки загруженных страниц
+    size_t resident_bytes = 0;
+    size_t spill_file_bytes = 0;
+};
+
+// Файл подкачки: хранит содержимое выгруженных страниц по смещениям.
+// Место страницы переиспользуется, если новое содержимое в него помещается.
+class SpillFile {
+public:
+    struct Slot {
+        uint64_t offset = 0;
+        uint64_t capacity = 0;
+        uint64_t size = 0;
+    };
+
+    explicit SpillFile(std::string path);
+    ~SpillFile();
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    void Write(Slot& slot, std::string_view data);
+    std::string Read(const Slot& slot) const;
+
+    uint64_t GetSize() const {
+        return size_;
+    }
+
+private:
+    std::string path_;
+    std::FILE* file_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+// Состояние подкачки таблицы: страницы - полосы строк фиксированной высоты.
+struct Pager {
+    struct Page {
+        bool spilled = false;
+        // время последнего обращения для вытеснения по LRU
+        uint64_t last_use = 0;
+        size_t bytes = 0;
+        SpillFile::Slot slot;
+        // ограничивающий прямоугольник непустых ячеек выгруженной страницы:
+        // число строк от начала таблицы и число столбцов
+        int used_rows = 0;
+        int used_cols = 0;
+    };
+
+    Pager(PagingOptions options, int max_rows)
+        : options(std::move(options))
+        , file(this->options.spill_path)
+        , pages(max_rows / this->options.rows_per_page + 1) {
+    }
+
+    int PageOf(int row) const {
+        return row / options.rows_per_page;
+    }
+
+    PagingOptions options;
+    SpillFile file;
+    std::vector<Page> pages;
+    uint64_t tick = 0;
+    PagingStats stats;
+};
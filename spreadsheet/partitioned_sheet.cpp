@@ -0,0 +1,219 @@
+#include "partitioned_sheet.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+std::vector<Position> PartitionedSheet::GetReferences(const std::string& text) const {
+    if (text.size() < 2 || text[0] != FORMULA_SIGN)
+    {
+        return {};
+    }
+    // формула разбирается ещё раз листом, зато до блокировки
+    const auto formula = ParseFormula(text.substr(1));
+    auto refs = formula->GetReferencedCells();
+    if (!formula->GetSheetReferencedCells().empty())
+    {
+        refs.push_back(Position::NONE);
+    }
+    const auto ranges = formula->GetReferencedRanges();
+    for (const Rect& range : ranges)
+    {
+        // по ячейке в каждой области, которую задевает диапазон
+        const int last = range.top_left.row + range.size.rows - 1;
+        for (int row = range.top_left.row; RegionOf(row) <= RegionOf(last);
+             row = (RegionOf(row) + 1) * rows_per_region_)
+        {
+            refs.push_back({row, range.top_left.col});
+        }
+    }
+    if (!ranges.empty())
+    {
+        // скрытые ячейки диапазонов общие для всего листа
+        refs.push_back(Position::NONE);
+    }
+    return refs;
+}
+
+PartitionedSheet::PartitionedSheet(int rows_per_region)
+    : rows_per_region_(rows_per_region) {
+    if (rows_per_region_ <= 0)
+    {
+        throw std::invalid_argument("rows_per_region must be positive");
+    }
+    const int regions = (Position::MAX_ROWS + rows_per_region_ - 1) / rows_per_region_;
+    region_mutexes_ = std::make_unique<std::mutex[]>(regions);
+    cross_counts_.resize(regions);
+    sheet_.EnableConcurrentWriters();
+}
+
+int PartitionedSheet::RegionOf(int row) const {
+    return row / rows_per_region_;
+}
+
+bool PartitionedSheet::IsLocal(Position pos, const std::vector<Position>& refs) const {
+    const int region = RegionOf(pos.row);
+    if (cross_counts_[region] > 0 || pos.row >= reserved_rows_)
+    {
+        return false;
+    }
+    return std::all_of(refs.begin(), refs.end(), [this, region](Position ref) {
+        return ref.IsValid() && RegionOf(ref.row) == region && ref.row < reserved_rows_;
+    });
+}
+
+void PartitionedSheet::SetCell(Position pos, std::string text) {
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("invalid position");
+    }
+    const auto refs = GetReferences(text);
+    {
+        std::shared_lock lock(mutex_);
+        if (IsLocal(pos, refs))
+        {
+            std::lock_guard region_lock(region_mutexes_[RegionOf(pos.row)]);
+            sheet_.SetCell(pos, std::move(text));
+            ++local_ops_;
+            return;
+        }
+    }
+    std::unique_lock lock(mutex_);
+    SetExclusive(pos, std::move(text), refs);
+    ++exclusive_ops_;
+}
+
+void PartitionedSheet::ClearCell(Position pos) {
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("invalid position");
+    }
+    {
+        std::shared_lock lock(mutex_);
+        if (IsLocal(pos, {}))
+        {
+            std::lock_guard region_lock(region_mutexes_[RegionOf(pos.row)]);
+            sheet_.ClearCell(pos);
+            ++local_ops_;
+            return;
+        }
+    }
+    std::unique_lock lock(mutex_);
+    sheet_.ClearCell(pos);
+    UpdateCrossRegions(pos, {});
+    ++exclusive_ops_;
+}
+
+void PartitionedSheet::SetExclusive(Position pos, std::string text, const std::vector<Position>& refs) {
+    int rows = pos.row + 1;
+    for (const Position ref : refs)
+    {
+        rows = std::max(rows, ref.row + 1);
+    }
+    if (rows > reserved_rows_)
+    {
+        // хранилище растёт целыми областями и вдвое, чтобы правки новых
+        // строк редко требовали исключительной блокировки
+        const int regions = (std::max(rows, 2 * reserved_rows_) + rows_per_region_ - 1) / rows_per_region_;
+        reserved_rows_ = std::min(Position::MAX_ROWS, regions * rows_per_region_);
+        sheet_.ReserveRows(reserved_rows_);
+    }
+    sheet_.SetCell(pos, std::move(text));
+    UpdateCrossRegions(pos, refs);
+}
+
+void PartitionedSheet::UpdateCrossRegions(Position pos, const std::vector<Position>& refs) {
+    const int region = RegionOf(pos.row);
+    auto it = cross_formulas_.find(pos);
+    if (it != cross_formulas_.end())
+    {
+        --cross_counts_[region];
+        for (const int other : it->second)
+        {
+            --cross_counts_[other];
+        }
+        cross_formulas_.erase(it);
+    }
+    std::vector<int> others;
+    for (const Position ref : refs)
+    {
+        if (!ref.IsValid())
+        {
+            // ссылки на другие листы и диапазоны закрепляют за областью
+            // формулы исключительную блокировку
+            others.push_back(region);
+        }
+        else if (RegionOf(ref.row) != region)
+        {
+            others.push_back(RegionOf(ref.row));
+        }
+    }
+    std::sort(others.begin(), others.end());
+    others.erase(std::unique(others.begin(), others.end()), others.end());
+    if (others.empty())
+    {
+        return;
+    }
+    ++cross_counts_[region];
+    for (const int other : others)
+    {
+        ++cross_counts_[other];
+    }
+    cross_formulas_.emplace(pos, std::move(others));
+}
+
+CellInterface::Value PartitionedSheet::GetValue(Position pos) const {
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("invalid position");
+    }
+    const auto read = [this, pos] {
+        const CellInterface* cell = sheet_.GetCell(pos);
+        return cell != nullptr ? cell->GetValue() : CellInterface::Value();
+    };
+    {
+        std::shared_lock lock(mutex_);
+        if (IsLocal(pos, {}))
+        {
+            // вычисление формул записывает кеш, поэтому блокировка области
+            // исключительная и для чтения
+            std::lock_guard region_lock(region_mutexes_[RegionOf(pos.row)]);
+            ++local_ops_;
+            return read();
+        }
+    }
+    std::unique_lock lock(mutex_);
+    ++exclusive_ops_;
+    return read();
+}
+
+std::string PartitionedSheet::GetText(Position pos) const {
+    if (!pos.IsValid())
+    {
+        throw InvalidPositionException("invalid position");
+    }
+    // текст не вычисляется и читается под блокировкой области
+    std::shared_lock lock(mutex_);
+    std::lock_guard region_lock(region_mutexes_[RegionOf(pos.row)]);
+    const CellInterface* cell = sheet_.GetCell(pos);
+    return cell != nullptr ? cell->GetText() : std::string();
+}
+
+Size PartitionedSheet::GetPrintableSize() const {
+    std::unique_lock lock(mutex_);
+    return sheet_.GetPrintableSize();
+}
+
+void PartitionedSheet::PrintValues(std::ostream& output) const {
+    std::unique_lock lock(mutex_);
+    sheet_.PrintValues(output);
+}
+
+void PartitionedSheet::PrintTexts(std::ostream& output) const {
+    std::unique_lock lock(mutex_);
+    sheet_.PrintTexts(output);
+}
+
+PartitionedSheet::Stats PartitionedSheet::GetStats() const {
+    return {local_ops_.load(), exclusive_ops_.load()};
+}
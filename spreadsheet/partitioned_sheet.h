@@ -0,0 +1,84 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <atomic>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Таблица для нескольких одновременных писателей.
+// Лист делится на области - полосы по rows_per_region строк, у каждой
+// области своя блокировка. Операция над ячейкой области, ни одна формула
+// которой не связана ссылками с другими областями, выполняется под
+// блокировкой только этой области: все зависимости, которые она может
+// затронуть при проверке цикла, сбросе кеша и вычислении, лежат в той же
+// области. Формулы со ссылками между областями отмечают обе области, и
+// операции над отмеченными областями, как и правки, создающие такие
+// ссылки, выполняются под исключительной блокировкой всего листа. Так
+// правки несвязанных областей идут параллельно, а правки через границы
+// областей упорядочены. Формулы с диапазонами, как и со ссылками на
+// другие листы, всегда правятся под исключительной блокировкой и отмечают
+// свою область и области диапазонов. Все методы потокобезопасны.
+class PartitionedSheet {
+public:
+    explicit PartitionedSheet(int rows_per_region = 256);
+
+    PartitionedSheet(const PartitionedSheet&) = delete;
+    PartitionedSheet& operator=(const PartitionedSheet&) = delete;
+
+    // Работают как одноимённые методы SheetInterface.
+    void SetCell(Position pos, std::string text);
+    void ClearCell(Position pos);
+
+    // Значение и текст ячейки; для несуществующей ячейки - пустая строка.
+    CellInterface::Value GetValue(Position pos) const;
+    std::string GetText(Position pos) const;
+
+    Size GetPrintableSize() const;
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+
+    struct Stats {
+        // операции под блокировкой одной области
+        size_t local = 0;
+        // операции под исключительной блокировкой листа
+        size_t exclusive = 0;
+    };
+    Stats GetStats() const;
+
+private:
+    // Ячейки, на которые ссылается текст ячейки, и по ячейке в каждой
+    // области, которую задевают переданные функциям диапазоны. Ссылка на
+    // другой лист или диапазон добавляет позицию NONE: такую правку нельзя
+    // выполнить в области.
+    std::vector<Position> GetReferences(const std::string& text) const;
+    int RegionOf(int row) const;
+    // Можно ли выполнить операцию над ячейкой pos, затрагивающую ячейки
+    // refs, под блокировкой одной области. Вызывается под разделяемой
+    // блокировкой листа: отметки областей меняются только под
+    // исключительной.
+    bool IsLocal(Position pos, const std::vector<Position>& refs) const;
+    // Под исключительной блокировкой: записывает текст и обновляет отметки
+    // областей, которые связывает формула ячейки.
+    void SetExclusive(Position pos, std::string text, const std::vector<Position>& refs);
+    void UpdateCrossRegions(Position pos, const std::vector<Position>& refs);
+
+    int rows_per_region_;
+    mutable std::shared_mutex mutex_;
+    std::unique_ptr<std::mutex[]> region_mutexes_;
+    // число формул со ссылками между областями, затрагивающих область
+    std::vector<size_t> cross_counts_;
+    // формулы со ссылками между областями и области их ссылок
+    std::unordered_map<Position, std::vector<int>> cross_formulas_;
+    // строки, под которые выделено хранилище листа
+    int reserved_rows_ = 0;
+    mutable std::atomic<size_t> local_ops_{0};
+    mutable std::atomic<size_t> exclusive_ops_{0};
+    Sheet sheet_;
+};
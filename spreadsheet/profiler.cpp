@@ -0,0 +1,167 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iostream>
+
+void Profiler::BeginRecalc() {
+    active_ = true;
+    samples_.clear();
+}
+
+void Profiler::Record(const Cell* cell, const Cell* parent, std::chrono::nanoseconds exclusive,
+                      const std::unordered_set<Cell*>& used) {
+    samples_.push_back({cell, parent, exclusive, {used.begin(), used.end()}});
+}
+
+void Profiler::EndRecalc() {
+    active_ = false;
+    if (samples_.empty())
+    {
+        return;
+    }
+
+    // Вычисления идут в обратном порядке обхода в глубину: зависимости
+    // раньше формул, поэтому самая долгая цепочка от каждой формулы
+    // собирается одним проходом вперёд.
+    std::unordered_map<const Cell*, size_t> index;
+    index.reserve(samples_.size());
+    std::vector<std::chrono::nanoseconds> inclusive(samples_.size());
+    std::vector<std::chrono::nanoseconds> longest(samples_.size());
+    std::vector<size_t> next(samples_.size(), samples_.size());
+    for (size_t i = 0; i < samples_.size(); ++i)
+    {
+        const Sample& sample = samples_[i];
+        inclusive[i] = sample.exclusive;
+        longest[i] = sample.exclusive;
+        for (const Cell* used : sample.used)
+        {
+            auto it = index.find(used);
+            if (it != index.end() && longest[it->second] + sample.exclusive > longest[i])
+            {
+                longest[i] = longest[it->second] + sample.exclusive;
+                next[i] = it->second;
+            }
+        }
+        index[sample.cell] = i;
+        auto& profile = profiles_[sample.cell];
+        ++profile.evaluations;
+        profile.exclusive += sample.exclusive;
+        profile.dependencies = sample.used.size();
+    }
+
+    // включающее время: каждая запись добавляет своё время родителю,
+    // который вычисляется позже
+    std::unordered_map<const Cell*, std::chrono::nanoseconds> pending;
+    for (size_t i = 0; i < samples_.size(); ++i)
+    {
+        const Sample& sample = samples_[i];
+        auto it = pending.find(sample.cell);
+        if (it != pending.end())
+        {
+            inclusive[i] += it->second;
+            pending.erase(it);
+        }
+        profiles_[sample.cell].inclusive += inclusive[i];
+        if (sample.parent != nullptr)
+        {
+            pending[sample.parent] += inclusive[i];
+        }
+    }
+
+    // Узлы дерева путей: в обратном порядке каждая запись идёт раньше
+    // своих детей, так что узел родителя уже известен.
+    std::unordered_map<const Cell*, size_t> node_of;
+    for (size_t i = samples_.size(); i-- > 0;)
+    {
+        const Sample& sample = samples_[i];
+        size_t parent_node = 0;
+        if (sample.parent != nullptr)
+        {
+            auto it = node_of.find(sample.parent);
+            if (it != node_of.end())
+            {
+                parent_node = it->second;
+            }
+        }
+        auto [child, inserted] = nodes_[parent_node].children.emplace(sample.cell, nodes_.size());
+        if (inserted)
+        {
+            nodes_.emplace_back(parent_node, sample.cell);
+            cell_nodes_[sample.cell].push_back(child->second);
+        }
+        const size_t node = child->second;
+        nodes_[node].exclusive += sample.exclusive;
+        node_of[sample.cell] = node;
+    }
+
+    size_t start = 0;
+    for (size_t i = 1; i < samples_.size(); ++i)
+    {
+        if (longest[i] > longest[start])
+        {
+            start = i;
+        }
+    }
+    critical_path_.clear();
+    critical_path_time_ = longest[start];
+    for (size_t i = start; i < samples_.size(); i = next[i])
+    {
+        critical_path_.push_back(samples_[i].cell);
+    }
+    samples_.clear();
+}
+
+void Profiler::Forget(const Cell* cell) {
+    profiles_.erase(cell);
+    auto it = cell_nodes_.find(cell);
+    if (it != cell_nodes_.end())
+    {
+        // узлы ячейки отцепляются от дерева: её адрес может достаться новой
+        // ячейке
+        for (size_t node : it->second)
+        {
+            nodes_[node].cell = nullptr;
+            nodes_[nodes_[node].parent].children.erase(cell);
+        }
+        cell_nodes_.erase(it);
+    }
+    std::replace(critical_path_.begin(), critical_path_.end(), cell, static_cast<const Cell*>(nullptr));
+}
+
+void Profiler::Reset() {
+    samples_.clear();
+    profiles_.clear();
+    nodes_.assign(1, Node(0, nullptr));
+    cell_nodes_.clear();
+    critical_path_.clear();
+    critical_path_time_ = std::chrono::nanoseconds{0};
+}
+
+void Profiler::WriteCollapsedStacks(std::ostream& output, const Namer& namer) const {
+    // обход дерева в глубину с текущим путём в виде строки
+    std::string path;
+    std::vector<std::pair<size_t, size_t>> stack;
+    for (const auto& [cell, child] : nodes_[0].children)
+    {
+        stack.push_back({child, 0});
+    }
+    std::vector<size_t> lengths;
+    while (!stack.empty())
+    {
+        const auto [node, depth] = stack.back();
+        stack.pop_back();
+        lengths.resize(depth);
+        path.resize(depth == 0 ? 0 : lengths.back());
+        if (depth > 0)
+        {
+            path += ';';
+        }
+        path += nodes_[node].cell != nullptr ? namer(nodes_[node].cell) : "?";
+        lengths.push_back(path.size());
+        output << path << ' ' << nodes_[node].exclusive.count() << '\n';
+        for (const auto& [cell, child] : nodes_[node].children)
+        {
+            stack.push_back({child, depth + 1});
+        }
+    }
+}
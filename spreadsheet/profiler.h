@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class Cell;
+
+// Накопленная статистика вычислений одной формулы.
+struct CellProfile {
+    size_t evaluations = 0;
+    // время вместе с зависимостями, вычисленными ради этой формулы
+    std::chrono::nanoseconds inclusive{0};
+    // время вычисления самой формулы при готовых зависимостях
+    std::chrono::nanoseconds exclusive{0};
+    // число ячеек, на которые ссылается формула
+    size_t dependencies = 0;
+};
+
+// Профиль вычислений формул. Ячейки сообщают о каждом вычислении, а
+// профиль строит из них дерево обхода зависимостей: формула, ради которой
+// зависимость была вычислена впервые, считается её родителем.
+// Пути по этому дереву выгружаются в формате collapsed stacks, который
+// понимают flamegraph.pl и аналогичные инструменты.
+class Profiler {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Имя ячейки для отчётов.
+    using Namer = std::function<std::string(const Cell*)>;
+
+    // Пересчёт: последовательность вычислений, в которой зависимости идут
+    // раньше использующих их формул.
+    void BeginRecalc();
+    // Идёт ли пересчёт: вложенные вычисления входят в текущий пересчёт.
+    bool IsActive() const {
+        return active_;
+    }
+    void Record(const Cell* cell, const Cell* parent, std::chrono::nanoseconds exclusive,
+                const std::unordered_set<Cell*>& used);
+    void EndRecalc();
+
+    // Удаляет из профиля уничтоженную ячейку.
+    void Forget(const Cell* cell);
+    void Reset();
+
+    const std::unordered_map<const Cell*, CellProfile>& GetProfiles() const {
+        return profiles_;
+    }
+
+    // Самая долгая цепочка зависимостей последнего пересчёта, от формулы,
+    // с которой она начинается, до последней зависимости, и её время.
+    const std::vector<const Cell*>& GetCriticalPath() const {
+        return critical_path_;
+    }
+    std::chrono::nanoseconds GetCriticalPathTime() const {
+        return critical_path_time_;
+    }
+
+    // Пишет по строке на путь дерева обхода: имена ячеек через ';' и
+    // собственное время последней из них в наносекундах.
+    void WriteCollapsedStacks(std::ostream& output, const Namer& namer) const;
+
+private:
+    struct Sample {
+        const Cell* cell;
+        const Cell* parent;
+        std::chrono::nanoseconds exclusive;
+        std::vector<const Cell*> used;
+    };
+    // узел дерева путей; нулевой узел - корень без ячейки
+    struct Node {
+        Node(size_t parent, const Cell* cell) : parent(parent), cell(cell) {}
+
+        size_t parent;
+        const Cell* cell;
+        std::chrono::nanoseconds exclusive{0};
+        std::unordered_map<const Cell*, size_t> children;
+    };
+
+    bool active_ = false;
+    std::vector<Sample> samples_;
+    std::unordered_map<const Cell*, CellProfile> profiles_;
+    std::vector<Node> nodes_{Node(0, nullptr)};
+    // узлы дерева путей, в которых встречается ячейка
+    std::unordered_map<const Cell*, std::vector<size_t>> cell_nodes_;
+    std::vector<const Cell*> critical_path_;
+    std::chrono::nanoseconds critical_path_time_{0};
+};
@@ -0,0 +1,28 @@
+#include "range_formulas.h"
+
+bool RangeFormulas::Track(int offset, const CellInterface* cell) {
+    // формула, которая была на этом месте, забывается: её ячейка могла
+    // быть удалена, а адрес - достаться другой ячейке
+    auto it = cells_.find(offset);
+    if (it != cells_.end())
+    {
+        offsets_.erase(it->second);
+        cells_.erase(it);
+    }
+    if (cell == nullptr || !IsFormulaCell(*cell))
+    {
+        return false;
+    }
+    offsets_[cell] = offset;
+    cells_[offset] = cell;
+    return true;
+}
+
+std::optional<int> RangeFormulas::Find(const CellInterface* cell) const {
+    auto it = offsets_.find(cell);
+    if (it == offsets_.end())
+    {
+        return std::nullopt;
+    }
+    return it->second;
+}
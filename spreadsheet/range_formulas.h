@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <unordered_map>
+
+// Формулы области, значения которых учитывает индекс области (итоги
+// RangeTotals, поиск LookupIndex). Ячейки нумеруются смещением в области.
+// Текст записывается в ячейку листом, и лист сразу передаёт его индексу.
+// Значение формулы меняется без записи в ячейку, поэтому индекс только
+// запоминает формулу здесь, а её значение учитывает, когда формула
+// вычислена и лист сообщает о ней по ячейке: Find находит её смещение.
+class RangeFormulas {
+public:
+    // Запоминает ячейку по смещению offset, если в ней формула, иначе
+    // забывает формулу, которая была на этом месте. cell может быть
+    // nullptr. Возвращает true для формулы.
+    bool Track(int offset, const CellInterface* cell);
+    // Смещение формулы области или nullopt.
+    std::optional<int> Find(const CellInterface* cell) const;
+
+private:
+    std::unordered_map<const CellInterface*, int> offsets_;
+    std::unordered_map<int, const CellInterface*> cells_;
+};
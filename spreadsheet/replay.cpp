@@ -0,0 +1,176 @@
+// Воспроизводит трассу, записанную RecordingSheet, на новой таблице и
+// выводит пропускную способность и перцентили задержки по типам операций.
+//
+//     spreadsheet_replay TRACE [--paced]
+//
+// По умолчанию операции выполняются подряд без пауз; с --paced
+// выдерживаются записанные интервалы между ними.
+
+#include "common.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Поток, отбрасывающий вывод печати.
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        return count;
+    }
+};
+
+struct OpStats {
+    std::vector<std::chrono::nanoseconds> latencies;
+    size_t errors = 0;
+    std::chrono::nanoseconds total{0};
+};
+
+double Percentile(const std::vector<std::chrono::nanoseconds>& sorted, double p) {
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    const size_t index = std::min(sorted.size() - 1, size_t(p * double(sorted.size())));
+    return double(sorted[index].count()) / 1000;
+}
+
+void Execute(SheetInterface& sheet, const TraceRecord& record, std::ostream& sink) {
+    switch (record.op)
+    {
+    case TraceOp::SetCell:
+        sheet.SetCell(record.pos, record.text);
+        break;
+    case TraceOp::ClearCell:
+        sheet.ClearCell(record.pos);
+        break;
+    case TraceOp::GetValue:
+        if (const CellInterface* cell = sheet.GetCell(record.pos))
+        {
+            cell->GetValue();
+        }
+        break;
+    case TraceOp::GetText:
+        if (const CellInterface* cell = sheet.GetCell(record.pos))
+        {
+            cell->GetTextView();
+        }
+        break;
+    case TraceOp::GetPrintableSize:
+        sheet.GetPrintableSize();
+        break;
+    case TraceOp::PrintValues:
+        sheet.PrintValues(sink);
+        break;
+    case TraceOp::PrintTexts:
+        sheet.PrintTexts(sink);
+        break;
+    }
+}
+
+void PrintReport(const std::array<OpStats, TRACE_OP_COUNT>& stats, std::chrono::nanoseconds wall) {
+    std::cout << std::left << std::setw(18) << "operation" << std::right
+              << std::setw(10) << "count" << std::setw(8) << "errors"
+              << std::setw(14) << "ops/s"
+              << std::setw(11) << "p50 us" << std::setw(11) << "p90 us"
+              << std::setw(11) << "p99 us" << std::setw(11) << "max us" << '\n';
+    std::cout << std::fixed << std::setprecision(1);
+    for (int op = 0; op < TRACE_OP_COUNT; ++op)
+    {
+        auto latencies = stats[op].latencies;
+        if (latencies.empty())
+        {
+            continue;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        // пропускная способность без учёта пауз между операциями
+        const double seconds = std::chrono::duration<double>(stats[op].total).count();
+        std::cout << std::left << std::setw(18) << ToString(TraceOp(op)) << std::right
+                  << std::setw(10) << latencies.size() << std::setw(8) << stats[op].errors
+                  << std::setw(14) << (seconds > 0 ? double(latencies.size()) / seconds : 0.0)
+                  << std::setw(11) << Percentile(latencies, 0.5)
+                  << std::setw(11) << Percentile(latencies, 0.9)
+                  << std::setw(11) << Percentile(latencies, 0.99)
+                  << std::setw(11) << double(latencies.back().count()) / 1000 << '\n';
+    }
+    std::cout << std::setprecision(3) << "wall time: " << std::chrono::duration<double>(wall).count() << " s\n";
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    std::string path;
+    bool paced = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--paced")
+        {
+            paced = true;
+        }
+        else if (path.empty())
+        {
+            path = arg;
+        }
+        else
+        {
+            path.clear();
+            break;
+        }
+    }
+    if (path.empty())
+    {
+        std::cerr << "usage: " << argv[0] << " TRACE [--paced]\n";
+        return 2;
+    }
+
+    try
+    {
+        TraceReader reader(path);
+        auto sheet = CreateSheet();
+        NullBuffer null_buffer;
+        std::ostream sink(&null_buffer);
+        std::array<OpStats, TRACE_OP_COUNT> stats;
+
+        const auto start = Clock::now();
+        while (auto record = reader.Next())
+        {
+            if (paced)
+            {
+                std::this_thread::sleep_until(start + record->offset);
+            }
+            auto& op_stats = stats[int(record->op)];
+            const auto op_start = Clock::now();
+            try
+            {
+                Execute(*sheet, *record, sink);
+            }
+            catch (const std::exception&)
+            {
+                // записанный вызов тоже завершился исключением
+                ++op_stats.errors;
+            }
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - op_start);
+            op_stats.latencies.push_back(elapsed);
+            op_stats.total += elapsed;
+        }
+        PrintReport(stats, Clock::now() - start);
+    }
+    catch (const TraceException& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+// Обслуживает лист или книгу через Unix domain socket, см. SheetServer.
+//
+//     spreadsheet_server SOCKET [SHEET...]
+//
+// Без имён листов обслуживается один лист, с именами - книга из этих
+// листов; листы нумеруются в порядке возрастания имён. Сервер работает
+// до SIGINT или SIGTERM.
+
+#include "sheet_server.h"
+#include "workbook.h"
+
+#include <csignal>
+#include <iostream>
+#include <memory>
+#include <string>
+
+namespace {
+SheetServer* running_server = nullptr;
+
+void HandleSignal(int) {
+    if (running_server != nullptr)
+    {
+        running_server->Stop();
+    }
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " SOCKET [SHEET...]\n";
+        return 2;
+    }
+    const std::string socket_path = argv[1];
+    try
+    {
+        Sheet sheet;
+        Workbook book;
+        std::unique_ptr<SheetServer> server;
+        if (argc == 2)
+        {
+            server = std::make_unique<SheetServer>(sheet, socket_path);
+        }
+        else
+        {
+            for (int i = 2; i < argc; ++i)
+            {
+                book.AddSheet(argv[i]);
+            }
+            server = std::make_unique<SheetServer>(book, socket_path);
+        }
+        running_server = server.get();
+        std::signal(SIGINT, HandleSignal);
+        std::signal(SIGTERM, HandleSignal);
+        std::cerr << "listening on " << socket_path << '\n';
+        server->Run();
+        running_server = nullptr;
+
+        const ServerStats stats = server->GetStats();
+        std::cerr << stats.requests << " requests in " << stats.batches << " batches from "
+                  << stats.connections << " connections, largest batch " << stats.max_batch << '\n';
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -2,66 +2,111 @@
 
 #include "cell.h"
 #include "common.h"
+#include "FormulaAST.h"
+#include "workbook.h"
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <locale>
 #include <optional>
+#include <string>
+#include <thread>
 
 using namespace std::literals;
 
-Sheet::~Sheet() {}
+Sheet::Sheet(Workbook& workbook)
+    : workbook_(&workbook)
+    , edits_(&workbook.GetEditCounter()) {}
 
-void Sheet::SetCell(Position pos, std::string text) {
-    if (!pos.IsValid())
-    {
-        throw InvalidPositionException("invalid position");
-    }
-    if (int(data_.size()) < (pos.row + 1))
+Sheet::Sheet(Layout layout) {
+    if (layout == Layout::ZOrder)
     {
-        data_.resize(pos.row + 1);
+        zorder_ = std::make_unique<ZOrderStore>();
     }
-    if (int(data_[pos.row].size()) < (pos.col + 1))
+}
+
+Sheet::~Sheet() {}
+
+namespace {
+// Приблизительная оценка памяти ячейки: сам объект, реализация и текст.
+constexpr size_t CELL_IMPL_BYTES = 64;
+
+size_t EstimateCellBytes(const Cell* cell) {
+    if (cell == nullptr)
     {
-        data_[pos.row].resize(pos.col + 1);
+        return 0;
     }
-    if (data_[pos.row][pos.col] == nullptr)
+    // текст выгруженной ячейки хранится в файле подкачки
+    if (cell->IsSpilled())
     {
-        data_[pos.row][pos.col] = std::make_unique<Cell>(*this);
+        return sizeof(Cell) + CELL_IMPL_BYTES;
     }
-    data_[pos.row][pos.col]->Set(std::move(text));
+    return sizeof(Cell) + CELL_IMPL_BYTES + cell->GetTextView().size();
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
-    if (!pos.IsValid())
+size_t EstimateRowBytes(const std::vector<std::unique_ptr<Cell>>& row) {
+    size_t bytes = row.capacity() * sizeof(row[0]);
+    for (const auto& cell : row)
     {
-        throw InvalidPositionException("invalid position");
+        bytes += EstimateCellBytes(cell.get());
     }
-    if (int(data_.size()) > pos.row && int(data_[pos.row].size()) > pos.col)
+    return bytes;
+}
+
+void PutUint32(std::string& out, uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+uint32_t GetUint32(std::string_view in, size_t offset) {
+    uint32_t value = 0;
+    std::memcpy(&value, in.data() + offset, sizeof(value));
+    return value;
+}
+}  // namespace
+
+void Sheet::SetCell(Position pos, std::string text) {
+    Cell* cell = GetOrCreateCellRef(pos);
+    if (pager_ == nullptr)
     {
-        if (data_[pos.row][pos.col] == nullptr || data_[pos.row][pos.col]->GetText() == "")
+        if (cell->Set(std::move(text)))
         {
-            return nullptr;
+            UpdateRanges(pos, cell);
         }
-        return data_[pos.row][pos.col].get();
+        return;
+    }
+    const size_t before = EstimateCellBytes(cell);
+    if (cell->Set(std::move(text)))
+    {
+        UpdateRanges(pos, cell);
+        AccountBytes(pos.row, before, EstimateCellBytes(cell));
+        EnforceMemoryBudget();
     }
-    return nullptr;
 }
 
-CellInterface* Sheet::GetCell(Position pos) {
-    if (!pos.IsValid())
+const CellInterface* Sheet::GetCell(Position pos) const {
+    const Cell* cell = GetCellRef(pos);
+    // ячейки, на которые только ссылаются формулы, и очищенные ячейки
+    // снаружи не видны
+    if (cell == nullptr || cell->IsEmpty())
     {
-        throw InvalidPositionException("invalid position");
+        return nullptr;
     }
-    if (int(data_.size()) > pos.row && int(data_[pos.row].size()) > pos.col)
+    return cell;
+}
+
+CellInterface* Sheet::GetCell(Position pos) {
+    Cell* cell = GetCellRef(pos);
+    if (cell == nullptr || cell->IsEmpty())
     {
-        if (data_[pos.row][pos.col] == nullptr || data_[pos.row][pos.col]->GetText() == "")
-        {
-            return nullptr;
-        }
-        return data_[pos.row][pos.col].get();
+        return nullptr;
     }
-    return nullptr;
+    return cell;
 }
 
 Cell* Sheet::GetCellRef(Position pos) {
@@ -69,23 +114,67 @@ Cell* Sheet::GetCellRef(Position pos) {
     {
         throw InvalidPositionException("invalid position");
     }
-    if (int(data_.size()) > pos.row && int(data_[pos.row].size()) > pos.col)
+    PageIn(pos.row, pos.row + 1);
+    return const_cast<Cell*>(CellAt(pos.row, pos.col));
+}
+
+const Cell* Sheet::GetCellRef(Position pos) const {
+    if (!pos.IsValid())
     {
-        return data_[pos.row][pos.col].get();
+        throw InvalidPositionException("invalid position");
     }
-    return nullptr;
+    return LoadCellAt(pos.row, pos.col);
 }
 
-const Cell* Sheet::GetCellRef(Position pos) const {
+Cell* Sheet::GetOrCreateCellRef(Position pos) {
     if (!pos.IsValid())
     {
         throw InvalidPositionException("invalid position");
     }
-    if (int(data_.size()) > pos.row && int(data_[pos.row].size()) > pos.col)
+    if (zorder_ != nullptr)
+    {
+        if (Cell* cell = zorder_->Find(pos))
+        {
+            return cell;
+        }
+        Cell* cell = zorder_->Emplace(pos, *this);
+        AddToRanges(pos, cell);
+        return cell;
+    }
+    PageIn(pos.row, pos.row + 1);
+    if (int(data_.size()) < (pos.row + 1))
     {
-        return data_[pos.row][pos.col].get();
+        data_.resize(pos.row + 1);
     }
-    return nullptr;
+    auto& row = data_[pos.row];
+    const size_t before = pager_ != nullptr ? row.capacity() * sizeof(row[0]) : 0;
+    if (int(row.size()) < (pos.col + 1))
+    {
+        row.resize(pos.col + 1);
+    }
+    if (row[pos.col] == nullptr)
+    {
+        row[pos.col] = std::make_unique<Cell>(*this);
+        AddToRanges(pos, row[pos.col].get());
+        if (pager_ != nullptr)
+        {
+            AccountBytes(pos.row, before, row.capacity() * sizeof(row[0]) + EstimateCellBytes(row[pos.col].get()));
+        }
+    }
+    return row[pos.col].get();
+}
+
+Cell* Sheet::GetOrCreateSheetCellRef(const SheetPosition& ref) {
+    Sheet* sheet = workbook_ != nullptr ? workbook_->GetSheet(ref.sheet) : nullptr;
+    if (sheet == nullptr)
+    {
+        throw FormulaException("unknown sheet " + ref.sheet);
+    }
+    return sheet->GetOrCreateCellRef(ref.pos);
+}
+
+const SheetInterface* Sheet::FindSheet(std::string_view name) const {
+    return workbook_ != nullptr ? workbook_->GetSheet(name) : nullptr;
 }
 
 void Sheet::ClearCell(Position pos) {
@@ -93,24 +182,74 @@ void Sheet::ClearCell(Position pos) {
     {
         throw InvalidPositionException("invalid position");
     }
+    if (zorder_ != nullptr)
+    {
+        if (Cell* cell = zorder_->Find(pos))
+        {
+            cell->Clear();
+            UpdateRanges(pos, cell);
+            if (!cell->IsReferenced())
+            {
+                zorder_->Erase(pos);
+            }
+        }
+        return;
+    }
+    PageIn(pos.row, pos.row + 1);
     if (int(data_.size()) > pos.row && int(data_[pos.row].size()) > pos.col)
     {
-        if (data_[pos.row][pos.col] != nullptr)
+        auto& cell = data_[pos.row][pos.col];
+        if (cell != nullptr)
         {
-            data_[pos.row][pos.col]->Clear();
+            const size_t before = EstimateCellBytes(cell.get());
+            cell->Clear();
+            UpdateRanges(pos, cell.get());
+            // пустая ячейка остаётся, только если на неё ссылаются формулы
+            if (!cell->IsReferenced())
+            {
+                cell.reset();
+            }
+            if (pager_ != nullptr)
+            {
+                AccountBytes(pos.row, before, EstimateCellBytes(cell.get()));
+                EnforceMemoryBudget();
+            }
         }
     }
 }
 
 Size Sheet::GetPrintableSize() const {
     Size to_ret;
+    if (zorder_ != nullptr)
+    {
+        zorder_->ForEach([&to_ret](Position pos, const Cell& cell) {
+            if (!cell.IsEmpty())
+            {
+                to_ret.rows = std::max(to_ret.rows, pos.row + 1);
+                to_ret.cols = std::max(to_ret.cols, pos.col + 1);
+            }
+        });
+        return to_ret;
+    }
     for (int row = 0; row < int(data_.size()); ++row)
     {
+        if (pager_ != nullptr)
+        {
+            // выгруженная страница помнит свой ограничивающий прямоугольник
+            const auto& page = pager_->pages[pager_->PageOf(row)];
+            if (page.spilled)
+            {
+                to_ret.rows = std::max(to_ret.rows, page.used_rows);
+                to_ret.cols = std::max(to_ret.cols, page.used_cols);
+                row = (pager_->PageOf(row) + 1) * pager_->options.rows_per_page - 1;
+                continue;
+            }
+        }
         for (int col = int(data_[row].size()) - 1; col >= 0 ; --col)
         {
             if (data_[row][col] != nullptr)
             {
-                if (!data_[row][col]->GetText().empty())
+                if (!data_[row][col]->IsEmpty())
                 {
                     to_ret.rows = std::max(to_ret.rows, row + 1);
                     to_ret.cols = std::max(to_ret.cols, col + 1);
@@ -122,46 +261,1220 @@ Size Sheet::GetPrintableSize() const {
     return to_ret;
 }
 
-void Sheet::PrintValues(std::ostream& output) const {
-    for (int row = 0; row < GetPrintableSize().rows; ++row)
+template <typename Func>
+void Sheet::ForEachInRect(Rect rect, Order order, Func func) const {
+    if (!rect.IsValid())
+    {
+        throw InvalidPositionException("invalid rect");
+    }
+    auto index_of = [&rect, order](int row, int col) {
+        const int r = row - rect.top_left.row;
+        const int c = col - rect.top_left.col;
+        return order == Order::RowMajor
+            ? size_t(r) * rect.size.cols + c
+            : size_t(c) * rect.size.rows + r;
+    };
+    if (zorder_ != nullptr)
+    {
+        zorder_->ForEachInRect(rect, [&func, &index_of](Position pos, const Cell& cell) {
+            func(cell, index_of(pos.row, pos.col));
+        });
+        return;
+    }
+    if (paging_ != nullptr)
+    {
+        paging_->PageIn(rect.top_left.row, rect.top_left.row + rect.size.rows);
+    }
+    const int row_end = std::min(rect.top_left.row + rect.size.rows, int(data_.size()));
+    for (int row = rect.top_left.row; row < row_end; ++row)
+    {
+        const auto& cells = data_[row];
+        const int col_end = std::min(rect.top_left.col + rect.size.cols, int(cells.size()));
+        for (int col = rect.top_left.col; col < col_end; ++col)
+        {
+            if (cells[col] == nullptr)
+            {
+                continue;
+            }
+            func(*cells[col], index_of(row, col));
+        }
+    }
+}
+
+bool Sheet::EvaluateRect(Rect rect, const EvalBudget* budget) const {
+    std::vector<const Cell*> cells;
+    ForEachInRect(rect, Order::RowMajor, [&cells](const Cell& cell, size_t) {
+        cells.push_back(&cell);
+    });
+    return Cell::Evaluate(cells, nullptr, budget, budget != nullptr ? &evaluate_plan_ : nullptr);
+}
+
+bool Sheet::Evaluate(Rect rect, const EvalBudget& budget) const {
+    return EvaluateRect(rect, &budget);
+}
+
+void Sheet::GetValues(Rect rect, CellInterface::Value* out, Order order) const {
+    EvaluateRect(rect);
+    std::fill_n(out, size_t(rect.size.rows) * rect.size.cols, CellInterface::Value());
+    ForEachInRect(rect, order, [out](const Cell& cell, size_t index) {
+        out[index] = cell.GetValue();
+    });
+}
+
+void Sheet::GetNumbers(Rect rect, double* out, Order order) const {
+    EvaluateRect(rect);
+    std::fill_n(out, size_t(rect.size.rows) * rect.size.cols, std::numeric_limits<double>::quiet_NaN());
+    ForEachInRect(rect, order, [out](const Cell& cell, size_t index) {
+        // числом может быть только значение формулы, а текст формулы всегда
+        // длиннее одного знака "="; так текст не копируется впустую
+        const auto text = cell.GetTextView();
+        if (text.size() < 2 || text[0] != FORMULA_SIGN)
+        {
+            return;
+        }
+        const auto value = cell.GetValue();
+        if (const auto* number = std::get_if<double>(&value))
+        {
+            out[index] = *number;
+        }
+    });
+}
+
+namespace {
+// Строк в одном блоке, который форматируется одним потоком.
+constexpr int ROWS_PER_BLOCK = 256;
+// Таблицы меньшего размера (в ячейках) печатаются в одном потоке.
+constexpr size_t PARALLEL_PRINT_THRESHOLD = 1 << 16;
+
+// Быстрое форматирование совпадает с operator<<, только если поток
+// настроен по умолчанию: без фиксированной или научной нотации, знаков и
+// ширины, с классической локалью.
+bool HasDefaultNumberFormat(const std::ostream& output) {
+    constexpr auto format_flags = std::ios_base::floatfield | std::ios_base::showpos
+        | std::ios_base::showpoint | std::ios_base::uppercase;
+    return (output.flags() & format_flags) == 0 && output.width() == 0
+        && output.getloc() == std::locale::classic();
+}
+
+void AppendNumber(std::string& buffer, double value, int precision) {
+    // std::to_chars в формате general даёт то же, что printf("%.*g"),
+    // а именно так operator<< печатает double при настройках по умолчанию
+    char chars[64];
+    const auto result = std::to_chars(std::begin(chars), std::end(chars), value,
+                                      std::chars_format::general, precision);
+    buffer.append(chars, result.ptr);
+}
+}  // namespace
+
+void Sheet::RenderValues(int row_begin, int row_end, int cols, int precision,
+                         std::string& buffer) const {
+    for (int row = row_begin; row < row_end; ++row)
     {
-        for (int col = 0; col < GetPrintableSize().cols; ++col)
+        for (int col = 0; col < cols; ++col)
         {
             if (col > 0)
             {
-                output << '\t';
+                buffer += '\t';
             }
-            if (col < int(data_[row].size()))
+            if (const Cell* cell = CellAt(row, col))
             {
-                if (data_[row][col] != nullptr)
+                const auto value = cell->GetValue();
+                if (const auto* number = std::get_if<double>(&value))
+                {
+                    AppendNumber(buffer, *number, precision);
+                }
+                else if (const auto* text = std::get_if<std::string>(&value))
+                {
+                    buffer += *text;
+                }
+                else
                 {
-                    std::visit([&output](const auto& obj){output << obj;}, data_[row][col]->GetValue());
+                    buffer += std::get<FormulaError>(value).ToString();
                 }
             }
         }
-        output << '\n';
+        buffer += '\n';
+    }
+}
+
+void Sheet::PrintValues(std::ostream& output) const {
+    const Size size = GetPrintableSize();
+    // строки печатаются блоками: перед вычислением блока лишние страницы
+    // выгружаются, а страницы блока загружаются
+    const auto prepare = [this, &size](int row_begin, int row_end) {
+        if (paging_ != nullptr)
+        {
+            paging_->EnforceMemoryBudget();
+            paging_->PageIn(row_begin, row_end);
+        }
+        EvaluateRect({{row_begin, 0}, {row_end - row_begin, size.cols}});
+    };
+    if (!HasDefaultNumberFormat(output))
+    {
+        for (int row = 0; row < size.rows; ++row)
+        {
+            if (row % ROWS_PER_BLOCK == 0)
+            {
+                prepare(row, std::min(row + ROWS_PER_BLOCK, size.rows));
+            }
+            for (int col = 0; col < size.cols; ++col)
+            {
+                if (col > 0)
+                {
+                    output << '\t';
+                }
+                if (const Cell* cell = CellAt(row, col))
+                {
+                    std::visit([&output](const auto& obj){output << obj;}, cell->GetValue());
+                }
+            }
+            output << '\n';
+        }
+        if (paging_ != nullptr)
+        {
+            paging_->EnforceMemoryBudget();
+        }
+        return;
+    }
+
+    const int precision = int(output.precision());
+    const int blocks = (size.rows + ROWS_PER_BLOCK - 1) / ROWS_PER_BLOCK;
+    int threads = 1;
+    if (size_t(size.rows) * size.cols >= PARALLEL_PRINT_THRESHOLD)
+    {
+        threads = std::clamp(int(std::thread::hardware_concurrency()), 1, blocks);
+    }
+    std::vector<std::string> buffers(threads);
+
+    // Потоки запускаются один раз на всю печать. Главный поток вычисляет
+    // очередную волну из threads блоков строк, после чего все потоки,
+    // включая главный, разбирают её блоки через общий счётчик.
+    std::mutex mutex;
+    std::condition_variable wave_ready;
+    std::condition_variable wave_done;
+    int wave = 0;
+    int wave_first = 0;
+    int wave_last = 0;
+    int pending = 0;
+    bool finished = false;
+    // счётчик не уходит за конец волны, поэтому поток, ещё не узнавший о
+    // следующей волне, не может занять её блок
+    std::atomic<int> next_block{0};
+    auto render = [&](int first, int last) {
+        int block = next_block.load();
+        while (block < last)
+        {
+            if (!next_block.compare_exchange_weak(block, block + 1))
+            {
+                continue;
+            }
+            const int row_begin = block * ROWS_PER_BLOCK;
+            const int row_end = std::min(row_begin + ROWS_PER_BLOCK, size.rows);
+            std::string& buffer = buffers[block - first];
+            buffer.clear();
+            RenderValues(row_begin, row_end, size.cols, precision, buffer);
+            {
+                std::lock_guard lock(mutex);
+                if (--pending == 0)
+                {
+                    wave_done.notify_one();
+                }
+            }
+            block = next_block.load();
+        }
+    };
+    auto work = [&] {
+        int seen = 0;
+        while (true)
+        {
+            int first = 0;
+            int last = 0;
+            {
+                std::unique_lock lock(mutex);
+                wave_ready.wait(lock, [&] {
+                    return finished || wave != seen;
+                });
+                if (finished)
+                {
+                    return;
+                }
+                seen = wave;
+                first = wave_first;
+                last = wave_last;
+            }
+            render(first, last);
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (int i = 1; i < threads; ++i)
+    {
+        workers.emplace_back(work);
+    }
+    auto stop = [&] {
+        {
+            std::lock_guard lock(mutex);
+            finished = true;
+        }
+        wave_ready.notify_all();
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+    };
+
+    try
+    {
+        for (int first = 0; first < blocks; first += threads)
+        {
+            const int last = std::min(first + threads, blocks);
+            // волна вычисляется и загружается целиком до раздачи блоков:
+            // после этого значения ячеек только читаются, и блоки строк
+            // можно форматировать параллельно
+            prepare(first * ROWS_PER_BLOCK, std::min(last * ROWS_PER_BLOCK, size.rows));
+            {
+                std::lock_guard lock(mutex);
+                ++wave;
+                wave_first = first;
+                wave_last = last;
+                pending = last - first;
+            }
+            wave_ready.notify_all();
+            render(first, last);
+            {
+                std::unique_lock lock(mutex);
+                wave_done.wait(lock, [&] {
+                    return pending == 0;
+                });
+            }
+            // блоки пишутся в поток строго по порядку строк
+            for (int i = 0; i < last - first; ++i)
+            {
+                output.write(buffers[i].data(), buffers[i].size());
+            }
+        }
+    }
+    catch (...)
+    {
+        stop();
+        throw;
+    }
+    stop();
+    if (paging_ != nullptr)
+    {
+        paging_->EnforceMemoryBudget();
     }
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    for (int row = 0; row < GetPrintableSize().rows; ++row)
+    const Size size = GetPrintableSize();
+    for (int row = 0; row < size.rows; ++row)
     {
-        for (int col = 0; col < GetPrintableSize().cols; ++col)
+        if (paging_ != nullptr && row % pager_->options.rows_per_page == 0)
+        {
+            paging_->EnforceMemoryBudget();
+            paging_->PageIn(row, std::min(row + pager_->options.rows_per_page, size.rows));
+        }
+        for (int col = 0; col < size.cols; ++col)
         {
             if (col > 0)
             {
                 output << '\t';
             }
-            if (col < int(data_[row].size()))
+            if (const Cell* cell = CellAt(row, col))
             {
-                if (data_[row][col] != nullptr)
-                {
-                    output << data_[row][col]->GetText();
-                }
+                output << cell->GetTextView();
             }
         }
         output << '\n';
     }
+    if (paging_ != nullptr)
+    {
+        paging_->EnforceMemoryBudget();
+    }
+}
+
+void Sheet::SetPriorityRects(std::vector<Rect> rects) {
+    for (const Rect& rect : rects)
+    {
+        if (!rect.IsValid())
+        {
+            throw InvalidPositionException("invalid rect");
+        }
+    }
+    priority_rects_ = std::move(rects);
+    // прерванный пересчёт начнётся заново с новых областей
+    recalc_plan_.Reset();
+}
+
+const std::vector<Rect>& Sheet::GetPriorityRects() const {
+    return priority_rects_;
+}
+
+size_t Sheet::GetPriorityDirtyCount() const {
+    const auto cells = GetPriorityCells();
+    return std::count_if(cells.begin(), cells.end(), [](const Cell* cell) {
+        return cell->IsDirty();
+    });
+}
+
+std::vector<const Cell*> Sheet::GetPriorityCells() const {
+    std::vector<const Cell*> cells;
+    std::unordered_set<const Cell*> seen;
+    for (const Rect& rect : priority_rects_)
+    {
+        ForEachInRect(rect, Order::RowMajor, [&cells, &seen](const Cell& cell, size_t) {
+            if (cell.IsFormula() && seen.insert(&cell).second)
+            {
+                cells.push_back(&cell);
+            }
+        });
+    }
+    return cells;
+}
+
+size_t Sheet::GetDirtyCount() const {
+    return dirty_.size();
+}
+
+size_t Sheet::RecalculateDirty(size_t limit, const EvalBudget& budget) {
+    // прерванный пересчёт продолжается с места остановки; формулы,
+    // устаревшие сверх его ячеек, пересчитываются следующим
+    if (recalc_plan_.IsPending()
+        && !Cell::Evaluate(recalc_plan_.GetCells(), nullptr, &budget, &recalc_plan_))
+    {
+        return dirty_.size();
+    }
+    std::vector<const Cell*> cells;
+    cells.reserve(std::min(limit, dirty_.size()));
+    std::unordered_set<const Cell*> queued;
+    for (const Cell* cell : GetPriorityCells())
+    {
+        if (cells.size() == limit)
+        {
+            break;
+        }
+        if (cell->IsDirty())
+        {
+            cells.push_back(cell);
+            queued.insert(cell);
+        }
+    }
+    // остальные устаревшие формулы вычисляются после видимых; в пачке
+    // limit разных формул
+    for (auto it = dirty_.begin(); it != dirty_.end() && cells.size() < limit; ++it)
+    {
+        if (queued.count(*it) == 0)
+        {
+            cells.push_back(*it);
+        }
+    }
+    Cell::Evaluate(cells, nullptr, &budget, &recalc_plan_);
+    return dirty_.size();
+}
+
+void Sheet::SetCalcMode(CalcMode mode) {
+    if (mode == calc_mode_)
+    {
+        return;
+    }
+    if (mode == CalcMode::Automatic)
+    {
+        Recalculate();
+        calc_mode_ = mode;
+        chain_.clear();
+        chain_index_.clear();
+        return;
+    }
+    calc_mode_ = mode;
+    // начальная цепочка - формулы в порядке хранения, её уточнит пересчёт
+    ForEachCell([this](Position, const Cell& cell) {
+        if (cell.IsFormula())
+        {
+            chain_index_.emplace(&cell, chain_.size());
+            chain_.push_back(const_cast<Cell*>(&cell));
+        }
+    });
+    for (auto& [text, subexpression] : subexpressions_)
+    {
+        if (subexpression.cell != nullptr)
+        {
+            chain_index_.emplace(subexpression.cell.get(), chain_.size());
+            chain_.push_back(subexpression.cell.get());
+        }
+    }
+}
+
+Sheet::CalcMode Sheet::GetCalcMode() const {
+    return calc_mode_;
+}
+
+size_t Sheet::Recalculate(const EvalBudget& budget) {
+    if (calc_mode_ == CalcMode::Automatic)
+    {
+        return RecalculateDirty(dirty_.size(), budget);
+    }
+    const std::vector<Cell*> changed(changed_.begin(), changed_.end());
+    changed_.clear();
+    chain_ = Cell::RecalculateChain(chain_, changed, GetPriorityCells(), &budget, &recalc_plan_);
+    chain_index_.clear();
+    for (size_t i = 0; i < chain_.size(); ++i)
+    {
+        chain_index_.emplace(chain_[i], i);
+    }
+    return dirty_.size();
+}
+
+bool Sheet::DeferInvalidation(Cell* cell) {
+    if (calc_mode_ == CalcMode::Automatic)
+    {
+        return false;
+    }
+    changed_.insert(cell);
+    if (cell->IsFormula() && chain_index_.emplace(cell, chain_.size()).second)
+    {
+        chain_.push_back(cell);
+    }
+    return true;
+}
+
+void Sheet::Unchain(const Cell* cell) {
+    if (calc_mode_ == CalcMode::Automatic)
+    {
+        return;
+    }
+    changed_.erase(const_cast<Cell*>(cell));
+    auto it = chain_index_.find(cell);
+    if (it != chain_index_.end())
+    {
+        chain_[it->second] = nullptr;
+        chain_index_.erase(it);
+    }
+}
+
+void Sheet::EnableConcurrentWriters() {
+    if (dirty_mutex_ == nullptr)
+    {
+        dirty_mutex_ = std::make_unique<std::mutex>();
+    }
+    memory_.EnableConcurrentWriters();
+}
+
+void Sheet::ReserveRows(int rows) {
+    if (zorder_ == nullptr && int(data_.size()) < rows)
+    {
+        data_.resize(rows);
+    }
+}
+
+void Sheet::MarkDirty(const Cell* cell) {
+    std::unique_lock<std::mutex> lock;
+    if (dirty_mutex_ != nullptr)
+    {
+        lock = std::unique_lock(*dirty_mutex_);
+    }
+    dirty_.insert(cell);
+}
+
+void Sheet::MarkClean(const Cell* cell) {
+    std::unique_lock<std::mutex> lock;
+    if (dirty_mutex_ != nullptr)
+    {
+        lock = std::unique_lock(*dirty_mutex_);
+    }
+    dirty_.erase(cell);
+}
+
+void Sheet::CountEdit() {
+    edits_->fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Sheet::GetEditCount() const {
+    return edits_->load(std::memory_order_relaxed);
+}
+
+SheetMemoryUsage Sheet::MemoryUsage() const {
+    SheetMemoryUsage usage;
+    memory_.Fill(usage);
+    if (zorder_ != nullptr)
+    {
+        zorder_->AddMemoryUsage(usage);
+        return usage;
+    }
+    using Row = std::vector<std::unique_ptr<Cell>>;
+    usage.storage.objects = data_.size();
+    usage.storage.bytes = data_.size() * sizeof(Row);
+    usage.storage_slack.objects = data_.capacity() - data_.size();
+    usage.storage_slack.bytes = usage.storage_slack.objects * sizeof(Row);
+    for (const Row& row : data_)
+    {
+        usage.storage.bytes += row.size() * sizeof(row[0]);
+        usage.storage_slack.objects += row.capacity() - row.size();
+        usage.storage_slack.bytes += (row.capacity() - row.size()) * sizeof(row[0]);
+    }
+    return usage;
+}
+
+MemoryTracker& Sheet::GetMemoryTracker() {
+    return memory_;
+}
+
+void Sheet::Link(Sheet& lhs, Sheet& rhs) {
+    ++lhs.links_[&rhs];
+    ++rhs.links_[&lhs];
+}
+
+void Sheet::Unlink(Sheet& lhs, Sheet& rhs) {
+    if (--lhs.links_[&rhs] == 0)
+    {
+        lhs.links_.erase(&rhs);
+    }
+    if (--rhs.links_[&lhs] == 0)
+    {
+        rhs.links_.erase(&lhs);
+    }
+}
+
+std::vector<const Sheet*> Sheet::GetLinkedSheets() const {
+    std::vector<const Sheet*> to_ret;
+    to_ret.reserve(links_.size());
+    for (const auto& [sheet, count] : links_)
+    {
+        to_ret.push_back(sheet);
+    }
+    return to_ret;
+}
+
+void Sheet::EnablePaging(PagingOptions options) {
+    if (zorder_ != nullptr)
+    {
+        throw std::logic_error("paging requires the row-major layout");
+    }
+    if (options.rows_per_page <= 0)
+    {
+        throw std::invalid_argument("rows_per_page must be positive");
+    }
+    if (pager_ != nullptr)
+    {
+        // старый файл подкачки удаляется, поэтому всё загружается обратно
+        PageIn(0, int(data_.size()));
+    }
+    pager_ = std::make_unique<Pager>(std::move(options), Position::MAX_ROWS);
+    paging_ = this;
+    for (int row = 0; row < int(data_.size()); ++row)
+    {
+        const size_t bytes = EstimateRowBytes(data_[row]);
+        pager_->pages[pager_->PageOf(row)].bytes += bytes;
+        pager_->stats.resident_bytes += bytes;
+    }
+    EnforceMemoryBudget();
+}
+
+PagingStats Sheet::GetPagingStats() const {
+    if (pager_ == nullptr)
+    {
+        return {};
+    }
+    PagingStats to_ret = pager_->stats;
+    for (const auto& page : pager_->pages)
+    {
+        if (page.spilled)
+        {
+            ++to_ret.spilled_pages;
+        }
+        else if (page.bytes > 0)
+        {
+            ++to_ret.resident_pages;
+        }
+    }
+    to_ret.spill_file_bytes = pager_->file.GetSize();
+    return to_ret;
+}
+
+void Sheet::EnforceMemoryBudget() {
+    if (pager_ == nullptr || pager_->stats.resident_bytes <= pager_->options.memory_budget)
+    {
+        return;
+    }
+    std::vector<std::pair<uint64_t, int>> candidates;
+    for (int page = 0; page < int(pager_->pages.size()); ++page)
+    {
+        if (!pager_->pages[page].spilled && pager_->pages[page].bytes > 0)
+        {
+            candidates.emplace_back(pager_->pages[page].last_use, page);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());
+    for (const auto& [last_use, page] : candidates)
+    {
+        if (pager_->stats.resident_bytes <= pager_->options.memory_budget)
+        {
+            break;
+        }
+        SpillPage(page);
+    }
+}
+
+const Cell* Sheet::CellAt(int row, int col) const {
+    if (zorder_ != nullptr)
+    {
+        return zorder_->Find({row, col});
+    }
+    if (row < int(data_.size()) && col < int(data_[row].size()))
+    {
+        return data_[row][col].get();
+    }
+    return nullptr;
+}
+
+const Cell* Sheet::LoadCellAt(int row, int col) const {
+    if (paging_ != nullptr)
+    {
+        paging_->PageIn(row, row + 1);
+    }
+    return CellAt(row, col);
+}
+
+void Sheet::LoadRow(int row) {
+    PageIn(row, row + 1);
+}
+
+void Sheet::PageIn(int row_begin, int row_end) {
+    if (pager_ == nullptr || row_begin >= row_end)
+    {
+        return;
+    }
+    const int last = pager_->PageOf(std::min(row_end, Position::MAX_ROWS) - 1);
+    for (int page = pager_->PageOf(row_begin); page <= last; ++page)
+    {
+        if (pager_->pages[page].spilled)
+        {
+            LoadPage(page);
+        }
+        pager_->pages[page].last_use = ++pager_->tick;
+    }
+}
+
+void Sheet::LoadPage(int page) {
+    auto& state = pager_->pages[page];
+    const std::string records = pager_->file.Read(state.slot);
+    state.spilled = false;
+    ++pager_->stats.page_ins;
+
+    // запись: строка, столбец, длина текста и сам текст
+    constexpr size_t HEADER = 3 * sizeof(uint32_t);
+    for (size_t offset = 0; offset + HEADER <= records.size();)
+    {
+        const int row = int(GetUint32(records, offset));
+        const int col = int(GetUint32(records, offset + sizeof(uint32_t)));
+        const size_t size = GetUint32(records, offset + 2 * sizeof(uint32_t));
+        offset += HEADER;
+        auto& cells = data_[row];
+        if (int(cells.size()) < col + 1)
+        {
+            cells.resize(col + 1);
+        }
+        // связанная ячейка ждёт своё содержимое на месте
+        if (cells[col] != nullptr && cells[col]->IsSpilled())
+        {
+            cells[col]->Restore(records.substr(offset, size));
+        }
+        else
+        {
+            cells[col] = std::make_unique<Cell>(*this);
+            cells[col]->Set(records.substr(offset, size));
+        }
+        offset += size;
+    }
+
+    const int row_begin = page * pager_->options.rows_per_page;
+    const int row_end = std::min(row_begin + pager_->options.rows_per_page, int(data_.size()));
+    // оставшиеся в памяти связанные ячейки уже учтены
+    pager_->stats.resident_bytes -= state.bytes;
+    state.bytes = 0;
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        state.bytes += EstimateRowBytes(data_[row]);
+    }
+    pager_->stats.resident_bytes += state.bytes;
+}
+
+void Sheet::SpillPage(int page) {
+    auto& state = pager_->pages[page];
+    const int row_begin = page * pager_->options.rows_per_page;
+    const int row_end = std::min(row_begin + pager_->options.rows_per_page, int(data_.size()));
+    // несвязанные ячейки удаляются, а связанные остаются на месте без
+    // содержимого: на них указывают другие ячейки
+    const auto spills = [](const Cell& cell) {
+        return cell.IsIsolated() || cell.CanSpill();
+    };
+
+    std::string records;
+    state.used_rows = 0;
+    state.used_cols = 0;
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        for (int col = 0; col < int(data_[row].size()); ++col)
+        {
+            const Cell* cell = data_[row][col].get();
+            if (cell == nullptr || cell->IsEmpty())
+            {
+                continue;
+            }
+            state.used_rows = row + 1;
+            state.used_cols = std::max(state.used_cols, col + 1);
+            if (!spills(*cell))
+            {
+                continue;
+            }
+            const std::string_view text = cell->GetTextView();
+            PutUint32(records, uint32_t(row));
+            PutUint32(records, uint32_t(col));
+            PutUint32(records, uint32_t(text.size()));
+            records.append(text);
+        }
+    }
+    pager_->file.Write(state.slot, records);
+
+    size_t bytes = 0;
+    for (int row = row_begin; row < row_end; ++row)
+    {
+        auto& cells = data_[row];
+        bool linked = false;
+        for (int col = 0; col < int(cells.size()); ++col)
+        {
+            Cell* cell = cells[col].get();
+            if (cell == nullptr)
+            {
+                continue;
+            }
+            if (cell->IsIsolated())
+            {
+                cells[col].reset();
+                continue;
+            }
+            if (!cell->IsEmpty() && spills(*cell))
+            {
+                cell->Spill(Position{row, col});
+            }
+            linked = true;
+        }
+        if (!linked)
+        {
+            std::vector<std::unique_ptr<Cell>>().swap(cells);
+        }
+        bytes += EstimateRowBytes(cells);
+    }
+    pager_->stats.resident_bytes -= state.bytes - bytes;
+    state.bytes = bytes;
+    state.spilled = true;
+    ++pager_->stats.page_outs;
+}
+
+void Sheet::AccountBytes(int row, size_t before, size_t after) {
+    auto& state = pager_->pages[pager_->PageOf(row)];
+    state.bytes = state.bytes + after - before;
+    pager_->stats.resident_bytes = pager_->stats.resident_bytes + after - before;
+}
+
+void Sheet::EnableProfiling(bool enable) {
+    if (!enable)
+    {
+        profiler_.reset();
+    }
+    else if (profiler_ == nullptr)
+    {
+        profiler_ = std::make_unique<Profiler>();
+    }
+}
+
+void Sheet::ForgetProfiled(const Cell* cell) {
+    if (workbook_ != nullptr)
+    {
+        workbook_->ForgetProfiled(cell);
+    }
+    else if (profiler_ != nullptr)
+    {
+        profiler_->Forget(cell);
+    }
+}
+
+std::vector<Sheet::FormulaProfile> Sheet::GetProfile() const {
+    std::vector<FormulaProfile> to_ret;
+    if (profiler_ == nullptr)
+    {
+        return to_ret;
+    }
+    const auto names = GetCellNames();
+    for (const auto& [cell, profile] : profiler_->GetProfiles())
+    {
+        auto it = names.find(cell);
+        to_ret.push_back({it != names.end() ? it->second : "?", profile});
+    }
+    std::sort(to_ret.begin(), to_ret.end(), [](const FormulaProfile& lhs, const FormulaProfile& rhs) {
+        return lhs.profile.inclusive > rhs.profile.inclusive;
+    });
+    return to_ret;
+}
+
+void Sheet::WriteCollapsedStacks(std::ostream& output) const {
+    if (profiler_ == nullptr)
+    {
+        return;
+    }
+    const auto names = GetCellNames();
+    profiler_->WriteCollapsedStacks(output, [&names](const Cell* cell) {
+        auto it = names.find(cell);
+        return it != names.end() ? it->second : "?";
+    });
+}
+
+std::vector<std::string> Sheet::GetCriticalPath() const {
+    std::vector<std::string> to_ret;
+    if (profiler_ == nullptr)
+    {
+        return to_ret;
+    }
+    const auto names = GetCellNames();
+    for (const Cell* cell : profiler_->GetCriticalPath())
+    {
+        auto it = names.find(cell);
+        to_ret.push_back(it != names.end() ? it->second : "?");
+    }
+    return to_ret;
+}
+
+void Sheet::EnableExpressionSharing(bool enable) {
+    share_subexpressions_ = enable;
+    if (enable)
+    {
+        return;
+    }
+    // без учёта владельцев они могли бы пережить свои ячейки
+    for (auto it = subexpressions_.begin(); it != subexpressions_.end();)
+    {
+        if (it->second.cell == nullptr)
+        {
+            it = subexpressions_.erase(it);
+        }
+        else
+        {
+            it->second.owner = nullptr;
+            ++it;
+        }
+    }
+}
+
+bool Sheet::IsExpressionSharingEnabled() const {
+    return share_subexpressions_;
+}
+
+size_t Sheet::GetSharedExpressionCount() const {
+    size_t count = 0;
+    for (const auto& [text, subexpression] : subexpressions_)
+    {
+        if (subexpression.cell != nullptr)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+Cell* Sheet::AcquireSubexpression(const std::string& text, const Cell* user) {
+    auto it = subexpressions_.find(text);
+    if (it == subexpressions_.end())
+    {
+        return nullptr;
+    }
+    if (it->second.cell != nullptr)
+    {
+        return it->second.cell.get();
+    }
+    Cell* owner = it->second.owner;
+    if (owner == nullptr || owner == user)
+    {
+        return nullptr;
+    }
+    // второе вхождение: подвыражение становится скрытой ячейкой
+    it->second.owner = nullptr;
+    it->second.cell = std::make_unique<Cell>(*this, true);
+    Cell* shared = it->second.cell.get();
+    // разбор подвыражения сам может добавить записи, it больше не нужен
+    shared->Set(FORMULA_SIGN + text);
+    owner->Reshare();
+    return shared;
+}
+
+void Sheet::RegisterSubexpression(const std::string& text, Cell* owner) {
+    auto& subexpression = subexpressions_[text];
+    if (subexpression.cell == nullptr && subexpression.owner == nullptr)
+    {
+        subexpression.owner = owner;
+    }
+}
+
+void Sheet::UnregisterSubexpression(const std::string& text, const Cell* owner) {
+    auto it = subexpressions_.find(text);
+    if (it != subexpressions_.end() && it->second.owner == owner)
+    {
+        it->second.owner = nullptr;
+        if (it->second.cell == nullptr)
+        {
+            subexpressions_.erase(it);
+        }
+    }
+}
+
+void Sheet::ReleaseSubexpression(Cell* shared) {
+    const std::string text(shared->GetTextView().substr(1));
+    // освобождает и вложенные подвыражения, если они больше не нужны
+    shared->Clear();
+    subexpressions_.erase(text);
+}
+
+Cell* Sheet::AcquireRange(const Rect& range) {
+    std::string text = range.ToString();
+    auto it = ranges_.find(text);
+    if (it != ranges_.end())
+    {
+        return it->second.cell.get();
+    }
+    std::unordered_set<Cell*> cells;
+    ForEachInRect(range, Order::RowMajor, [&cells](const Cell& cell, size_t) {
+        cells.insert(const_cast<Cell*>(&cell));
+    });
+    auto cell = std::make_unique<Cell>(*this, true);
+    cell->SetRange(text, std::move(cells));
+    Range& state = ranges_.emplace(std::move(text), Range{range, std::move(cell), nullptr, nullptr}).first->second;
+    IndexRange(&state, true);
+    // значения формул области приходят в индекс поиска и итоги при
+    // вычислении области
+    state.cell->SetRangeListener([&state](const std::unordered_set<Cell*>& cells) {
+        for (const Cell* cell : cells)
+        {
+            if (state.index != nullptr)
+            {
+                state.index->Refresh(cell);
+            }
+            if (state.totals != nullptr)
+            {
+                state.totals->Refresh(cell);
+            }
+        }
+    });
+    return state.cell.get();
+}
+
+void Sheet::ReleaseRange(Cell* range) {
+    const std::string text(range->GetTextView());
+    range->ClearUsed();
+    auto it = ranges_.find(text);
+    if (it != ranges_.end())
+    {
+        IndexRange(&it->second, false);
+        ranges_.erase(it);
+    }
+}
+
+namespace {
+// Ключ блока индекса областей по номерам строки и столбца блоков.
+uint64_t GetRangeBlock(int block_row, int block_col) {
+    return uint64_t(block_row) << 32 | uint32_t(block_col);
+}
+}  // namespace
+
+void Sheet::IndexRange(Range* range, bool add) {
+    const Rect& rect = range->rect;
+    const int row_end = rect.top_left.row + rect.size.rows - 1;
+    const int col_end = rect.top_left.col + rect.size.cols - 1;
+    for (int row = rect.top_left.row / RANGE_BLOCK; row <= row_end / RANGE_BLOCK; ++row)
+    {
+        for (int col = rect.top_left.col / RANGE_BLOCK; col <= col_end / RANGE_BLOCK; ++col)
+        {
+            const uint64_t block = GetRangeBlock(row, col);
+            if (add)
+            {
+                range_blocks_[block].push_back(range);
+                continue;
+            }
+            auto it = range_blocks_.find(block);
+            auto& ranges = it->second;
+            ranges.erase(std::find(ranges.begin(), ranges.end(), range));
+            if (ranges.empty())
+            {
+                range_blocks_.erase(it);
+            }
+        }
+    }
+}
+
+template <typename Func>
+void Sheet::ForEachRangeAt(Position pos, Func func) {
+    auto it = range_blocks_.find(GetRangeBlock(pos.row / RANGE_BLOCK, pos.col / RANGE_BLOCK));
+    if (it == range_blocks_.end())
+    {
+        return;
+    }
+    for (Range* range : it->second)
+    {
+        const Rect& rect = range->rect;
+        if (pos.row >= rect.top_left.row && pos.row < rect.top_left.row + rect.size.rows
+            && pos.col >= rect.top_left.col && pos.col < rect.top_left.col + rect.size.cols)
+        {
+            func(*range, pos.row - rect.top_left.row, pos.col - rect.top_left.col);
+        }
+    }
+}
+
+int Sheet::Match(const CellInterface::Value& key, Rect range, MatchType type) const {
+    const auto lookup_key = MakeLookupKey(key);
+    if (!lookup_key || !range.IsValid())
+    {
+        return -1;
+    }
+    // поиск без индекса читает O(log n) ячеек и загружает только их страницы
+    const auto cell_at = [this, &range](int offset) {
+        const Position pos = GetMatchPosition(range, offset);
+        return LoadCellAt(pos.row, pos.col);
+    };
+    if (type == MatchType::Exact && range.size.rows > 1)
+    {
+        auto it = ranges_.find(range.ToString());
+        if (it != ranges_.end())
+        {
+            const Range& state = it->second;
+            if (state.index == nullptr)
+            {
+                state.index = std::make_unique<LookupIndex>(range.size.rows, cell_at);
+            }
+            state.cell->RefreshRange();
+            return state.index->Find(*lookup_key);
+        }
+    }
+    const int count = range.size.rows == 1 ? range.size.cols : range.size.rows;
+    return MatchValues(*lookup_key, count, type, [&cell_at](int offset) {
+        const Cell* cell = cell_at(offset);
+        return cell != nullptr ? cell->GetValue() : CellInterface::Value();
+    });
+}
+
+size_t Sheet::GetLookupIndexCount() const {
+    size_t count = 0;
+    for (const auto& [text, range] : ranges_)
+    {
+        if (range.index != nullptr)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+std::variant<double, FormulaError> Sheet::GetAggregate(Rect range, Aggregate type) const {
+    auto it = ranges_.find(range.ToString());
+    if (it == ranges_.end())
+    {
+        return SheetInterface::GetAggregate(range, type);
+    }
+    const Range& state = it->second;
+    if (state.totals == nullptr)
+    {
+        EvaluateRect(range);
+        const auto cell_at = [this, &range](int offset) {
+            return CellAt(range.top_left.row + offset / range.size.cols,
+                          range.top_left.col + offset % range.size.cols);
+        };
+        state.totals = std::make_unique<RangeTotals>(range.size.rows * range.size.cols, cell_at);
+    }
+    state.cell->RefreshRange();
+    return state.totals->Get(type);
+}
+
+size_t Sheet::GetRangeTotalsCount() const {
+    size_t count = 0;
+    for (const auto& [text, range] : ranges_)
+    {
+        if (range.totals != nullptr)
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+void Sheet::AddToRanges(Position pos, Cell* cell) {
+    ForEachRangeAt(pos, [cell](Range& range, int, int) {
+        range.cell->AddRangeCell(cell);
+    });
+}
+
+void Sheet::UpdateRanges(Position pos, const Cell* cell) {
+    ForEachRangeAt(pos, [cell](Range& range, int row, int col) {
+        if (range.index != nullptr && col == 0)
+        {
+            range.index->Update(row, cell);
+        }
+        if (range.totals != nullptr)
+        {
+            range.totals->Update(row * range.rect.size.cols + col, cell);
+        }
+    });
+}
+
+template <typename Func>
+void Sheet::ForEachCell(Func func) const {
+    if (zorder_ != nullptr)
+    {
+        zorder_->ForEach(func);
+        return;
+    }
+    // выгруженные строки пусты, а их ячейки не участвуют в вычислениях
+    for (int row = 0; row < int(data_.size()); ++row)
+    {
+        for (int col = 0; col < int(data_[row].size()); ++col)
+        {
+            if (data_[row][col] != nullptr)
+            {
+                func(Position{row, col}, *data_[row][col]);
+            }
+        }
+    }
+}
+
+std::unordered_map<const Cell*, std::string> Sheet::GetCellNames() const {
+    std::unordered_map<const Cell*, std::string> to_ret;
+    if (workbook_ != nullptr)
+    {
+        for (const auto& name : workbook_->GetSheetNames())
+        {
+            const Sheet* sheet = workbook_->GetSheet(name);
+            if (sheet == this)
+            {
+                continue;
+            }
+            const std::string prefix = FormatSheetName(name) + '!';
+            sheet->ForEachCell([&to_ret, &prefix](Position pos, const Cell& cell) {
+                to_ret.emplace(&cell, prefix + pos.ToString());
+            });
+        }
+    }
+    ForEachCell([&to_ret](Position pos, const Cell& cell) {
+        to_ret.emplace(&cell, pos.ToString());
+    });
+    // скрытые ячейки называются своим выражением
+    for (const auto& [text, subexpression] : subexpressions_)
+    {
+        if (subexpression.cell != nullptr)
+        {
+            to_ret.emplace(subexpression.cell.get(), FORMULA_SIGN + text);
+        }
+    }
+    for (const auto& [text, range] : ranges_)
+    {
+        to_ret.emplace(range.cell.get(), text);
+    }
+    return to_ret;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -1,12 +1,51 @@
 #pragma once
 
 #include "cell.h"
+#include "aggregate.h"
 #include "common.h"
+#include "lookup.h"
+#include "memory_usage.h"
+#include "paging.h"
+#include "profiler.h"
+#include "zorder.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+class Workbook;
 
 class Sheet : public SheetInterface {
 public:
+    // Порядок заполнения буфера при чтении прямоугольной области.
+    enum class Order {
+        RowMajor,     // строка за строкой
+        ColumnMajor,  // столбец за столбцом
+    };
+
+    // Режим пересчёта формул.
+    enum class CalcMode {
+        Automatic,  // правка сразу сбрасывает кеш зависимых формул
+        Manual,     // зависимые формулы пересчитывает Recalculate
+    };
+
+    // Размещение ячеек в памяти.
+    enum class Layout {
+        RowMajor,  // массив строк, в каждой строке массив ячеек
+        ZOrder,    // плитки в Z-порядке, см. ZOrderStore
+    };
+
+    Sheet() = default;
+    // Лист с заданным размещением ячеек. Z-порядок держит соседние по обеим
+    // осям ячейки рядом в памяти и ускоряет чтение прямоугольных областей,
+    // но несовместим с подкачкой.
+    explicit Sheet(Layout layout);
+    // Лист книги: формулы могут ссылаться на другие её листы.
+    explicit Sheet(Workbook& workbook);
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
@@ -16,16 +55,307 @@ public:
 
     Cell* GetCellRef(Position pos);
     const Cell* GetCellRef(Position pos) const;
+    // Возвращает ячейку, создавая пустую, если её ещё нет. Используется для
+    // ячеек, на которые ссылаются формулы.
+    Cell* GetOrCreateCellRef(Position pos);
+    // То же для ячейки другого листа книги. Бросает FormulaException, если
+    // такого листа нет.
+    Cell* GetOrCreateSheetCellRef(const SheetPosition& ref);
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
 
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
 
+    // Записывает значения ячеек области в буфер вызывающего, в котором должно
+    // быть место под rect.size.rows * rect.size.cols элементов. Невычисленные
+    // формулы области вычисляются одним проходом. Пустые ячейки дают пустую
+    // строку. Бросает InvalidPositionException, если область выходит за
+    // пределы таблицы.
+    void GetValues(Rect rect, CellInterface::Value* out, Order order = Order::RowMajor) const;
+    // То же для числовых значений: ячейки, значение которых не число (текст,
+    // ошибка, пустая ячейка), записываются как NaN.
+    void GetNumbers(Rect rect, double* out, Order order = Order::RowMajor) const;
+    // Вычисляет невычисленные формулы области одним проходом, как GetValues,
+    // пока не исчерпан budget. Возвращает false, если бюджет кончился
+    // раньше: часть формул области осталась устаревшей, их последние
+    // значения доступны через Cell::GetLastValue. Следующий вызов для той
+    // же области продолжает с места остановки, не обходя зависимости
+    // заново, если лист с тех пор не менялся.
+    bool Evaluate(Rect rect, const EvalBudget& budget) const;
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Число формул, значение которых устарело и ждёт пересчёта.
+    size_t GetDirtyCount() const;
+    // Пересчитывает до limit устаревших формул вместе с их зависимостями,
+    // пока не исчерпан budget. Пересчёт, прерванный бюджетом, следующий
+    // вызов продолжает с места остановки, если лист с тех пор не менялся.
+    // Возвращает число формул, оставшихся устаревшими.
+    size_t RecalculateDirty(size_t limit, const EvalBudget& budget = {});
+
+    // Области, которые сейчас видит пользователь. Пересчёт (RecalculateDirty,
+    // Recalculate и фоновый пересчёт AsyncSheet) сначала вычисляет формулы
+    // этих областей вместе с их зависимостями и только потом остальные
+    // устаревшие формулы, поэтому время до верных значений на экране после
+    // правки зависит от видимых ячеек, а не от размера листа. Бросает
+    // InvalidPositionException для некорректной области.
+    void SetPriorityRects(std::vector<Rect> rects);
+    const std::vector<Rect>& GetPriorityRects() const;
+    // Число устаревших формул в областях приоритета, без их зависимостей.
+    size_t GetPriorityDirtyCount() const;
+
+    // В ручном режиме правка сбрасывает кеш только самой ячейки, а её
+    // пользователи до вызова Recalculate сохраняют прежние значения и
+    // читаются без пересчёта. Переход в автоматический режим пересчитывает
+    // лист.
+    void SetCalcMode(CalcMode mode);
+    CalcMode GetCalcMode() const;
+    // Пересчитывает все устаревшие формулы листа. В ручном режиме сначала
+    // сбрасывает кеш формул, зависящих от изменённых ячеек, затем вычисляет
+    // формулы в порядке цепочки вычислений. Цепочка хранится между
+    // пересчётами и уточняется: формула, вычисленная раньше своей
+    // зависимости, переставляется после неё, поэтому повторный пересчёт
+    // проходит цепочку без обхода зависимостей.
+    // Пересчёт останавливается, когда исчерпан budget: вычисленные формулы
+    // остаются в кеше, остальные - устаревшими, и следующий вызов
+    // продолжает с них. Возвращает число формул, оставшихся устаревшими.
+    size_t Recalculate(const EvalBudget& budget = {});
+
+    // Для ячеек. В ручном режиме запоминает изменённую ячейку и возвращает
+    // true: сброс кеша её пользователей откладывается до Recalculate.
+    bool DeferInvalidation(Cell* cell);
+    // Забывает уничтожаемую ячейку.
+    void Unchain(const Cell* cell);
+
+    // Разрешает править ячейки листа из нескольких потоков: учёт устаревших
+    // формул ведётся под собственной блокировкой. Остальной доступ
+    // согласует вызывающий, см. PartitionedSheet.
+    void EnableConcurrentWriters();
+    // Заранее выделяет хранилище строк [0, rows): запись в эти строки не
+    // перестраивает массив строк и не мешает работе с другими строками.
+    void ReserveRows(int rows);
+
+    // Учёт устаревших формул, ведётся ячейками.
+    void MarkDirty(const Cell* cell);
+    void MarkClean(const Cell* cell);
+    // Для ячеек: счётчик изменений ячеек и связей между ними, по которому
+    // прерванное вычисление (Cell::EvaluationPlan) проверяет, что его можно
+    // продолжить. У листов книги счётчик общий: вычисление переходит на
+    // другие её листы.
+    void CountEdit();
+    uint64_t GetEditCount() const;
+
+    // Включает выгрузку холодных страниц (полос строк) в файл подкачки.
+    // Бросает std::logic_error для листа с размещением Layout::ZOrder.
+    // Ячейки, не участвующие в зависимостях, выгружаются целиком. От
+    // связанных ячеек остаются только сами объекты Cell со связями и
+    // последним значением (см. Cell::Spill): формулы, зависящие от них,
+    // читают значение без загрузки, а вычисление устаревшей выгруженной
+    // формулы или обращение к её тексту загружает страницу.
+    // Чтение ячеек, в том числе через константный лист (GetCell, GetValues,
+    // Match, печать), загружает нужные страницы прозрачно для вызывающего.
+    // Правка и печать, кроме того, выгружают лишние страницы.
+    // При включённой подкачке указатели, полученные от GetCell, действительны
+    // только до следующего изменения или печати таблицы.
+    void EnablePaging(PagingOptions options);
+    PagingStats GetPagingStats() const;
+    // Выгружает страницы, к которым дольше всего не обращались, пока оценка
+    // занятой памяти превышает бюджет. Вызывается после каждого изменения.
+    void EnforceMemoryBudget();
+    // Для ячеек: загружает выгруженную страницу со строкой row.
+    void LoadRow(int row);
+
+    // Профилирование вычислений формул, по умолчанию выключено. Выключение
+    // сбрасывает накопленный профиль.
+    void EnableProfiling(bool enable);
+    // Профиль, в который ячейки сообщают о вычислениях, или nullptr.
+    Profiler* GetProfiler() const {
+        return profiler_.get();
+    }
+    // Для ячеек: удаляет уничтоженную ячейку из профилей. Пересчёт,
+    // начатый на другом листе книги, учитывает её в профиле того листа,
+    // поэтому ячейка листа книги удаляется из профилей всех её листов.
+    void ForgetProfiled(const Cell* cell);
+
+    struct FormulaProfile {
+        // A1 для ячеек листа, Лист!A1 для ячеек других листов книги
+        std::string cell;
+        CellProfile profile;
+    };
+    // Статистика формул по убыванию включающего времени.
+    std::vector<FormulaProfile> GetProfile() const;
+    // Выгружает пути зависимостей в формате collapsed stacks для flamegraph.
+    void WriteCollapsedStacks(std::ostream& output) const;
+    // Критический путь последнего пересчёта: от формулы к зависимостям.
+    std::vector<std::string> GetCriticalPath() const;
+
+    // Общие подвыражения формул, по умолчанию выключены. Структурно
+    // одинаковые операнды верхних операций формул (например, (B1+C1) в
+    // =(B1+C1)*2 и =(B1+C1)/D1) хранятся в листе один раз - в скрытой
+    // ячейке, которая кешируется и сбрасывается как обычная формула, а
+    // формулы ссылаются на её значение. Подвыражение становится общим,
+    // когда встречается во второй формуле; скрытая ячейка удаляется вместе
+    // с последней ссылающейся на неё формулой. Влияет на формулы, заданные
+    // после включения.
+    void EnableExpressionSharing(bool enable);
+    bool IsExpressionSharingEnabled() const;
+    // Число общих подвыражений листа.
+    size_t GetSharedExpressionCount() const;
+
+    // Для ячеек. Возвращает скрытую ячейку подвыражения или nullptr, если
+    // оно ещё не общее; во втором случае формула user может стать его
+    // владельцем через RegisterSubexpression. Если подвыражение уже
+    // встречалось в формуле другой ячейки, создаёт скрытую ячейку и
+    // перезадаёт ту формулу, чтобы она тоже ссылалась на неё.
+    Cell* AcquireSubexpression(const std::string& text, const Cell* user);
+    void RegisterSubexpression(const std::string& text, Cell* owner);
+    void UnregisterSubexpression(const std::string& text, const Cell* owner);
+    // Удаляет скрытую ячейку, на которую больше никто не ссылается.
+    void ReleaseSubexpression(Cell* shared);
+
+    // Для ячеек. Возвращает скрытую ячейку области, переданной функции
+    // формулы, создавая её при первом обращении: от неё зависят все формулы
+    // с этой областью, а она сама - от ячеек области. Так тысяча формул
+    // поиска по одной таблице связана с таблицей через одну скрытую ячейку.
+    // Ячейки, созданные в области позже, добавляются в неё листом.
+    Cell* AcquireRange(const Rect& range);
+    // Удаляет скрытую ячейку области, на которую больше никто не ссылается.
+    void ReleaseRange(Cell* range);
+
+    // Точный поиск в первом столбце области, переданной формулам, идёт по
+    // индексу этого столбца. Индекс строится при первом поиске и
+    // обновляется при каждом изменении ячейки столбца. Остальной поиск
+    // устроен как в SheetInterface::Match.
+    int Match(const CellInterface::Value& key, Rect range, MatchType type) const override;
+    // Число построенных индексов поиска.
+    size_t GetLookupIndexCount() const;
+    // Итоги области, переданной формулам, хранятся в RangeTotals: они
+    // строятся при первом запросе и дальше обновляются при каждом
+    // изменении ячейки области, так что правка одной ячейки не требует
+    // заново обходить область. Остальные области считаются как в
+    // SheetInterface::GetAggregate.
+    std::variant<double, FormulaError> GetAggregate(Rect range, Aggregate type) const override;
+    // Число областей с поддерживаемыми итогами.
+    size_t GetRangeTotalsCount() const;
+
+    // Память листа по видам объектов. Счётчики ведутся ячейками при каждом
+    // изменении, а отчёт обходит только строки хранилища (или плитки
+    // Z-порядка), поэтому его можно снимать постоянно, как показатель
+    // мониторинга. Страницы, выгруженные подкачкой, в отчёт не входят.
+    SheetMemoryUsage MemoryUsage() const;
+    // Для ячеек: счётчики памяти листа.
+    MemoryTracker& GetMemoryTracker();
+
+    // Учёт ссылок между листами: число зависимостей между парой листов.
+    static void Link(Sheet& lhs, Sheet& rhs);
+    static void Unlink(Sheet& lhs, Sheet& rhs);
+    // Листы, связанные с этим хотя бы одной зависимостью.
+    std::vector<const Sheet*> GetLinkedSheets() const;
+
 private:
-	
+
+    // Обходит ячейки области, существующие в хранилище, передавая их вместе
+    // с индексом в выходном буфере. Выгруженные страницы области
+    // загружаются.
+    template <typename Func>
+    void ForEachInRect(Rect rect, Order order, Func func) const;
+    bool EvaluateRect(Rect rect, const EvalBudget* budget = nullptr) const;
+    // Формулы областей приоритета, каждая по разу, даже если области
+    // перекрываются.
+    std::vector<const Cell*> GetPriorityCells() const;
+    // Дописывает в buffer значения строк [row_begin, row_end) в формате
+    // PrintValues. Формулы к этому моменту должны быть вычислены.
+    void RenderValues(int row_begin, int row_end, int cols, int precision,
+                      std::string& buffer) const;
+
+    // Ячейка хранилища или nullptr, без проверки позиции и подкачки.
+    const Cell* CellAt(int row, int col) const;
+    // То же, но сначала загружает выгруженную страницу строки row.
+    const Cell* LoadCellAt(int row, int col) const;
+    // Обходит загруженные ячейки листа, передавая позицию и ячейку.
+    template <typename Func>
+    void ForEachCell(Func func) const;
+    // Имена ячеек листа и, для листа книги, ячеек остальных листов.
+    std::unordered_map<const Cell*, std::string> GetCellNames() const;
+
+    // Загружает выгруженные страницы, покрывающие строки [row_begin,
+    // row_end), и отмечает обращение к ним. Без подкачки ничего не делает.
+    void PageIn(int row_begin, int row_end);
+    void LoadPage(int page);
+    void SpillPage(int page);
+    // Связывает новую ячейку с областями, в которые она попадает.
+    void AddToRanges(Position pos, Cell* cell);
+    // Обновляет индексы поиска и итоги областей после изменения ячейки pos.
+    void UpdateRanges(Position pos, const Cell* cell);
+    // Обходит области, в которые попадает pos, передавая область и
+    // смещение pos в ней.
+    template <typename Func>
+    void ForEachRangeAt(Position pos, Func func);
+    // Учитывает изменение оценки памяти ячеек строки row.
+    void AccountBytes(int row, size_t before, size_t after);
+
+    Workbook* workbook_ = nullptr;
+    std::unique_ptr<Pager> pager_;
+    // Этот же лист при включённой подкачке. Константные методы загружают
+    // через него выгруженные страницы, как ячейки через свою ссылку на
+    // лист: подкачку включает неконстантный EnablePaging, и загрузка не
+    // меняет содержимое листа.
+    Sheet* paging_ = nullptr;
+    std::unique_ptr<Profiler> profiler_;
+    std::unordered_map<const Sheet*, size_t> links_;
+    // объявлено раньше data_, чтобы пережить удаление ячеек
+    std::unordered_set<const Cell*> dirty_;
+    std::unique_ptr<std::mutex> dirty_mutex_;
+    // объявлено раньше data_ по той же причине
+    MemoryTracker memory_;
+    CalcMode calc_mode_ = CalcMode::Automatic;
+    // ручной режим: изменённые после пересчёта ячейки и цепочка вычислений
+    // с индексами формул в ней; уничтоженные формулы оставляют nullptr
+    std::unordered_set<Cell*> changed_;
+    std::vector<Cell*> chain_;
+    std::unordered_map<const Cell*, size_t> chain_index_;
+    std::vector<Rect> priority_rects_;
+    std::atomic<uint64_t> own_edits_{0};
+    // own_edits_ или счётчик книги
+    std::atomic<uint64_t>* edits_ = &own_edits_;
+    // прерванные бюджетом пересчёт (Recalculate, RecalculateDirty) и
+    // вычисление области (Evaluate)
+    Cell::EvaluationPlan recalc_plan_{*this};
+    mutable Cell::EvaluationPlan evaluate_plan_{*this};
     std::vector<std::vector<std::unique_ptr<Cell>>> data_;
+    // при размещении Layout::ZOrder ячейки хранятся здесь, а data_ пуст
+    std::unique_ptr<ZOrderStore> zorder_;
+
+    // Подвыражение, встреченное в формулах листа: пока оно не общее,
+    // запоминается первая формула с ним, затем хранится скрытая ячейка.
+    struct Subexpression {
+        Cell* owner = nullptr;
+        std::unique_ptr<Cell> cell;
+    };
+    bool share_subexpressions_ = false;
+    // объявлено после data_: скрытые ячейки удаляются раньше остальных
+    std::unordered_map<std::string, Subexpression> subexpressions_;
+
+    // Область, переданная функциям формул листа.
+    struct Range {
+        Rect rect;
+        std::unique_ptr<Cell> cell;
+        // индекс первого столбца области для точного поиска
+        mutable std::unique_ptr<LookupIndex> index;
+        mutable std::unique_ptr<RangeTotals> totals;
+    };
+    // Сторона квадратного блока таблицы в индексе областей.
+    static constexpr int RANGE_BLOCK = 256;
+    // Добавляет область в блоки, которые она пересекает, или убирает из них.
+    void IndexRange(Range* range, bool add);
+    // Области, пересекающие блок, по номеру блока: правка ячейки проверяет
+    // только области своего блока. Объявлено раньше ranges_, чтобы
+    // пережить удаление скрытых ячеек областей.
+    std::unordered_map<uint64_t, std::vector<Range*>> range_blocks_;
+    // по записи области
+    std::unordered_map<std::string, Range> ranges_;
 
 };
\ No newline at end of file
@@ -0,0 +1,781 @@
+#include "sheet_server.h"
+#include "workbook.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+// запрос или ответ больше этого считается нарушением протокола
+constexpr uint32_t MAX_FRAME = 64u << 20;
+// больше ячеек за один запрос GetValues не читается
+constexpr size_t MAX_RANGE_CELLS = size_t(1) << 20;
+// соединение не читается, пока клиент не заберёт столько ответов
+constexpr size_t MAX_PENDING_OUTPUT = 8u << 20;
+constexpr size_t READ_CHUNK = 64u << 10;
+
+enum ValueTag : uint8_t {
+    TAG_STRING,
+    TAG_NUMBER,
+    TAG_ERROR,
+};
+
+std::string ErrnoMessage(const std::string& what) {
+    return what + ": " + std::strerror(errno);
+}
+
+void SetNonBlocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        throw ServerException(ErrnoMessage("fcntl"));
+    }
+}
+
+sockaddr_un MakeAddress(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        throw ServerException("invalid socket path " + path);
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+    return address;
+}
+
+void PutUint32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+    {
+        out += char((value >> (8 * i)) & 0xFF);
+    }
+}
+
+void PutDouble(std::string& out, double value) {
+    uint64_t bits = 0;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; ++i)
+    {
+        out += char((bits >> (8 * i)) & 0xFF);
+    }
+}
+
+void PutString(std::string& out, std::string_view text) {
+    PutUint32(out, uint32_t(text.size()));
+    out += text;
+}
+
+void PutValue(std::string& out, const CellInterface::Value& value) {
+    if (const auto* number = std::get_if<double>(&value))
+    {
+        out += char(TAG_NUMBER);
+        PutDouble(out, *number);
+    }
+    else if (const auto* error = std::get_if<FormulaError>(&value))
+    {
+        out += char(TAG_ERROR);
+        out += char(error->GetCategory());
+    }
+    else
+    {
+        out += char(TAG_STRING);
+        PutString(out, std::get<std::string>(value));
+    }
+}
+
+// Начинает кадр: место под длину заполняет EndFrame.
+size_t BeginFrame(std::string& out) {
+    const size_t begin = out.size();
+    PutUint32(out, 0);
+    return begin;
+}
+
+void EndFrame(std::string& out, size_t begin) {
+    const uint32_t size = uint32_t(out.size() - begin - sizeof(uint32_t));
+    for (int i = 0; i < 4; ++i)
+    {
+        out[begin + i] = char((size >> (8 * i)) & 0xFF);
+    }
+}
+
+// Последовательное чтение полей кадра с проверкой границ.
+class Decoder {
+public:
+    explicit Decoder(std::string_view data) : data_(data) {}
+
+    bool GetUint8(uint8_t& value) {
+        if (data_.size() < 1)
+        {
+            return false;
+        }
+        value = uint8_t(data_[0]);
+        data_.remove_prefix(1);
+        return true;
+    }
+
+    bool GetUint32(uint32_t& value) {
+        if (data_.size() < 4)
+        {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            value |= uint32_t(uint8_t(data_[i])) << (8 * i);
+        }
+        data_.remove_prefix(4);
+        return true;
+    }
+
+    bool GetDouble(double& value) {
+        if (data_.size() < 8)
+        {
+            return false;
+        }
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            bits |= uint64_t(uint8_t(data_[i])) << (8 * i);
+        }
+        std::memcpy(&value, &bits, sizeof(value));
+        data_.remove_prefix(8);
+        return true;
+    }
+
+    bool GetString(std::string_view& text) {
+        uint32_t size = 0;
+        if (!GetUint32(size) || data_.size() < size)
+        {
+            return false;
+        }
+        text = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return true;
+    }
+
+    bool GetValue(CellInterface::Value& value) {
+        uint8_t tag = 0;
+        if (!GetUint8(tag))
+        {
+            return false;
+        }
+        switch (tag)
+        {
+        case TAG_STRING:
+        {
+            std::string_view text;
+            if (!GetString(text))
+            {
+                return false;
+            }
+            value = std::string(text);
+            return true;
+        }
+        case TAG_NUMBER:
+        {
+            double number = 0;
+            if (!GetDouble(number))
+            {
+                return false;
+            }
+            value = number;
+            return true;
+        }
+        case TAG_ERROR:
+        {
+            uint8_t category = 0;
+            if (!GetUint8(category) || category > uint8_t(FormulaError::Category::NA))
+            {
+                return false;
+            }
+            value = FormulaError(FormulaError::Category(category));
+            return true;
+        }
+        }
+        return false;
+    }
+
+private:
+    std::string_view data_;
+};
+
+// Длина тела кадра, если кадр в data получен целиком, иначе nullopt.
+// Бросает ServerException для кадра недопустимой длины.
+std::optional<uint32_t> CompleteFrame(std::string_view data) {
+    uint32_t size = 0;
+    if (!Decoder(data).GetUint32(size))
+    {
+        return std::nullopt;
+    }
+    if (size > MAX_FRAME)
+    {
+        throw ServerException("frame too large");
+    }
+    if (data.size() - sizeof(uint32_t) < size)
+    {
+        return std::nullopt;
+    }
+    return size;
+}
+}  // namespace
+
+SheetServer::SheetServer(Sheet& sheet, std::string socket_path)
+    : sheets_{&sheet}
+    , socket_path_(std::move(socket_path)) {
+    Listen();
+}
+
+SheetServer::SheetServer(Workbook& book, std::string socket_path)
+    : socket_path_(std::move(socket_path)) {
+    for (const auto& name : book.GetSheetNames())
+    {
+        sheets_.push_back(book.GetSheet(name));
+    }
+    Listen();
+}
+
+SheetServer::~SheetServer() {
+    for (const Connection& connection : connections_)
+    {
+        close(connection.fd);
+    }
+    for (int fd : {listen_fd_, wake_fds_[0], wake_fds_[1]})
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    if (listen_fd_ >= 0)
+    {
+        unlink(socket_path_.c_str());
+    }
+}
+
+void SheetServer::Listen() {
+    const sockaddr_un address = MakeAddress(socket_path_);
+    if (pipe(wake_fds_) < 0)
+    {
+        throw ServerException(ErrnoMessage("pipe"));
+    }
+    SetNonBlocking(wake_fds_[1]);
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd_ < 0)
+    {
+        throw ServerException(ErrnoMessage("socket"));
+    }
+    // сокет, оставшийся от прошлого запуска
+    unlink(socket_path_.c_str());
+    if (bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0
+        || listen(listen_fd_, SOMAXCONN) < 0)
+    {
+        throw ServerException(ErrnoMessage("cannot listen on " + socket_path_));
+    }
+    SetNonBlocking(listen_fd_);
+}
+
+void SheetServer::Run() {
+    std::vector<pollfd> fds;
+    while (true)
+    {
+        fds.clear();
+        fds.push_back({wake_fds_[0], POLLIN, 0});
+        fds.push_back({listen_fd_, POLLIN, 0});
+        for (const Connection& connection : connections_)
+        {
+            short events = 0;
+            // клиент, не забирающий ответы, перестаёт читаться
+            if (connection.out.size() < MAX_PENDING_OUTPUT)
+            {
+                events |= POLLIN;
+            }
+            if (!connection.out.empty())
+            {
+                events |= POLLOUT;
+            }
+            fds.push_back({connection.fd, events, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw ServerException(ErrnoMessage("poll"));
+        }
+        if (fds[0].revents != 0)
+        {
+            char wake[64];
+            while (read(wake_fds_[0], wake, sizeof(wake)) == sizeof(wake))
+            {
+            }
+            return;
+        }
+        for (size_t i = 0; i < connections_.size(); ++i)
+        {
+            if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                Read(connections_[i]);
+            }
+        }
+        // новые соединения опрашиваются со следующей итерации
+        if (fds[1].revents & POLLIN)
+        {
+            Accept();
+        }
+        ExecuteBatch();
+        for (Connection& connection : connections_)
+        {
+            if (!connection.out.empty())
+            {
+                Write(connection);
+            }
+        }
+        for (size_t i = 0; i < connections_.size();)
+        {
+            if (connections_[i].closed)
+            {
+                close(connections_[i].fd);
+                connections_[i] = std::move(connections_.back());
+                connections_.pop_back();
+            }
+            else
+            {
+                ++i;
+            }
+        }
+    }
+}
+
+void SheetServer::Stop() {
+    const char wake = 0;
+    // канал неблокирующий: если он полон, сервер и так проснётся
+    [[maybe_unused]] const auto written = write(wake_fds_[1], &wake, 1);
+}
+
+std::unique_lock<std::mutex> SheetServer::Lock() {
+    return std::unique_lock(mutex_);
+}
+
+ServerStats SheetServer::GetStats() {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+void SheetServer::Accept() {
+    while (true)
+    {
+        const int fd = accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // EAGAIN: очередь разобрана; прочие ошибки касаются одного
+            // соединения и не останавливают сервер
+            return;
+        }
+        SetNonBlocking(fd);
+        Connection connection;
+        connection.fd = fd;
+        connections_.push_back(std::move(connection));
+        std::lock_guard lock(mutex_);
+        ++stats_.connections;
+    }
+}
+
+void SheetServer::Read(Connection& connection) {
+    char buffer[READ_CHUNK];
+    while (connection.out.size() < MAX_PENDING_OUTPUT)
+    {
+        const ssize_t size = read(connection.fd, buffer, sizeof(buffer));
+        if (size > 0)
+        {
+            connection.in.append(buffer, size_t(size));
+            continue;
+        }
+        if (size < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            // запросы, уже полученные от закрытого соединения, всё равно
+            // выполняются
+            connection.closed = true;
+        }
+        return;
+    }
+}
+
+void SheetServer::Write(Connection& connection) {
+    size_t offset = 0;
+    while (offset < connection.out.size())
+    {
+        const ssize_t size = send(connection.fd, connection.out.data() + offset,
+                                  connection.out.size() - offset, MSG_NOSIGNAL);
+        if (size >= 0)
+        {
+            offset += size_t(size);
+            continue;
+        }
+        if (errno == EINTR)
+        {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            connection.closed = true;
+            connection.out.clear();
+            return;
+        }
+        break;
+    }
+    connection.out.erase(0, offset);
+}
+
+void SheetServer::ExecuteBatch() {
+    std::unique_lock<std::mutex> lock;
+    size_t batch = 0;
+    for (Connection& connection : connections_)
+    {
+        while (true)
+        {
+            const std::string_view pending = std::string_view(connection.in).substr(connection.in_offset);
+            std::optional<uint32_t> size;
+            try
+            {
+                size = CompleteFrame(pending);
+            }
+            catch (const ServerException&)
+            {
+                // длину следующего кадра не узнать, соединение закрывается
+                connection.closed = true;
+                break;
+            }
+            if (!size)
+            {
+                break;
+            }
+            if (!lock.owns_lock())
+            {
+                lock = std::unique_lock(mutex_);
+            }
+            Execute(pending.substr(sizeof(uint32_t), *size), connection.out);
+            connection.in_offset += sizeof(uint32_t) + *size;
+            ++batch;
+        }
+        connection.in.erase(0, connection.in_offset);
+        connection.in_offset = 0;
+    }
+    if (batch > 0)
+    {
+        stats_.requests += batch;
+        ++stats_.batches;
+        stats_.max_batch = std::max(stats_.max_batch, batch);
+    }
+}
+
+void SheetServer::Execute(std::string_view request, std::string& out) {
+    const size_t begin = BeginFrame(out);
+    const auto reply_error = [&out, begin](WireError error) {
+        out.resize(begin + sizeof(uint32_t));
+        out += char(error);
+        EndFrame(out, begin);
+    };
+    Decoder in(request);
+    uint8_t op = 0;
+    uint8_t sheet_index = 0;
+    uint32_t row = 0;
+    uint32_t col = 0;
+    if (!in.GetUint8(op) || !in.GetUint8(sheet_index) || !in.GetUint32(row) || !in.GetUint32(col))
+    {
+        reply_error(WireError::BadRequest);
+        return;
+    }
+    if (sheet_index >= sheets_.size())
+    {
+        reply_error(WireError::UnknownSheet);
+        return;
+    }
+    Sheet& sheet = *sheets_[sheet_index];
+    const Position pos{int(row), int(col)};
+    out += char(WireError::None);
+    try
+    {
+        switch (WireOp(op))
+        {
+        case WireOp::SetCell:
+        {
+            std::string_view text;
+            if (!in.GetString(text))
+            {
+                reply_error(WireError::BadRequest);
+                return;
+            }
+            sheet.SetCell(pos, std::string(text));
+            break;
+        }
+        case WireOp::ClearCell:
+            sheet.ClearCell(pos);
+            break;
+        case WireOp::GetValue:
+        {
+            const CellInterface* cell = sheet.GetCell(pos);
+            PutValue(out, cell != nullptr ? cell->GetValue() : CellInterface::Value());
+            break;
+        }
+        case WireOp::GetText:
+        {
+            const CellInterface* cell = sheet.GetCell(pos);
+            PutString(out, cell != nullptr ? cell->GetTextView() : std::string_view());
+            break;
+        }
+        case WireOp::GetValues:
+        {
+            uint32_t rows = 0;
+            uint32_t cols = 0;
+            if (!in.GetUint32(rows) || !in.GetUint32(cols))
+            {
+                reply_error(WireError::BadRequest);
+                return;
+            }
+            const Rect rect{pos, {int(rows), int(cols)}};
+            if (!rect.IsValid())
+            {
+                reply_error(WireError::InvalidPosition);
+                return;
+            }
+            const size_t count = size_t(rows) * cols;
+            if (count > MAX_RANGE_CELLS)
+            {
+                reply_error(WireError::BadRequest);
+                return;
+            }
+            std::vector<CellInterface::Value> values(count);
+            sheet.GetValues(rect, values.data());
+            PutUint32(out, uint32_t(count));
+            for (const auto& value : values)
+            {
+                PutValue(out, value);
+            }
+            break;
+        }
+        default:
+            reply_error(WireError::BadRequest);
+            return;
+        }
+    }
+    catch (const InvalidPositionException&)
+    {
+        reply_error(WireError::InvalidPosition);
+        return;
+    }
+    catch (const FormulaException&)
+    {
+        reply_error(WireError::Formula);
+        return;
+    }
+    catch (const CircularDependencyException&)
+    {
+        reply_error(WireError::CircularDependency);
+        return;
+    }
+    EndFrame(out, begin);
+}
+
+SheetClient::SheetClient(const std::string& socket_path) {
+    const sockaddr_un address = MakeAddress(socket_path);
+    fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd_ < 0)
+    {
+        throw ServerException(ErrnoMessage("socket"));
+    }
+    if (connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+    {
+        const std::string message = ErrnoMessage("cannot connect to " + socket_path);
+        close(fd_);
+        throw ServerException(message);
+    }
+    SetNonBlocking(fd_);
+}
+
+SheetClient::~SheetClient() {
+    close(fd_);
+}
+
+void SheetClient::Put(WireOp op, int sheet, Position pos) {
+    if (sheet < 0 || sheet > UINT8_MAX)
+    {
+        throw std::invalid_argument("invalid sheet index");
+    }
+    out_ += char(op);
+    out_ += char(sheet);
+    PutUint32(out_, uint32_t(pos.row));
+    PutUint32(out_, uint32_t(pos.col));
+}
+
+void SheetClient::EndRequest(size_t begin) {
+    EndFrame(out_, begin);
+    pending_.push_back(WireOp(uint8_t(out_[begin + sizeof(uint32_t)])));
+}
+
+void SheetClient::SetCell(int sheet, Position pos, std::string_view text) {
+    const size_t begin = BeginFrame(out_);
+    Put(WireOp::SetCell, sheet, pos);
+    PutString(out_, text);
+    EndRequest(begin);
+}
+
+void SheetClient::ClearCell(int sheet, Position pos) {
+    const size_t begin = BeginFrame(out_);
+    Put(WireOp::ClearCell, sheet, pos);
+    EndRequest(begin);
+}
+
+void SheetClient::GetValue(int sheet, Position pos) {
+    const size_t begin = BeginFrame(out_);
+    Put(WireOp::GetValue, sheet, pos);
+    EndRequest(begin);
+}
+
+void SheetClient::GetText(int sheet, Position pos) {
+    const size_t begin = BeginFrame(out_);
+    Put(WireOp::GetText, sheet, pos);
+    EndRequest(begin);
+}
+
+void SheetClient::GetValues(int sheet, Rect rect) {
+    const size_t begin = BeginFrame(out_);
+    Put(WireOp::GetValues, sheet, rect.top_left);
+    PutUint32(out_, uint32_t(rect.size.rows));
+    PutUint32(out_, uint32_t(rect.size.cols));
+    EndRequest(begin);
+}
+
+void SheetClient::Flush() {
+    size_t offset = 0;
+    while (offset < out_.size())
+    {
+        // ответы забираются во время отправки, иначе сервер, упёршись в
+        // непрочитанные ответы, перестанет читать запросы
+        pollfd fd{fd_, POLLIN | POLLOUT, 0};
+        if (poll(&fd, 1, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw ServerException(ErrnoMessage("poll"));
+        }
+        if ((fd.revents & POLLIN) && !ReadSome())
+        {
+            throw ServerException("connection closed by server");
+        }
+        if (fd.revents & (POLLOUT | POLLERR | POLLHUP))
+        {
+            const ssize_t size = send(fd_, out_.data() + offset, out_.size() - offset, MSG_NOSIGNAL);
+            if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                throw ServerException(ErrnoMessage("send"));
+            }
+            offset += size_t(std::max<ssize_t>(size, 0));
+        }
+    }
+    out_.clear();
+}
+
+bool SheetClient::ReadSome() {
+    char buffer[READ_CHUNK];
+    while (true)
+    {
+        const ssize_t size = read(fd_, buffer, sizeof(buffer));
+        if (size > 0)
+        {
+            in_.append(buffer, size_t(size));
+            continue;
+        }
+        if (size < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+WireResponse SheetClient::Receive() {
+    if (pending_.empty())
+    {
+        throw ServerException("no pending requests");
+    }
+    Flush();
+    std::optional<uint32_t> size;
+    while (!(size = CompleteFrame(std::string_view(in_).substr(in_offset_))))
+    {
+        pollfd fd{fd_, POLLIN, 0};
+        if (poll(&fd, 1, -1) < 0 && errno != EINTR)
+        {
+            throw ServerException(ErrnoMessage("poll"));
+        }
+        if ((fd.revents & (POLLIN | POLLHUP | POLLERR)) && !ReadSome())
+        {
+            throw ServerException("connection closed by server");
+        }
+    }
+    Decoder in(std::string_view(in_).substr(in_offset_ + sizeof(uint32_t), *size));
+    in_offset_ += sizeof(uint32_t) + *size;
+    const WireOp op = pending_.front();
+    pending_.pop_front();
+
+    WireResponse response;
+    uint8_t error = 0;
+    bool ok = in.GetUint8(error);
+    response.error = WireError(error);
+    if (ok && response.error == WireError::None)
+    {
+        switch (op)
+        {
+        case WireOp::GetValue:
+            response.values.emplace_back();
+            ok = in.GetValue(response.values.back());
+            break;
+        case WireOp::GetText:
+        {
+            std::string_view text;
+            ok = in.GetString(text);
+            response.text = text;
+            break;
+        }
+        case WireOp::GetValues:
+        {
+            uint32_t count = 0;
+            ok = in.GetUint32(count);
+            for (uint32_t i = 0; ok && i < count; ++i)
+            {
+                response.values.emplace_back();
+                ok = in.GetValue(response.values.back());
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    if (!ok)
+    {
+        throw ServerException("malformed response");
+    }
+    // прочитанные ответы вырезаются из буфера изредка, пачкой
+    if (in_offset_ == in_.size() || in_offset_ > READ_CHUNK)
+    {
+        in_.erase(0, in_offset_);
+        in_offset_ = 0;
+    }
+    return response;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class Workbook;
+
+// Исключение, выбрасываемое при ошибке сокета или нарушении протокола
+class ServerException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичный протокол сервера листов. Числа - little-endian, запрос и ответ
+// начинаются с длины тела (uint32), за которой идёт тело.
+//
+// Запрос: операция (uint8), номер листа (uint8), строка и столбец
+// (uint32), далее для SetCell - длина текста (uint32) и текст, для
+// GetValues - число строк и столбцов области (uint32).
+//
+// Ответ: код ошибки (uint8, WireError::None при успехе), далее для
+// GetValue - значение, для GetText - длина текста и текст, для GetValues -
+// число значений (uint32) и значения построчно. Значение - тег (uint8:
+// 0 - текст, 1 - число, 2 - ошибка формулы) и текст, double или категория
+// ошибки (uint8).
+//
+// Клиент может отправлять запросы, не дожидаясь ответов; ответы приходят
+// в порядке запросов.
+enum class WireOp : uint8_t {
+    SetCell = 1,
+    ClearCell,
+    GetValue,
+    GetText,
+    GetValues,
+};
+
+enum class WireError : uint8_t {
+    None,
+    InvalidPosition,
+    Formula,
+    CircularDependency,
+    UnknownSheet,
+    BadRequest,
+};
+
+struct WireResponse {
+    WireError error = WireError::None;
+    // для GetValue - одно значение, для GetValues - значения построчно
+    std::vector<CellInterface::Value> values;
+    // для GetText
+    std::string text;
+};
+
+struct ServerStats {
+    size_t connections = 0;
+    size_t requests = 0;
+    // пачки запросов, выполненных под одной блокировкой
+    size_t batches = 0;
+    size_t max_batch = 0;
+};
+
+// Сервер, обслуживающий лист или листы книги через Unix domain socket.
+// Один поток обрабатывает все соединения: за итерацию он читает всё, что
+// пришло по всем соединениям, выполняет полученные запросы одной пачкой
+// под одной блокировкой (в порядке поступления внутри соединения) и
+// отправляет накопленные ответы каждому соединению одной записью.
+class SheetServer {
+public:
+    // Листы нумеруются с нуля; лист книги - в порядке GetSheetNames.
+    SheetServer(Sheet& sheet, std::string socket_path);
+    SheetServer(Workbook& book, std::string socket_path);
+    ~SheetServer();
+
+    SheetServer(const SheetServer&) = delete;
+    SheetServer& operator=(const SheetServer&) = delete;
+
+    // Обслуживает соединения, пока не будет вызван Stop.
+    void Run();
+    // Можно вызывать из другого потока и из обработчика сигнала.
+    void Stop();
+
+    // Пока Run работает, к листам можно обращаться только под этой
+    // блокировкой: её держит каждая пачка запросов.
+    std::unique_lock<std::mutex> Lock();
+    ServerStats GetStats();
+
+private:
+    struct Connection {
+        int fd = -1;
+        std::string in;
+        size_t in_offset = 0;
+        std::string out;
+        bool closed = false;
+    };
+
+    void Listen();
+    void Accept();
+    void Read(Connection& connection);
+    void Write(Connection& connection);
+    // Выполняет полные запросы, накопленные во входных буферах.
+    void ExecuteBatch();
+    void Execute(std::string_view request, std::string& out);
+
+    std::vector<Sheet*> sheets_;
+    std::string socket_path_;
+    int listen_fd_ = -1;
+    // Stop пишет в канал, чтобы разбудить poll
+    int wake_fds_[2] = {-1, -1};
+    std::vector<Connection> connections_;
+    std::mutex mutex_;
+    ServerStats stats_;
+};
+
+// Клиент сервера листов. Запросы копятся в буфере и уходят при Flush,
+// поэтому несколько запросов отправляются одной записью.
+class SheetClient {
+public:
+    explicit SheetClient(const std::string& socket_path);
+    ~SheetClient();
+
+    SheetClient(const SheetClient&) = delete;
+    SheetClient& operator=(const SheetClient&) = delete;
+
+    void SetCell(int sheet, Position pos, std::string_view text);
+    void ClearCell(int sheet, Position pos);
+    void GetValue(int sheet, Position pos);
+    void GetText(int sheet, Position pos);
+    void GetValues(int sheet, Rect rect);
+
+    void Flush();
+    // Ответ на самый ранний запрос, ещё не получивший ответа.
+    WireResponse Receive();
+    size_t GetPendingCount() const {
+        return pending_.size();
+    }
+
+private:
+    void Put(WireOp op, int sheet, Position pos);
+    void EndRequest(size_t begin);
+    // Дочитывает сокет, возвращает false, если соединение закрыто.
+    bool ReadSome();
+
+    int fd_ = -1;
+    std::string out_;
+    std::string in_;
+    size_t in_offset_ = 0;
+    std::deque<WireOp> pending_;
+};
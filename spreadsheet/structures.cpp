@@ -1,22 +1,38 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
+#include <charconv>
 #include <algorithm>
+#include <iterator>
+#include <sstream>
+#include <tuple>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
-const Position Position::NONE = {-1, -1};
 
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
+namespace {
+// Число букв в обозначении последнего столбца.
+constexpr int CountLetters(int cols) {
+    int count = 0;
+    for (long long c = cols - 1; c >= 0; c = c / LETTERS - 1) {
+        ++count;
+    }
+    return count;
 }
 
-bool Position::operator<(const Position rhs) const {
-    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
+constexpr int CountDigits(int rows) {
+    int count = 1;
+    for (; rows >= 10; rows /= 10) {
+        ++count;
+    }
+    return count;
 }
+}  // namespace
+
+const int MAX_POS_LETTER_COUNT = CountLetters(Position::MAX_COLS);
+const int MAX_POS_DIGIT_COUNT = CountDigits(Position::MAX_ROWS);
+const int MAX_POSITION_LENGTH = MAX_POS_LETTER_COUNT + MAX_POS_DIGIT_COUNT;
+
+const Position Position::NONE = {-1, -1};
 
 bool Position::IsValid() const {
     return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
@@ -27,17 +43,17 @@ std::string Position::ToString() const {
         return "";
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+    // буквы столбца получаются с конца, поэтому заполняем буфер справа налево
+    char letters[MAX_POS_LETTER_COUNT];
+    char* begin = std::end(letters);
+    for (int c = col; c >= 0; c = c / LETTERS - 1) {
+        *--begin = char('A' + c % LETTERS);
     }
 
-    result += std::to_string(row + 1);
-
-    return result;
+    char result[MAX_POSITION_LENGTH];
+    char* end = std::copy(begin, std::end(letters), result);
+    end = std::to_chars(end, std::end(result), row + 1).ptr;
+    return std::string(result, end);
 }
 
 Position Position::FromString(std::string_view str) {
@@ -50,7 +66,7 @@ Position Position::FromString(std::string_view str) {
     if (letters.empty() || digits.empty()) {
         return Position::NONE;
     }
-    if (letters.size() > MAX_POS_LETTER_COUNT) {
+    if (letters.size() > MAX_POS_LETTER_COUNT || digits.size() > MAX_POS_DIGIT_COUNT) {
         return Position::NONE;
     }
 
@@ -58,21 +74,70 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     }
 
-    int row;
-    std::istringstream row_in{std::string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
+    int row = 0;
+    const auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (ec != std::errc() || ptr != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
-    int col = 0;
+    // после проверки длины номер столбца помещается в long long
+    long long col = 0;
     for (char ch : letters) {
         col *= LETTERS;
         col += ch - 'A' + 1;
     }
+    if (col > Position::MAX_COLS) {
+        return Position::NONE;
+    }
+
+    return {row - 1, int(col - 1)};
+}
+
+bool SheetPosition::operator==(const SheetPosition& rhs) const {
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
 
-    return {row - 1, col - 1};
+bool SheetPosition::operator<(const SheetPosition& rhs) const {
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
 }
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
+
+bool Rect::operator==(Rect rhs) const {
+    return top_left == rhs.top_left && size == rhs.size;
+}
+
+bool Rect::IsValid() const {
+    return top_left.IsValid() && size.rows >= 0 && size.cols >= 0
+        && size.rows <= Position::MAX_ROWS - top_left.row
+        && size.cols <= Position::MAX_COLS - top_left.col;
+}
+
+std::string Rect::ToString() const {
+    if (!IsValid() || size.rows == 0 || size.cols == 0) {
+        return "";
+    }
+    const Position bottom_right{top_left.row + size.rows - 1, top_left.col + size.cols - 1};
+    return top_left.ToString() + ':' + bottom_right.ToString();
+}
+
+bool IsFormulaCell(const CellInterface& cell) {
+    const auto text = cell.GetTextView();
+    return text.size() > 1 && text[0] == FORMULA_SIGN;
+}
+
+std::optional<double> ParseNumber(const std::string& text) {
+    if (text.empty())
+    {
+        return std::nullopt;
+    }
+    std::istringstream is_value(text);
+    double result = 0.0;
+    if (is_value >> result && is_value.eof())
+    {
+        return result;
+    }
+    return std::nullopt;
+}
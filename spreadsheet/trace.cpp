@@ -0,0 +1,300 @@
+#include "trace.h"
+
+#include <iostream>
+
+namespace {
+constexpr std::string_view TRACE_MAGIC = "SST1";
+// записи копятся в памяти и пишутся на диск пачками
+constexpr size_t FLUSH_BYTES = 64 << 10;
+
+void PutVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80)
+    {
+        out += char((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+}  // namespace
+
+std::string_view ToString(TraceOp op) {
+    switch (op)
+    {
+    case TraceOp::SetCell:
+        return "SetCell";
+    case TraceOp::ClearCell:
+        return "ClearCell";
+    case TraceOp::GetValue:
+        return "GetValue";
+    case TraceOp::GetText:
+        return "GetText";
+    case TraceOp::GetPrintableSize:
+        return "GetPrintableSize";
+    case TraceOp::PrintValues:
+        return "PrintValues";
+    case TraceOp::PrintTexts:
+        return "PrintTexts";
+    }
+    return "";
+}
+
+TraceWriter::TraceWriter(const std::string& path)
+    : file_(std::fopen(path.c_str(), "wb"))
+    , start_(std::chrono::steady_clock::now()) {
+    if (file_ == nullptr)
+    {
+        throw TraceException("cannot create trace " + path);
+    }
+    buffer_ = TRACE_MAGIC;
+}
+
+TraceWriter::~TraceWriter() {
+    try
+    {
+        Flush();
+    }
+    catch (const TraceException&)
+    {
+        // из деструктора ошибку не сообщить
+    }
+    std::fclose(file_);
+}
+
+void TraceWriter::Write(TraceOp op, Position pos, std::string_view text) {
+    // отвергнутая запись не должна оставить в буфере начало
+    if (text.size() > TRACE_MAX_TEXT)
+    {
+        throw TraceException("text too long for trace");
+    }
+    const auto offset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_);
+    buffer_ += char(op);
+    PutVarint(buffer_, uint64_t((offset - last_).count()));
+    last_ = offset;
+    switch (op)
+    {
+    case TraceOp::SetCell:
+        PutVarint(buffer_, uint32_t(pos.row));
+        PutVarint(buffer_, uint32_t(pos.col));
+        PutVarint(buffer_, text.size());
+        buffer_ += text;
+        break;
+    case TraceOp::ClearCell:
+    case TraceOp::GetValue:
+    case TraceOp::GetText:
+        PutVarint(buffer_, uint32_t(pos.row));
+        PutVarint(buffer_, uint32_t(pos.col));
+        break;
+    default:
+        break;
+    }
+    if (buffer_.size() >= FLUSH_BYTES)
+    {
+        Flush();
+    }
+}
+
+void TraceWriter::Flush() {
+    if (!buffer_.empty())
+    {
+        if (std::fwrite(buffer_.data(), 1, buffer_.size(), file_) != buffer_.size())
+        {
+            throw TraceException("trace write failed");
+        }
+        buffer_.clear();
+    }
+    if (std::fflush(file_) != 0)
+    {
+        throw TraceException("trace flush failed");
+    }
+}
+
+TraceReader::TraceReader(const std::string& path)
+    : file_(std::fopen(path.c_str(), "rb")) {
+    if (file_ == nullptr)
+    {
+        throw TraceException("cannot open trace " + path);
+    }
+    char magic[TRACE_MAGIC.size()];
+    if (std::fread(magic, 1, sizeof(magic), file_) != sizeof(magic)
+        || std::string_view(magic, sizeof(magic)) != TRACE_MAGIC)
+    {
+        std::fclose(file_);
+        throw TraceException("unknown trace format");
+    }
+}
+
+TraceReader::~TraceReader() {
+    std::fclose(file_);
+}
+
+bool TraceReader::ReadVarint(uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        const int c = std::fgetc(file_);
+        if (c == EOF)
+        {
+            return false;
+        }
+        value |= uint64_t(c & 0x7F) << shift;
+        if ((c & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::optional<TraceRecord> TraceReader::Next() {
+    const int op = std::fgetc(file_);
+    if (op == EOF)
+    {
+        return std::nullopt;
+    }
+    if (op >= TRACE_OP_COUNT)
+    {
+        throw TraceException("corrupted trace");
+    }
+    TraceRecord record;
+    record.op = TraceOp(op);
+    uint64_t delta = 0;
+    if (!ReadVarint(delta))
+    {
+        throw TraceException("truncated trace");
+    }
+    last_ += std::chrono::nanoseconds(delta);
+    record.offset = last_;
+    if (record.op == TraceOp::SetCell || record.op == TraceOp::ClearCell
+        || record.op == TraceOp::GetValue || record.op == TraceOp::GetText)
+    {
+        uint64_t row = 0;
+        uint64_t col = 0;
+        if (!ReadVarint(row) || !ReadVarint(col))
+        {
+            throw TraceException("truncated trace");
+        }
+        record.pos = {int(uint32_t(row)), int(uint32_t(col))};
+    }
+    if (record.op == TraceOp::SetCell)
+    {
+        uint64_t size = 0;
+        if (!ReadVarint(size))
+        {
+            throw TraceException("truncated trace");
+        }
+        if (size > TRACE_MAX_TEXT)
+        {
+            throw TraceException("corrupted trace");
+        }
+        record.text.resize(size);
+        if (std::fread(record.text.data(), 1, size, file_) != size)
+        {
+            throw TraceException("truncated trace");
+        }
+    }
+    return record;
+}
+
+// Посредник ячейки: записывает обращение и передаёт его ячейке таблицы,
+// которая ищется заново, так как могла быть пересоздана.
+class RecordingSheet::RecordingCell : public CellInterface {
+public:
+    RecordingCell(SheetInterface& sheet, TraceWriter& writer, Position pos)
+        : sheet_(sheet)
+        , writer_(writer)
+        , pos_(pos) {
+    }
+
+    Value GetValue() const override {
+        writer_.Write(TraceOp::GetValue, pos_);
+        const CellInterface* cell = Get();
+        return cell != nullptr ? cell->GetValue() : Value();
+    }
+
+    std::string GetText() const override {
+        writer_.Write(TraceOp::GetText, pos_);
+        const CellInterface* cell = Get();
+        return cell != nullptr ? cell->GetText() : std::string();
+    }
+
+    std::string_view GetTextView() const override {
+        writer_.Write(TraceOp::GetText, pos_);
+        const CellInterface* cell = Get();
+        return cell != nullptr ? cell->GetTextView() : std::string_view();
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        const CellInterface* cell = Get();
+        return cell != nullptr ? cell->GetReferencedCells() : std::vector<Position>();
+    }
+
+private:
+    const CellInterface* Get() const {
+        return static_cast<const SheetInterface&>(sheet_).GetCell(pos_);
+    }
+
+    SheetInterface& sheet_;
+    TraceWriter& writer_;
+    Position pos_;
+};
+
+RecordingSheet::RecordingSheet(SheetInterface& sheet, const std::string& trace_path)
+    : sheet_(sheet)
+    , writer_(trace_path) {
+}
+
+RecordingSheet::~RecordingSheet() = default;
+
+void RecordingSheet::SetCell(Position pos, std::string text) {
+    writer_.Write(TraceOp::SetCell, pos, text);
+    sheet_.SetCell(pos, std::move(text));
+}
+
+const CellInterface* RecordingSheet::GetCell(Position pos) const {
+    if (static_cast<const SheetInterface&>(sheet_).GetCell(pos) == nullptr)
+    {
+        // ячейки больше нет, и её посредник не нужен
+        cells_.erase(pos);
+        return nullptr;
+    }
+    auto& cell = cells_[pos];
+    if (cell == nullptr)
+    {
+        cell = std::make_unique<RecordingCell>(sheet_, writer_, pos);
+    }
+    return cell.get();
+}
+
+CellInterface* RecordingSheet::GetCell(Position pos) {
+    return const_cast<CellInterface*>(static_cast<const RecordingSheet&>(*this).GetCell(pos));
+}
+
+void RecordingSheet::ClearCell(Position pos) {
+    writer_.Write(TraceOp::ClearCell, pos);
+    sheet_.ClearCell(pos);
+    cells_.erase(pos);
+}
+
+Size RecordingSheet::GetPrintableSize() const {
+    writer_.Write(TraceOp::GetPrintableSize);
+    return sheet_.GetPrintableSize();
+}
+
+void RecordingSheet::PrintValues(std::ostream& output) const {
+    writer_.Write(TraceOp::PrintValues);
+    sheet_.PrintValues(output);
+}
+
+void RecordingSheet::PrintTexts(std::ostream& output) const {
+    writer_.Write(TraceOp::PrintTexts);
+    sheet_.PrintTexts(output);
+}
+
+const SheetInterface* RecordingSheet::FindSheet(std::string_view name) const {
+    return sheet_.FindSheet(name);
+}
+
+void RecordingSheet::Flush() {
+    writer_.Flush();
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Исключение, выбрасываемое при ошибке ввода-вывода или повреждении трассы
+class TraceException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Операции над таблицей, которые попадают в трассу.
+enum class TraceOp : uint8_t {
+    SetCell,
+    ClearCell,
+    GetValue,
+    GetText,
+    GetPrintableSize,
+    PrintValues,
+    PrintTexts,
+};
+
+inline constexpr int TRACE_OP_COUNT = 7;
+// Предел длины текста SetCell: длина больше него при чтении означает
+// повреждённую трассу.
+inline constexpr size_t TRACE_MAX_TEXT = 64u << 20;
+
+std::string_view ToString(TraceOp op);
+
+struct TraceRecord {
+    TraceOp op = TraceOp::SetCell;
+    // время от начала записи
+    std::chrono::nanoseconds offset{0};
+    // для операций над ячейкой
+    Position pos;
+    // для SetCell
+    std::string text;
+};
+
+// Трасса - последовательность записей после заголовка. Числа пишутся как
+// varint (по 7 бит в байте, младшие первыми), время - как приращение к
+// предыдущей записи, поэтому типичная запись занимает несколько байт.
+// Текст записи ограничен TRACE_MAX_TEXT байтами.
+class TraceWriter {
+public:
+    explicit TraceWriter(const std::string& path);
+    // Дописывает буфер на диск.
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    // Бросает TraceException, если текст длиннее TRACE_MAX_TEXT.
+    void Write(TraceOp op, Position pos = {}, std::string_view text = {});
+    void Flush();
+
+private:
+    std::FILE* file_ = nullptr;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::nanoseconds last_{0};
+};
+
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path);
+    ~TraceReader();
+
+    TraceReader(const TraceReader&) = delete;
+    TraceReader& operator=(const TraceReader&) = delete;
+
+    // Следующая запись или nullopt в конце трассы. Бросает TraceException,
+    // если трасса повреждена.
+    std::optional<TraceRecord> Next();
+
+private:
+    bool ReadVarint(uint64_t& value);
+
+    std::FILE* file_ = nullptr;
+    std::chrono::nanoseconds last_{0};
+};
+
+// Таблица-обёртка, записывающая в трассу все обращения к другой таблице:
+// изменения, печать и чтение значений и текстов ячеек. Ячейки, которые
+// возвращает GetCell, - посредники, записывающие обращения к настоящим
+// ячейкам. Как и ячейки таблицы, посредник действителен, пока его ячейка
+// не очищена: очистка через обёртку и GetCell, не нашедший ячейку,
+// освобождают посредника.
+class RecordingSheet : public SheetInterface {
+public:
+    RecordingSheet(SheetInterface& sheet, const std::string& trace_path);
+    ~RecordingSheet() override;
+
+    void SetCell(Position pos, std::string text) override;
+
+    const CellInterface* GetCell(Position pos) const override;
+    CellInterface* GetCell(Position pos) override;
+
+    void ClearCell(Position pos) override;
+
+    Size GetPrintableSize() const override;
+
+    void PrintValues(std::ostream& output) const override;
+    void PrintTexts(std::ostream& output) const override;
+
+    const SheetInterface* FindSheet(std::string_view name) const override;
+
+    // Дописывает трассу на диск.
+    void Flush();
+
+    // Число живых посредников ячеек.
+    size_t GetProxyCount() const {
+        return cells_.size();
+    }
+
+private:
+    class RecordingCell;
+
+    SheetInterface& sheet_;
+    mutable TraceWriter writer_;
+    mutable std::unordered_map<Position, std::unique_ptr<RecordingCell>> cells_;
+};
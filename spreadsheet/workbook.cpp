@@ -0,0 +1,144 @@
+#include "workbook.h"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+Workbook::~Workbook() {
+    closing_ = true;
+}
+
+Sheet& Workbook::AddSheet(std::string name) {
+    if (name.empty())
+    {
+        throw std::invalid_argument("empty sheet name");
+    }
+    auto [it, inserted] = sheets_.try_emplace(std::move(name));
+    if (!inserted)
+    {
+        throw std::invalid_argument("duplicate sheet name " + it->first);
+    }
+    it->second = std::make_unique<Sheet>(*this);
+    return *it->second;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name) {
+    const auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+const Sheet* Workbook::GetSheet(std::string_view name) const {
+    const auto it = sheets_.find(name);
+    return it != sheets_.end() ? it->second.get() : nullptr;
+}
+
+std::vector<std::string> Workbook::GetSheetNames() const {
+    std::vector<std::string> to_ret;
+    to_ret.reserve(sheets_.size());
+    for (const auto& [name, sheet] : sheets_)
+    {
+        to_ret.push_back(name);
+    }
+    return to_ret;
+}
+
+std::atomic<uint64_t>& Workbook::GetEditCounter() {
+    return edits_;
+}
+
+void Workbook::ForgetProfiled(const Cell* cell) {
+    if (closing_)
+    {
+        return;
+    }
+    for (const auto& [name, sheet] : sheets_)
+    {
+        if (Profiler* profiler = sheet->GetProfiler())
+        {
+            profiler->Forget(cell);
+        }
+    }
+}
+
+bool Workbook::Recalculate(const EvalBudget& budget) {
+    // группы связанных листов: система непересекающихся множеств
+    std::vector<Sheet*> sheets;
+    std::unordered_map<const Sheet*, size_t> index;
+    for (const auto& [name, sheet] : sheets_)
+    {
+        index[sheet.get()] = sheets.size();
+        sheets.push_back(sheet.get());
+    }
+    std::vector<size_t> parent(sheets.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&parent](size_t i) {
+        while (parent[i] != i)
+        {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+    for (size_t i = 0; i < sheets.size(); ++i)
+    {
+        for (const Sheet* linked : sheets[i]->GetLinkedSheets())
+        {
+            parent[find(i)] = find(index.at(linked));
+        }
+    }
+
+    std::unordered_map<size_t, std::vector<Sheet*>> groups;
+    for (size_t i = 0; i < sheets.size(); ++i)
+    {
+        if (sheets[i]->GetDirtyCount() > 0)
+        {
+            groups[find(i)].push_back(sheets[i]);
+        }
+    }
+    std::vector<std::vector<Sheet*>> tasks;
+    tasks.reserve(groups.size());
+    for (auto& [root, group] : groups)
+    {
+        tasks.push_back(std::move(group));
+    }
+
+    // внутри группы листы пересчитываются последовательно: вычисление
+    // формулы может затронуть ячейки других листов группы
+    std::atomic<size_t> next = 0;
+    auto worker = [&tasks, &next, &budget] {
+        const EvalBudget local = budget;
+        for (size_t task = next++; task < tasks.size(); task = next++)
+        {
+            for (Sheet* sheet : tasks[task])
+            {
+                sheet->RecalculateDirty(std::numeric_limits<size_t>::max(), local);
+            }
+        }
+    };
+    const size_t threads = std::min<size_t>(tasks.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : workers)
+    {
+        thread.join();
+    }
+    for (const auto& task : tasks)
+    {
+        for (const Sheet* sheet : task)
+        {
+            if (sheet->GetDirtyCount() > 0)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Книга из нескольких именованных листов. Формулы ссылаются на ячейки
+// других листов в виде Лист!A1, а граф зависимостей охватывает все листы,
+// поэтому правка на одном листе сбрасывает кеш только тех формул других
+// листов, которые от неё зависят.
+class Workbook {
+public:
+    Workbook() = default;
+    ~Workbook();
+    // листы хранят указатель на книгу, поэтому она не копируется и не
+    // перемещается
+    Workbook(const Workbook&) = delete;
+    Workbook& operator=(const Workbook&) = delete;
+
+    // Добавляет пустой лист. Бросает std::invalid_argument, если имя пустое
+    // или уже занято. Листы не удаляются, ссылки на них остаются
+    // действительными всё время жизни книги.
+    Sheet& AddSheet(std::string name);
+
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+
+    // Имена листов в порядке возрастания.
+    std::vector<std::string> GetSheetNames() const;
+
+    // Пересчитывает все устаревшие формулы. Листы разбиваются на группы,
+    // связанные ссылками; независимые группы пересчитываются параллельно,
+    // листы без устаревших формул не затрагиваются. Каждая группа
+    // проверяет свою копию budget; пересчёт, прерванный исчерпанным
+    // бюджетом, оставляет невычисленные формулы устаревшими. Возвращает
+    // true, если устаревших формул не осталось.
+    bool Recalculate(const EvalBudget& budget = {});
+
+    // Для листов: общий счётчик изменений ячеек, см. Sheet::CountEdit.
+    std::atomic<uint64_t>& GetEditCounter();
+    // Для листов: удаляет уничтоженную ячейку из профилей всех листов, см.
+    // Sheet::ForgetProfiled.
+    void ForgetProfiled(const Cell* cell);
+
+private:
+    std::atomic<uint64_t> edits_{0};
+    // книга уничтожается: ячейки удаляются вместе с листами и их профилями
+    bool closing_ = false;
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets_;
+};
@@ -0,0 +1,127 @@
+#include "zorder.h"
+
+namespace {
+// Раздвигает 32 бита значения в чётные биты 64-битного числа.
+uint64_t SpreadBits(uint32_t value) {
+    uint64_t x = value;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2)) & 0x3333333333333333ull;
+    x = (x | (x << 1)) & 0x5555555555555555ull;
+    return x;
+}
+
+// Обратное преобразование: собирает чётные биты в 32-битное число.
+uint32_t CompactBits(uint64_t x) {
+    x &= 0x5555555555555555ull;
+    x = (x | (x >> 1)) & 0x3333333333333333ull;
+    x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x >> 4)) & 0x00FF00FF00FF00FFull;
+    x = (x | (x >> 8)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+    return uint32_t(x);
+}
+}  // namespace
+
+uint64_t MortonEncode(Position pos) {
+    return SpreadBits(uint32_t(pos.row)) << 1 | SpreadBits(uint32_t(pos.col));
+}
+
+Position MortonDecode(uint64_t code) {
+    return {int(CompactBits(code >> 1)), int(CompactBits(code))};
+}
+
+ZOrderStore::Tile::~Tile() {
+    for (uint64_t bits = occupied; bits != 0; bits &= bits - 1)
+    {
+        int index = 0;
+        while (((bits >> index) & 1) == 0)
+        {
+            ++index;
+        }
+        At(index)->~Cell();
+    }
+}
+
+void ZOrderStore::AddMemoryUsage(SheetMemoryUsage& usage) const {
+    // узел словаря: три указателя, цвет и пара ключ-значение
+    constexpr size_t MAP_NODE_BYTES = 4 * sizeof(void*) + sizeof(uint64_t) + sizeof(std::unique_ptr<Tile>);
+    for (const auto& [key, tile] : tiles_)
+    {
+        size_t occupied = 0;
+        for (uint64_t bits = tile->occupied; bits != 0; bits &= bits - 1)
+        {
+            ++occupied;
+        }
+        size_t slots = 0;
+        for (const auto& group : tile->groups)
+        {
+            if (group != nullptr)
+            {
+                slots += GROUP;
+                usage.storage.bytes += sizeof(Tile::Group) - GROUP * sizeof(Cell);
+            }
+        }
+        const size_t free = slots - occupied;
+        ++usage.storage.objects;
+        usage.storage.bytes += MAP_NODE_BYTES + sizeof(Tile);
+        usage.storage_slack.objects += free;
+        usage.storage_slack.bytes += free * sizeof(Cell);
+    }
+}
+
+Cell* ZOrderStore::Find(Position pos) const {
+    auto it = tiles_.find(TileKey(pos));
+    if (it == tiles_.end())
+    {
+        return nullptr;
+    }
+    const int index = IndexInTile(pos);
+    if (((it->second->occupied >> index) & 1) == 0)
+    {
+        return nullptr;
+    }
+    return it->second->At(index);
+}
+
+Cell* ZOrderStore::Emplace(Position pos, Sheet& sheet) {
+    auto& tile = tiles_[TileKey(pos)];
+    if (tile == nullptr)
+    {
+        tile = std::make_unique<Tile>();
+    }
+    const int index = IndexInTile(pos);
+    auto& group = tile->groups[index / GROUP];
+    if (group == nullptr)
+    {
+        group = std::make_unique<Tile::Group>();
+    }
+    Cell* cell = new (&group->slots[index % GROUP]) Cell(sheet);
+    tile->occupied |= uint64_t(1) << index;
+    return cell;
+}
+
+void ZOrderStore::Erase(Position pos) {
+    auto it = tiles_.find(TileKey(pos));
+    if (it == tiles_.end())
+    {
+        return;
+    }
+    const int index = IndexInTile(pos);
+    if (((it->second->occupied >> index) & 1) == 0)
+    {
+        return;
+    }
+    Tile& tile = *it->second;
+    tile.At(index)->~Cell();
+    tile.occupied &= ~(uint64_t(1) << index);
+    if (tile.occupied == 0)
+    {
+        tiles_.erase(it);
+    }
+    else if (tile.GroupBits(index) == 0)
+    {
+        tile.groups[index / GROUP].reset();
+    }
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+#include "memory_usage.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Код Мортона (Z-порядок) позиции: биты строки и столбца чередуются, строка
+// занимает старший бит каждой пары. Близкие по обеим осям позиции получают
+// близкие коды.
+uint64_t MortonEncode(Position pos);
+Position MortonDecode(uint64_t code);
+
+// Хранилище ячеек в Z-порядке. Таблица делится на плитки TILE x TILE, ячейки
+// плитки лежат в порядке Мортона в группах по GROUP мест, а сами плитки
+// упорядочены по коду Мортона своих координат. Группа выделяется при
+// появлении в ней первой ячейки и освобождается вместе с последней, так
+// что у редко заполненной плитки свободных мест не больше GROUP - 1 на
+// занятую группу. Соседние по вертикали ячейки
+// оказываются рядом, а запрос прямоугольника сводится к нескольким отрезкам
+// кодов плиток.
+// Ячейки не перемещаются, пока существуют: указатели на них остаются
+// действительными до Erase.
+class ZOrderStore {
+public:
+    static constexpr int TILE_BITS = 3;
+    static constexpr int TILE = 1 << TILE_BITS;
+    // соседние коды Мортона: полоса 2 x 4 ячейки
+    static constexpr int GROUP = 8;
+
+    ZOrderStore() = default;
+    ZOrderStore(const ZOrderStore&) = delete;
+    ZOrderStore& operator=(const ZOrderStore&) = delete;
+
+    Cell* Find(Position pos) const;
+    // Создаёт пустую ячейку. Позиция должна быть свободна.
+    Cell* Emplace(Position pos, Sheet& sheet);
+    void Erase(Position pos);
+
+    // Обходит ячейки прямоугольника в Z-порядке, передавая позицию и ячейку.
+    template <typename Func>
+    void ForEachInRect(Rect rect, Func func) const;
+    // Добавляет в usage память плиток: storage - плитки и группы без
+    // занятых мест (сами ячейки учтены в usage.cells), storage_slack -
+    // свободные места выделенных групп.
+    void AddMemoryUsage(SheetMemoryUsage& usage) const;
+    // Обходит все ячейки в Z-порядке.
+    template <typename Func>
+    void ForEach(Func func) const;
+
+private:
+    struct Tile {
+        struct Group {
+            std::aligned_storage_t<sizeof(Cell), alignof(Cell)> slots[GROUP];
+        };
+
+        ~Tile();
+
+        Cell* At(int index) {
+            return std::launder(reinterpret_cast<Cell*>(&groups[index / GROUP]->slots[index % GROUP]));
+        }
+        // Занятые места группы, в которую попадает index.
+        uint64_t GroupBits(int index) const {
+            return (occupied >> (index / GROUP * GROUP)) & ((uint64_t(1) << GROUP) - 1);
+        }
+
+        // занятые ячейки плитки, бит на ячейку
+        uint64_t occupied = 0;
+        // группы мест, nullptr у группы без ячеек
+        std::unique_ptr<Group> groups[TILE * TILE / GROUP];
+    };
+
+    static uint64_t TileKey(Position pos) {
+        return MortonEncode({pos.row >> TILE_BITS, pos.col >> TILE_BITS});
+    }
+    static int IndexInTile(Position pos) {
+        return int(MortonEncode({pos.row & (TILE - 1), pos.col & (TILE - 1)}));
+    }
+
+    template <typename Func>
+    static void ForEachInTile(uint64_t key, Tile& tile, const Rect& rect, Func& func);
+
+    std::map<uint64_t, std::unique_ptr<Tile>> tiles_;
+};
+
+template <typename Func>
+void ZOrderStore::ForEachInTile(uint64_t key, Tile& tile, const Rect& rect, Func& func) {
+    const Position origin = MortonDecode(key);
+    for (uint64_t bits = tile.occupied; bits != 0; bits &= bits - 1)
+    {
+        int index = 0;
+        while (((bits >> index) & 1) == 0)
+        {
+            ++index;
+        }
+        const Position offset = MortonDecode(uint64_t(index));
+        const Position pos{(origin.row << TILE_BITS) + offset.row,
+                           (origin.col << TILE_BITS) + offset.col};
+        if (pos.row >= rect.top_left.row && pos.row < rect.top_left.row + rect.size.rows
+            && pos.col >= rect.top_left.col && pos.col < rect.top_left.col + rect.size.cols)
+        {
+            func(pos, *tile.At(index));
+        }
+    }
+}
+
+template <typename Func>
+void ZOrderStore::ForEachInRect(Rect rect, Func func) const {
+    if (rect.size.rows <= 0 || rect.size.cols <= 0 || tiles_.empty())
+    {
+        return;
+    }
+    // прямоугольник в координатах плиток
+    const int row_begin = rect.top_left.row >> TILE_BITS;
+    const int row_last = (rect.top_left.row + rect.size.rows - 1) >> TILE_BITS;
+    const int col_begin = rect.top_left.col >> TILE_BITS;
+    const int col_last = (rect.top_left.col + rect.size.cols - 1) >> TILE_BITS;
+
+    // Квадранты пространства кодов: квадрант уровня level со стороной
+    // 2^level плиток занимает отрезок из 4^level подряд идущих кодов.
+    // Квадрант целиком внутри прямоугольника обходится одним отрезком,
+    // пересекающий границу делится на четыре, пустые отбрасываются по
+    // поиску в tiles_.
+    struct Quad {
+        int row;
+        int col;
+        int level;
+    };
+    int level = 0;
+    while ((1 << level) <= std::max(row_last, col_last))
+    {
+        ++level;
+    }
+    std::vector<Quad> stack{{0, 0, level}};
+    while (!stack.empty())
+    {
+        const Quad quad = stack.back();
+        stack.pop_back();
+        const int side = 1 << quad.level;
+        if (quad.row > row_last || quad.row + side <= row_begin
+            || quad.col > col_last || quad.col + side <= col_begin)
+        {
+            continue;
+        }
+        const uint64_t first = MortonEncode({quad.row, quad.col});
+        const uint64_t last = first + (uint64_t(1) << (2 * quad.level)) - 1;
+        auto it = tiles_.lower_bound(first);
+        if (it == tiles_.end() || it->first > last)
+        {
+            continue;
+        }
+        const bool inside = quad.row >= row_begin && quad.row + side - 1 <= row_last
+            && quad.col >= col_begin && quad.col + side - 1 <= col_last;
+        if (inside)
+        {
+            for (; it != tiles_.end() && it->first <= last; ++it)
+            {
+                ForEachInTile(it->first, *it->second, rect, func);
+            }
+            continue;
+        }
+        // дети кладутся в обратном Z-порядке, чтобы обходиться в прямом
+        const int half = side / 2;
+        stack.push_back({quad.row + half, quad.col + half, quad.level - 1});
+        stack.push_back({quad.row + half, quad.col, quad.level - 1});
+        stack.push_back({quad.row, quad.col + half, quad.level - 1});
+        stack.push_back({quad.row, quad.col, quad.level - 1});
+    }
+}
+
+template <typename Func>
+void ZOrderStore::ForEach(Func func) const {
+    const Rect all{{0, 0}, {Position::MAX_ROWS, Position::MAX_COLS}};
+    for (const auto& [key, tile] : tiles_)
+    {
+        ForEachInTile(key, *tile, all, func);
+    }
+}